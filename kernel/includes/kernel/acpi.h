@@ -4,6 +4,7 @@
 #include <multiboot/multiboot2.h>
 
 #define RSDP_SIGNATURE "RSD PTR "
+#define MADT_SIGNATURE "APIC"
 
 typedef enum {
 	RSDP_INVALID,
@@ -45,4 +46,63 @@ typedef struct root_system_descriptor_pointer_v2 {
 	uint8_t  reserved[3];
 } RSDPv2;
 
-void acpi_init(struct multiboot_tag_new_acpi *acpi_tag);
\ No newline at end of file
+/**
+ * Multiple APIC Description Table, describes the local APICs, I/O APICs
+ * and how ISA IRQs are wired to them
+ */
+#define MADT_FLAG_PCAT_COMPAT 0x01 // Also has dual 8259 PICs
+
+typedef struct {
+	SDT_Header header;
+	uint32_t   local_apic_address;
+	uint32_t   flags;
+	uint8_t    entries[0];
+} MADT;
+
+typedef enum {
+	MADT_LOCAL_APIC         = 0,
+	MADT_IO_APIC            = 1,
+	MADT_INTERRUPT_OVERRIDE = 2,
+	MADT_LOCAL_APIC_NMI     = 4,
+} MADT_ENTRY_TYPE;
+
+typedef struct {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed)) MADT_Entry_Header;
+
+#define MADT_LOCAL_APIC_ENABLED 0x01
+
+typedef struct {
+	MADT_Entry_Header header;
+	uint8_t  processor_id;
+	uint8_t  apic_id;
+	uint32_t flags;
+} __attribute__((packed)) MADT_Local_APIC_Entry;
+
+typedef struct {
+	MADT_Entry_Header header;
+	uint8_t  io_apic_id;
+	uint8_t  reserved;
+	uint32_t address;
+	uint32_t gsi_base;
+} __attribute__((packed)) MADT_IO_APIC_Entry;
+
+// Interrupt override flags (also used by MPS INTI flags)
+#define MADT_POLARITY_MASK       0x03
+#define MADT_POLARITY_ACTIVE_LOW 0x03
+#define MADT_TRIGGER_MASK        0x0C
+#define MADT_TRIGGER_LEVEL       0x0C
+
+typedef struct {
+	MADT_Entry_Header header;
+	uint8_t  bus;
+	uint8_t  source;
+	uint32_t gsi;
+	uint16_t flags;
+} __attribute__((packed)) MADT_Interrupt_Override_Entry;
+
+void acpi_init(struct multiboot_tag_new_acpi *acpi_tag);
+
+SDT_Header *acpi_find_table(const char *signature);
+MADT *acpi_get_madt();
\ No newline at end of file
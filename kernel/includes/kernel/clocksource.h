@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#define NSEC_PER_SEC  1000000000
+#define NSEC_PER_MSEC 1000000
+
+// Length of one TSC calibration run against PIT channel 2
+#define CLOCKSOURCE_CALIBRATION_MS   10
+#define CLOCKSOURCE_CALIBRATION_RUNS 3
+
+/**
+ * @brief      A free running counter used to tell time
+ *
+ * Counter values are converted to nanoseconds with ns = (cycles * mult) >> shift.
+ */
+struct clocksource {
+	const char *name;
+
+	uint64_t (*read)();
+
+	uint32_t mult;
+	uint32_t shift;
+
+	uint32_t frequency_khz;
+
+	/* Keeps counting while the timer interrupt is stopped */
+	bool continuous;
+};
+
+void clocksource_init();
+
+const struct clocksource *clocksource_get();
+
+uint64_t clocksource_read_ns();
+uint64_t clocksource_cycles_to_ns(uint64_t cycles);
+
+uint32_t clocksource_calibrate(uint64_t (*read)());
+void clocksource_calculate_mult_shift(uint32_t *mult, uint32_t *shift, uint32_t from, uint32_t to);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <i686/isr.h>
+
+/**
+ * @brief      Work queued from an interrupt handler to run later with interrupts enabled
+ */
+struct deferred_work {
+	struct deferred_work *next;
+
+	void (*function)(void *data);
+	void *data;
+
+	/* Queued and not yet started, queueing again does nothing */
+	bool pending;
+};
+
+#define DEFERRED_WORK_INITIALIZER(function, data) {NULL, (function), (data), false}
+
+/**
+ * @brief      FIFO of deferred work
+ */
+struct deferred_list {
+	struct deferred_work *head;
+	struct deferred_work *tail;
+};
+
+void deferred_init();
+void deferred_work_init(struct deferred_work *work, void (*function)(void *data), void *data);
+
+bool deferred_queue(struct deferred_work *work);
+bool deferred_queue_worker(struct deferred_work *work);
+
+bool deferred_running();
+void deferred_interrupt_exit(struct isr_arguments *args);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <timer.h>
+
+#define APIC_BASE_MSR          0x1B
+#define APIC_BASE_MSR_ENABLE   (1 << 11)
+#define APIC_BASE_ADDRESS_MASK 0xFFFFF000
+
+#define TSC_DEADLINE_MSR       0x6E0
+
+/**
+ * @brief      Local APIC register offsets
+ */
+enum apic_registers {
+	APIC_REGISTER_ID            = 0x020,
+	APIC_REGISTER_VERSION       = 0x030,
+	APIC_REGISTER_TPR           = 0x080,
+	APIC_REGISTER_EOI           = 0x0B0,
+	APIC_REGISTER_SPURIOUS      = 0x0F0,
+	APIC_REGISTER_ICR_LOW       = 0x300,
+	APIC_REGISTER_ICR_HIGH      = 0x310,
+	APIC_REGISTER_LVT_TIMER     = 0x320,
+	APIC_REGISTER_TIMER_INITIAL = 0x380,
+	APIC_REGISTER_TIMER_CURRENT = 0x390,
+	APIC_REGISTER_TIMER_DIVIDE  = 0x3E0,
+};
+
+#define APIC_SPURIOUS_ENABLE    (1 << 8)
+#define APIC_LVT_MASKED         (1 << 16)
+
+#define APIC_TIMER_ONESHOT      (0 << 17)
+#define APIC_TIMER_PERIODIC     (1 << 17)
+#define APIC_TIMER_TSC_DEADLINE (2 << 17)
+#define APIC_TIMER_MODE_MASK    (3 << 17)
+
+#define APIC_TIMER_DIVIDE_16    0x3
+
+// Interrupt command register, the low half holds the vector (or startup page) and these
+#define APIC_ICR_FIXED              (0 << 8)
+#define APIC_ICR_INIT               (5 << 8)
+#define APIC_ICR_STARTUP            (6 << 8)
+#define APIC_ICR_SEND_PENDING       (1 << 12)
+#define APIC_ICR_LEVEL_ASSERT       (1 << 14)
+#define APIC_ICR_LEVEL_TRIGGERED    (1 << 15)
+#define APIC_ICR_DESTINATION_SHIFT  24
+
+// Message signalled interrupts are writes to this range, with the destination APIC ID in the address
+#define APIC_MSI_ADDRESS           0xFEE00000
+#define APIC_MSI_DESTINATION_SHIFT 12
+
+bool apic_init();
+void apic_init_cpu();
+bool apic_is_enabled();
+
+uint32_t apic_read(uint32_t reg);
+void apic_write(uint32_t reg, uint32_t value);
+
+void apic_eoi();
+uint8_t apic_id();
+
+void apic_send_ipi(uint8_t destination, uint32_t command);
+
+struct timer_event_source *apic_timer_init();
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#define CPUID_LEAF_FEATURES          0x01
+#define CPUID_LEAF_EXTENDED_MAX      0x80000000
+#define CPUID_LEAF_EXTENDED_POWER    0x80000007
+
+/* CPUID_LEAF_FEATURES, EDX */
+#define CPUID_FEATURE_EDX_TSC        (1 << 4)
+#define CPUID_FEATURE_EDX_MSR        (1 << 5)
+#define CPUID_FEATURE_EDX_APIC       (1 << 9)
+
+/* CPUID_LEAF_FEATURES, ECX */
+#define CPUID_FEATURE_ECX_TSC_DEADLINE (1 << 24)
+
+/* CPUID_LEAF_EXTENDED_POWER, EDX */
+#define CPUID_POWER_EDX_INVARIANT_TSC (1 << 8)
+
+/**
+ * @brief      Registers returned by the CPUID instruction
+ */
+struct cpuid_registers {
+	uint32_t eax, ebx, ecx, edx;
+};
+
+void cpuid(uint32_t leaf, struct cpuid_registers *registers);
+
+uint64_t rdtsc();
+
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
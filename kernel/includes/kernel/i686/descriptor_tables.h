@@ -32,6 +32,10 @@ struct task_state_segment_s {
    uint16_t iomap_base;
 } __attribute__((packed));
 
+// First TSS descriptor, each CPU has its own after it
+#define GDT_TSS_INDEX    5
+#define GDT_TSS_SELECTOR (GDT_TSS_INDEX * 8)
+
 enum gdt_access_bits {
   GDT_ACCESSED             = 0x01,
   GDT_READ_WRITE           = 0x02,
@@ -122,9 +126,21 @@ enum {
    IRQ14,
    IRQ15,
 };
+enum {
+   IRQ_DEVICE_FIRST = 48,  // Assigned to I/O APIC lines by irq_allocate_vector()
+   IRQ_DEVICE_LAST  = 111,
+};
+enum {
+   APIC_TIMER          = 240,
+   APIC_IPI_RESCHEDULE = 241,
+   APIC_SPURIOUS       = 255,
+};
 
 extern void gdt_flush(uint32_t address);
 extern void idt_flush(uint32_t address);
-extern void tss_flush();
+extern void tss_flush(uint32_t selector);
+
+void descriptor_tables_init();
+void descriptor_tables_init_cpu(uint32_t cpu);
 
-void descriptor_tables_init();
\ No newline at end of file
+void tss_set_kernel_stack(uint32_t esp0);
\ No newline at end of file
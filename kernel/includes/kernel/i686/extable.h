@@ -0,0 +1,20 @@
+#pragma once
+
+#include <i686/isr.h>
+#include <stddef.h>
+
+/**
+ * @brief      Maps an instruction that is allowed to fault to the code that handles the fault
+ *
+ * Entries are emitted into the __ex_table section by assembly routines that
+ * touch memory which may not be mapped (ie. user buffers).
+ */
+struct exception_table_entry {
+	uintptr_t instruction;
+	uintptr_t fixup;
+};
+
+void extable_init();
+
+uintptr_t extable_search(uintptr_t instruction);
+bool extable_fixup(struct isr_arguments *args);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <i686/isr.h>
+
+// Bucket N counts handler runs taking [2^N, 2^(N+1)) cycles, the last one everything above
+#define INTERRUPT_STATS_BUCKETS 32
+
+/**
+ * @brief      Statistics kept for each interrupt vector
+ */
+struct interrupt_stats {
+	uint32_t count;      // Times the handler ran
+	uint32_t switched;   // Runs that switched process, not timed
+	uint64_t cycles;     // TSC cycles spent in the handler
+	uint32_t max_cycles;
+	uint32_t histogram[INTERRUPT_STATS_BUCKETS];
+};
+
+void interrupt_stats_init();
+
+void interrupt_stats_account(struct isr_arguments *args, uint32_t start_low, uint32_t start_high,
+	uint32_t switch_count);
+
+bool interrupt_stats_get(uint8_t vector, struct interrupt_stats *stats);
+void interrupt_stats_reset();
+void interrupt_stats_dump();
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <acpi.h>
+#include <stddef.h>
+
+#define IOAPIC_MAX_NUMBER 8
+
+// Register select and data window, every other register is reached through these
+#define IOAPIC_REGISTER_SELECT 0x00
+#define IOAPIC_REGISTER_WINDOW 0x10
+
+#define IOAPIC_ID           0x00
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_REDIRECTION  0x10 // Two registers per line, low dword first
+
+// Redirection entry (low dword)
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+// Redirection entry (high dword)
+#define IOAPIC_DESTINATION_SHIFT 24
+
+#define IOAPIC_ISA_IRQS 16
+
+bool ioapic_init(MADT *madt);
+
+bool ioapic_isa_to_gsi(uint8_t irq, uint32_t *gsi);
+bool ioapic_vector_to_gsi(uint8_t vector, uint32_t *gsi);
+
+bool ioapic_set_entry(uint32_t gsi, uint8_t vector, uint32_t flags);
+void ioapic_mask(uint32_t gsi);
+void ioapic_unmask(uint32_t gsi);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+void irq_controller_init();
+bool irq_using_ioapic();
+
+void enable_irq(uint8_t irq);
+void disable_irq(uint8_t irq);
+
+bool irq_mask_vector(uint8_t vector);
+void irq_unmask_vector(uint8_t vector);
+
+void irq_acknowledge(uint8_t vector);
+
+uint8_t irq_allocate_vector();
+uint8_t irq_allocate_vectors(uint32_t count);
+void irq_free_vector(uint8_t vector);
+void irq_free_vectors(uint8_t vector, uint32_t count);
@@ -4,6 +4,9 @@
 
 #define MAX_ISR_NUMBER 256
 
+#define EFLAGS_RESERVED       (1 << 1) // Always set
+#define EFLAGS_INTERRUPT_FLAG (1 << 9)
+
 #define SYNC_CLI() do {asm volatile("cli");} while(0);
 #define SYNC_STI() do {asm volatile("sti");} while (0);
 
@@ -24,6 +27,7 @@ uint32_t irq_get_sync_depth();
 void irq_disable();
 void irq_resume();
 void irq_enable();
+void irq_enable_halt();
 
 void install_interrupt_handler(uint8_t interrupt_number, void (*handler)(struct isr_arguments*));
 
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * 64 bit arithmetic helpers. The kernel is not linked against libgcc, so
+ * 64 bit division has to be built from the 64/32 bit DIVL instruction.
+ */
+
+/**
+ * @brief      Divide a 64 bit number by a 32 bit number
+ *
+ * @param[in]  dividend   The dividend
+ * @param[in]  divisor    The divisor, cannot be 0
+ * @param      remainder  Set to the remainder if not NULL
+ *
+ * @return     The quotient
+ */
+static inline uint64_t div_u64_u32(uint64_t dividend, uint32_t divisor, uint32_t *remainder)
+{
+	uint32_t high, low, quotient_high, quotient_low, rest;
+
+	high = (uint32_t)(dividend >> 32);
+	low  = (uint32_t)dividend;
+
+	// Divide the high half first so DIVL cannot overflow
+	quotient_high = high / divisor;
+	rest          = high % divisor;
+
+	asm("divl %4"
+		: "=a"(quotient_low), "=d"(rest)
+		: "a"(low), "d"(rest), "rm"(divisor));
+
+	if(remainder)
+		*remainder = rest;
+
+	return ((uint64_t)quotient_high << 32) | quotient_low;
+}
+
+/**
+ * @brief      Calculate (value * multiplier) >> shift without overflowing the intermediate product
+ *
+ * @param[in]  value       The value
+ * @param[in]  multiplier  The multiplier
+ * @param[in]  shift       The shift, at most 32
+ *
+ * @return     The result
+ */
+static inline uint64_t mul_u64_u32_shr(uint64_t value, uint32_t multiplier, uint32_t shift)
+{
+	uint64_t result;
+	uint32_t high;
+
+	result = ((uint64_t)(uint32_t)value * multiplier) >> shift;
+
+	high = (uint32_t)(value >> 32);
+	if(high)
+		result += ((uint64_t)high * multiplier) << (32 - shift);
+
+	return result;
+}
@@ -26,5 +26,8 @@
 
 void pic_init();
 
-void enable_irq(uint8_t irq);
-void disable_irq(uint8_t irq);
\ No newline at end of file
+void pic_disable();
+
+void pic_enable_irq(uint8_t irq);
+void pic_disable_irq(uint8_t irq);
+void pic_eoi(uint8_t irq);
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <i686/descriptor_tables.h>
+
+#define SMP_MAX_CPUS 16
+
+/**
+ * Set of CPUs, bit N for CPU N
+ */
+typedef uint32_t cpu_mask_t;
+_Static_assert(SMP_MAX_CPUS <= 32, "CPU mask must fit in 32 bits");
+
+#define CPU_MASK(cpu) ((cpu_mask_t)1 << (cpu))
+#define CPU_MASK_ALL  ((cpu_mask_t)-1)
+
+// Page the AP startup code is copied to (and identity mapped at), below 1MiB for the startup IPI
+#define SMP_TRAMPOLINE_ADDRESS 0x8000
+
+// How long an AP gets to come online before it is given up on
+#define SMP_AP_TIMEOUT_MS 100
+
+// Per-CPU data segments, one for each CPU after the TSS descriptors. Update interrupt.S if modified.
+#define GDT_PERCPU_INDEX          (GDT_TSS_INDEX + SMP_MAX_CPUS)
+#define GDT_PERCPU_SELECTOR(cpu)  ((GDT_PERCPU_INDEX + (cpu)) * sizeof(struct gdt_entry_s))
+
+struct process_control_block;
+
+/**
+ * @brief      State kept for each CPU. Each CPU has a data segment covering its own
+ *              struct cpu loaded in %gs, so its fields are read with a single
+ *              %gs relative load through this_cpu_read() without knowing the CPU index.
+ */
+struct cpu {
+	/* Update interrupt.S if modified */
+	struct cpu *self;
+
+	/* Nesting count of irq_disable(), also incremented by the interrupt stubs */
+	volatile uint32_t sync_depth;
+
+	/* Context switches done by this CPU */
+	uint32_t switch_count;
+	/* Can modify below this point freely */
+
+	/* Process running on this CPU */
+	struct process_control_block *process;
+
+	uint32_t id;
+	uint8_t  apic_id;
+
+	/* Set once the CPU has an idle process and takes processes from its run queue */
+	volatile bool online;
+
+	/* Stack an AP starts on, kept as the stack of its idle process */
+	void *stack;
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[SMP_MAX_CPUS];
+
+/**
+ * @brief      Read a field of the struct cpu of this CPU. Only for 32-bit fields.
+ */
+#define this_cpu_read(field) ({                                                             \
+	typeof(((struct cpu*)0)->field) __value;                                                \
+	_Static_assert(sizeof(__value) == 4, "this_cpu_read() only handles 32-bit fields");     \
+	asm volatile("movl %%gs:%c1, %0"                                                        \
+		: "=r"(__value) : "i"(__builtin_offsetof(struct cpu, field)));                      \
+	__value;                                                                                \
+})
+
+/**
+ * @brief      Write a field of the struct cpu of this CPU. Only for 32-bit fields.
+ */
+#define this_cpu_write(field, value) do {                                                   \
+	typeof(((struct cpu*)0)->field) __value = (value);                                      \
+	_Static_assert(sizeof(__value) == 4, "this_cpu_write() only handles 32-bit fields");    \
+	asm volatile("movl %0, %%gs:%c1"                                                        \
+		:: "ri"(__value), "i"(__builtin_offsetof(struct cpu, field)) : "memory");           \
+} while(0)
+
+/**
+ * @brief      Increment a 32-bit field of the struct cpu of this CPU. A single instruction, so an
+ *              interrupt on this CPU sees it either before or after.
+ */
+#define this_cpu_inc(field)                                                                 \
+	asm volatile("incl %%gs:%c0" :: "i"(__builtin_offsetof(struct cpu, field)) : "memory")
+
+/**
+ * @brief      Get the index of the CPU running this code
+ *
+ * @return     The CPU index
+ */
+static inline uint32_t cpu_id()
+{
+	return this_cpu_read(id);
+}
+
+/**
+ * @brief      Get the state of the CPU running this code
+ */
+static inline struct cpu *cpu_current()
+{
+	return this_cpu_read(self);
+}
+
+void smp_init();
+
+uint32_t smp_number_of_cpus();
+bool smp_cpu_online(uint32_t cpu);
+cpu_mask_t smp_online_mask();
+
+void smp_reschedule(uint32_t cpu);
+
+void smp_ap_entry();
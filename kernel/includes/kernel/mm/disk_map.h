@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <multitasking/process.h>
+
+#define DISK_MAP_MAX_REGIONS 32
+
+/**
+ * @brief      A range of a disk mapped into the address space of a process
+ *
+ * Pages are read in from the disk on first access (page fault) and written
+ * back when dirty on disk_sync() or disk_unmap().
+ */
+struct disk_map_region {
+	pid_t pid;
+
+	uint32_t disk_number;
+	uint32_t disk_offset;
+
+	uintptr_t virtual_address;
+	size_t length;
+
+	uint32_t page_flags;
+
+	bool in_use;
+};
+
+/**
+ * @brief      Outcome of a page fault on an address that may be disk mapped
+ */
+typedef enum {
+	DISK_MAP_FAULT_NOT_MAPPED, // Not part of a disk mapping
+	DISK_MAP_FAULT_LOADED,     // Page read in from the disk
+	DISK_MAP_FAULT_READ_ERROR, // Page could not be read, left unmapped
+} disk_map_fault_t;
+
+void disk_map_init();
+
+bool disk_map(uint32_t disk_number, uint32_t disk_offset, size_t length,
+	void *virtual_address, uint32_t page_flags);
+bool disk_unmap(void *virtual_address);
+bool disk_sync(void *virtual_address);
+
+void disk_map_release_current();
+
+disk_map_fault_t disk_map_fault(void *fault_address);
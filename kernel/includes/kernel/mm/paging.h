@@ -18,6 +18,14 @@
 #define REFLECTED_PAGE_DIRECTORY_ADDRESS  0xFFFFF000
 #define REFLECTED_PAGE_DIRECTORY_ENTRY    1023
 
+// Windows used to edit page directories/tables that are not currently loaded (just below the VGA buffer)
+#define PAGING_TEMPORARY_TABLE_ADDRESS    0xC07FD000
+#define PAGING_TEMPORARY_PAGE_ADDRESS     0xC07FE000
+
+// Window for memory mapped device registers (just below the temporary windows)
+#define PAGING_MMIO_BASE_ADDRESS          0xC0780000
+#define PAGING_MMIO_END_ADDRESS           PAGING_TEMPORARY_TABLE_ADDRESS
+
 /**
  * @brief      Flags for setting permissions on page directory/table entries
  */
@@ -53,15 +61,31 @@ void paging_init();
 void * paging_directory_address();
 
 void * paging_virtual_to_physical(void *virtual_address);
+bool paging_is_present(void *virtual_address);
+
+uint32_t paging_get_page_flags(void *virtual_address);
+bool paging_set_page_flags(void *virtual_address, uint32_t page_flags);
 
 bool paging_map(void *virtual_address, uint32_t flags, uint32_t mapping_flags);
 bool paging_map2(void *physical_address, void *virtual_address, uint32_t page_flags, uint32_t mapping_flags);
 
 bool paging_unmap(void *virtual_address);
 
+void * paging_map_mmio(uintptr_t physical_address, size_t length);
+
 void * paging_clone_directory(void *directory_physical, uint32_t clone_flags);
+void paging_destroy_directory(uint32_t *paging_directory_virtual);
 bool paging_create_page_table(void *virtual_address, uint32_t page_flags, uint32_t *paging_directory_virtual);
 
+bool paging_map_foreign(uint32_t *paging_directory_virtual, void *physical_address,
+	void *virtual_address, uint32_t page_flags, uint32_t mapping_flags);
+uintptr_t paging_unmap_foreign(uint32_t *paging_directory_virtual, void *virtual_address);
+void * paging_virtual_to_physical_foreign(uint32_t *paging_directory_virtual, void *virtual_address);
+bool paging_copy_to_foreign(uint32_t *paging_directory_virtual, void *virtual_address,
+	const void *buffer, size_t length);
+void paging_copy_from_physical(void *buffer, uintptr_t physical_address, size_t length);
+void paging_wipe_physical(uintptr_t physical_address);
+
 void paging_switch_directory(uint32_t * page_dir, uint32_t phys);
 
 void page_fault_handler(struct isr_arguments *args);
\ No newline at end of file
@@ -10,5 +10,6 @@ void palloc_init2(uintptr_t low_address, struct multiboot_tag_mmap *mb_mmap);
 
 uintptr_t palloc_physical();
 void palloc_release(uintptr_t address);
+bool palloc_reference(uintptr_t address);
 
 void palloc_mark_inuse(uintptr_t address);
\ No newline at end of file
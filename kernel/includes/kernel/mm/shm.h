@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+#define SHM_MAX_REGIONS 64
+
+#define SHM_INVALID_ID ((int32_t)-1)
+
+/**
+ * @brief      Where a region is mapped, so the mapping can be forgotten when its page directory is destroyed
+ */
+struct shm_mapping {
+	struct shm_mapping *next;
+
+	// Physical address of the page directory, and the virtual address in it
+	uintptr_t directory;
+	void *address;
+};
+
+/**
+ * @brief      A region of physical pages that can be mapped into multiple page directories
+ */
+struct shm_region {
+	uintptr_t *frames;
+	size_t number_of_pages;
+
+	// Number of virtual mappings currently using the region, and where they are
+	uint32_t mappings;
+	struct shm_mapping *mapping_list;
+
+	bool in_use;
+	bool destroyed;
+};
+
+void shm_init();
+
+int32_t shm_create(size_t size);
+bool shm_destroy(int32_t id);
+
+bool shm_map(int32_t id, void *virtual_address, uint32_t page_flags);
+bool shm_unmap(int32_t id, void *virtual_address);
+
+void shm_release_directory(void *paging_directory_virtual);
+
+size_t shm_size(int32_t id);
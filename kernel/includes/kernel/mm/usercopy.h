@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+bool user_access_ok(const void *address, size_t length);
+
+size_t copy_to_user(void *to, const void *from, size_t n);
+size_t copy_from_user(void *to, const void *from, size_t n);
+
+size_t copy_user_unchecked(void *to, const void *from, size_t n);
@@ -12,4 +12,5 @@
 #define ELF_PAGES (GET_PAGE_DIR_INDEX(ELF_USER_STACK_BASE_ADDRESS - ELF_USER_CODE_BASE_ADDRESS - 1))
 
 void elf_load();
+bool elf_setup_image(process_t process);
 void elf_setup_stack(process_t process);
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <multitasking/process.h>
+#include <multitasking/wait_queue.h>
+
+/**
+ * Longest chain of owners a priority is passed along (A waits on a mutex held
+ * by B, which waits on a mutex held by C, ...). Also stops a deadlock cycle.
+ */
+#define MUTEX_MAX_INHERITANCE_DEPTH 8
+
+/**
+ * @brief      Sleeping lock with a single owner. Processes waiting for it lend their priority to the owner.
+ */
+typedef struct mutex {
+	/* Process holding the mutex, NULL if free */
+	process_t owner;
+
+	/* Processes waiting for the mutex */
+	wait_queue_t wait;
+
+	/* Highest effective priority waiting, PRIORITY_NUMBER_OF_PRIORITIES if none */
+	priority_t waiter_priority;
+
+	/* Next mutex held by the same owner */
+	struct mutex *next_held;
+} mutex_t;
+
+#define MUTEX_INITIALIZER {NULL, WAIT_QUEUE_INITIALIZER, PRIORITY_NUMBER_OF_PRIORITIES, NULL}
+
+void mutex_init(mutex_t *mutex);
+
+void mutex_lock(mutex_t *mutex);
+bool mutex_trylock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
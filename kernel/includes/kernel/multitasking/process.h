@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <macros.h>
+#include <i686/smp.h>
 
 /**
  * @brief      Flags for creation of a new process
@@ -9,8 +10,12 @@
 enum process_creation_flags {
 	KERNEL_MODE     = 0x01,
 	COPY_SYNC_DEPTH = 0x02,
+	KERNEL_THREAD   = 0x04, // Runs a kernel function in the kernel page directory
+	FAIR_SCHEDULING = 0x08, // Shares the CPU by weight (from its priority) with other fair processes, see scheduler.c
 };
 
+#define KERNEL_THREAD_STACK_SIZE (4096 * 2)
+
 /**
  * @brief      Priorities for a given process
  */
@@ -22,12 +27,25 @@ typedef enum {
 		PRIORITY_NUMBER_OF_PRIORITIES
 } priority_t;
 
+/**
+ * @brief      Scheduling state of a process
+ */
+typedef enum {
+		PROCESS_RUNNABLE, // In a run queue
+		PROCESS_BLOCKED,  // Waiting on a wait queue
+		PROCESS_SLEEPING, // Waiting for a timer tick
+		PROCESS_ZOMBIE,   // Exited, waiting to be reaped
+} process_state_t;
+
 /**
  * Typedef for the PID of a process
  */
 typedef uint16_t pid_t;
 #define MAX_PROCESS_PID ((1 << (sizeof(pid_t) * 8)) - 1)
 
+struct mutex;
+struct scheduler_process;
+
 /**
  * @brief      Register information for a process.
  * 
@@ -54,25 +72,90 @@ struct process_control_block {
 	
 	priority_t priority;
 	pid_t pid;
+
+	process_state_t state;
+	int32_t exit_status;
+
+	/* CPUs the process may run on, changed with process_set_affinity() */
+	cpu_mask_t affinity;
+
+	/* Running on a CPU, or still being switched away from. Its registers are only valid once cleared. */
+	volatile bool on_cpu;
+
+	/* Run queue entry, owned by the scheduler. NULL until added and once removed. */
+	struct scheduler_process *scheduler_entry;
+
+	/* Next process on the same wait queue or sleep list (only valid for PROCESS_BLOCKED and PROCESS_SLEEPING) */
+	struct process_control_block *wait_next;
+
+	/* Timer tick to wake up on (only valid for PROCESS_SLEEPING) */
+	uint32_t wake_tick;
+
+	/**
+	 * Highest priority of the processes waiting on a mutex this process holds, or
+	 * PRIORITY_NUMBER_OF_PRIORITIES if none. It runs at that priority if it is above its own.
+	 */
+	priority_t inherited_priority;
+
+	/* Mutexes held, and the mutex waited for. Only changed with the priority inheritance lock held (see mutex.c). */
+	struct mutex *held_mutexes;
+	struct mutex *blocked_on;
+
+	/* Next process waiting to be reaped (only valid for PROCESS_ZOMBIE) */
+	struct process_control_block *next_zombie;
+
+	/* Function run by a kernel thread, and its stack (only valid for KERNEL_THREAD) */
+	void (*thread_entry)(void *data);
+	void *thread_data;
+	void *kernel_stack;
 } __attribute__((packed));
 
 typedef struct process_control_block* process_t;
 
 /**
- * @brief      Holds a pointer to the currently running process
+ * @brief      Get the priority a process is scheduled at, its own or an inherited higher one. A FAIR_SCHEDULING
+ *              process is below every priority (PRIORITY_NUMBER_OF_PRIORITIES) unless it inherited one, its own
+ *              priority only weighs its share of the CPU.
  */
-extern process_t current_process;
+static inline priority_t process_effective_priority(process_t process)
+{
+	if(process->creation_flags & FAIR_SCHEDULING)
+		return process->inherited_priority;
+
+	return process->inherited_priority < process->priority ? process->inherited_priority : process->priority;
+}
+
+/**
+ * @brief      The process running on this CPU, a single load from the per-CPU data
+ */
+#define current_process this_cpu_read(process)
 
 void process_init();
 
-process_t process_create(uint32_t creation_flags, priority_t priority);
+process_t process_create(uint32_t creation_flags, priority_t priority, cpu_mask_t affinity);
 process_t process_create2(uint32_t eflags,
 	void *pagedir_virtual, uint32_t creation_flags,
-	priority_t priority);
+	priority_t priority, cpu_mask_t affinity);
+process_t process_create_kernel_thread(void (*entry)(void *data), void *data, priority_t priority,
+	cpu_mask_t affinity);
+
+bool process_set_affinity(process_t process, cpu_mask_t affinity);
 
 void process_yield();
+uint32_t process_get_switch_count();
+void process_idle();
+void process_start_cpu();
+
+void process_sleep(uint32_t ticks);
+void process_sleep_until(uint32_t tick);
+void process_wake_sleepers(uint32_t now);
+bool process_next_wake_tick(uint32_t *tick);
+
+void process_exit(int32_t status);
+void process_reap();
 
-void process_creation_complete(void *eip);
-void process_switch(process_t next_process);
+void process_creation_complete(process_t process, void *eip);
+void process_switch(process_t previous_process, process_t next_process);
+void process_switch_finish(process_t previous_process);
 
 void dump_process(process_t process);
\ No newline at end of file
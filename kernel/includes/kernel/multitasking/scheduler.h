@@ -1,23 +1,154 @@
 #pragma once
 
+#include <spinlock.h>
+#include <multitasking/process.h>
+#include <structures/rbtree.h>
+
+/**
+ * Number of timer ticks a process runs before being moved to the back of its run queue.
+ * Higher priorities get longer timeslices. Fair processes get their share of
+ * SCHEDULER_FAIR_LATENCY_TICKS instead.
+ */
+#define SCHEDULER_TIMESLICE_TICKS(priority) (PRIORITY_NUMBER_OF_PRIORITIES - (priority))
+
+/**
+ * Processes created with FAIR_SCHEDULING share the CPU in proportion to their
+ * weight instead of by strict priority, each priority weighing twice the one
+ * below. They are queued together below every priority, at SCHEDULER_FAIR_LEVEL.
+ */
+#define SCHEDULER_FAIR_LEVEL            PRIORITY_NUMBER_OF_PRIORITIES
+#define SCHEDULER_FAIR_WEIGHT(priority) (4096 >> (priority))
+
+/**
+ * Each runnable fair process gets a turn every SCHEDULER_FAIR_LATENCY_TICKS,
+ * sliced by weight. Slices are at least SCHEDULER_FAIR_MIN_GRANULARITY_TICKS
+ * long, and a fair process is only preempted early by one that is more than
+ * that far behind it in virtual runtime. A lower granularity favors
+ * interactive processes, a higher one throughput (fewer switches).
+ */
+#define SCHEDULER_FAIR_LATENCY_TICKS         12
+#define SCHEDULER_FAIR_MIN_GRANULARITY_TICKS 2
+
+// Virtual runtime a process of PRIORITY_NORMAL weight gains per tick it runs
+#define SCHEDULER_FAIR_TICK_VRUNTIME 1024
+
 /**
- * @brief      Linked-list entry used by the process scheduler
+ * Every SCHEDULER_AGING_TICKS ticks the longest waiting process of the lowest
+ * non-empty priority is boosted one priority level, until its next timeslice
+ * expires. Prevents lower priorities from starving. Set to 0 to disable aging.
+ */
+#define SCHEDULER_AGING_TICKS 25
+
+/**
+ * A process that ran on its CPU within the last SCHEDULER_CACHE_HOT_TICKS ticks
+ * likely still has its working set in that CPU's caches, and is only stolen
+ * by another CPU if there is nothing else to take.
+ */
+#define SCHEDULER_CACHE_HOT_TICKS 2
+
+/**
+ * Every SCHEDULER_BALANCE_TICKS ticks a busy CPU pulls a process from the
+ * busiest CPU if that one has SCHEDULER_BALANCE_IMBALANCE more waiting.
+ * Idle CPUs steal right away. Set to 0 to only steal when idle.
+ */
+#define SCHEDULER_BALANCE_TICKS     10
+#define SCHEDULER_BALANCE_IMBALANCE 2
+
+/**
+ * @brief      Run queue entry used by the process scheduler
  */
 struct scheduler_process {
 	process_t process;
+
+	/* Circular, doubly linked list of processes sharing a priority */
 	struct scheduler_process *next;
+	struct scheduler_process *prev;
+
+	/* Priority the process is queued at (can be boosted above process->priority), or SCHEDULER_FAIR_LEVEL */
+	priority_t priority;
+
+	/* In a run queue, a priority bucket or the fair tree */
+	bool queued;
+
+	/* Timer ticks left before the process is rotated, 0 to work it out when next picked */
+	uint32_t timeslice;
+
+	/* Weighted ticks run by a FAIR_SCHEDULING process, the fair tree is sorted by it */
+	uint32_t vruntime;
+	uint32_t weight;
+	struct rb_node fair_node;
+
+	/* CPU whose run queue the process is (or was last) in */
+	uint32_t cpu;
+
+	/* Clock of that run queue when the process last stopped running */
+	uint32_t last_ran;
+
+	/* Taken off its CPU for its affinity, queued elsewhere once switched away from */
+	bool migrating;
 };
 
 /**
- * @brief      Bucket for a given priority
+ * @brief      Run queue for a given priority
  */
 struct scheduler_priority_bucket {
 	struct scheduler_process *head;
 };
 
+/**
+ * @brief      Run queues of a single CPU
+ */
+struct scheduler_run_queue {
+	/* Protects everything below, and the entries queued here */
+	spinlock_t lock;
+
+	struct scheduler_priority_bucket buckets[PRIORITY_NUMBER_OF_PRIORITIES];
+
+	/* Fair processes sorted by virtual runtime, and the sum of their weights */
+	struct rb_tree fair_tree;
+	uint32_t fair_weight;
+
+	/* Smallest virtual runtime in the fair tree, never goes backwards. Fair processes are placed relative to it. */
+	uint32_t min_vruntime;
+
+	/* Bit N is set when buckets[N] is non-empty, bit SCHEDULER_FAIR_LEVEL when the fair tree is */
+	uint32_t priority_bitmap;
+
+	/* Process running on the CPU, NULL while idle */
+	struct scheduler_process *running;
+
+	/* Run when no other process is runnable, never in a run queue */
+	process_t idle_process;
+
+	uint32_t aging_ticks;
+	uint32_t balance_ticks;
+
+	/* Ticks accounted to this CPU, used to tell cache hot processes apart */
+	uint32_t clock;
+
+	/* Processes in the run queues, including the running one */
+	uint32_t number_queued;
+};
+
 void scheduler_init();
 
 void scheduler_add_process(process_t process);
 void scheduler_remove_process(process_t process);
 
-process_t scheduler_get_next();
\ No newline at end of file
+void scheduler_block_process(process_t process);
+void scheduler_unblock_process(process_t process);
+void scheduler_update_priority(process_t process);
+void scheduler_affinity_changed(process_t process);
+void scheduler_finish_migration(process_t process);
+
+void scheduler_set_idle_process(process_t process);
+bool scheduler_has_runnable();
+bool scheduler_steal();
+
+bool scheduler_tick(uint32_t elapsed);
+bool scheduler_should_preempt();
+uint32_t scheduler_ticks_until_preempt();
+
+void scheduler_lock();
+void scheduler_unlock();
+process_t scheduler_get_next();
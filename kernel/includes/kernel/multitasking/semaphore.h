@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <multitasking/wait_queue.h>
+
+/**
+ * @brief      Counting semaphore, processes sleep while the count is 0
+ */
+typedef struct semaphore {
+	/* Number of times it can be taken without waiting */
+	uint32_t count;
+
+	/* Processes waiting for the count to go up */
+	wait_queue_t wait;
+} semaphore_t;
+
+#define SEMAPHORE_INITIALIZER(initial_count) {(initial_count), WAIT_QUEUE_INITIALIZER}
+
+void semaphore_init(semaphore_t *semaphore, uint32_t count);
+
+void semaphore_down(semaphore_t *semaphore);
+bool semaphore_try_down(semaphore_t *semaphore);
+void semaphore_up(semaphore_t *semaphore);
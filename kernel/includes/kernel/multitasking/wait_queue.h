@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <spinlock.h>
+#include <multitasking/process.h>
+
+/**
+ * @brief      FIFO of processes blocked until an event happens
+ */
+typedef struct wait_queue {
+	process_t head;
+	process_t tail;
+
+	/* Protects the queue, and is held while checking the condition waited on */
+	spinlock_t lock;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INITIALIZER {NULL, NULL, SPINLOCK_INITIALIZER("wait queue")}
+
+void wait_queue_init(wait_queue_t *queue);
+
+void wait_queue_lock(wait_queue_t *queue);
+void wait_queue_unlock(wait_queue_t *queue);
+void wait_queue_block(wait_queue_t *queue);
+
+bool wait_queue_wake_one(wait_queue_t *queue);
+bool wait_queue_wake_highest(wait_queue_t *queue);
+size_t wait_queue_wake_all(wait_queue_t *queue);
@@ -13,6 +13,7 @@
 struct pci_device {
 	uint8_t bus;
 	uint8_t device;
+	uint8_t function;
 	
 	uint16_t device_id;
 	uint16_t vendor_id;
@@ -38,6 +39,11 @@ struct pci_device {
 			uint8_t  bist;
 		};
 	};
+
+	/* Set by pci_enable_msi() and pci_enable_msix() */
+	uint8_t  msi_vector;
+	uint8_t  msi_vector_count;
+	volatile uint32_t *msix_table;
 };
 
 /**
@@ -59,8 +65,55 @@ enum pci_header_offsets {
 	PCI_TYPE_0_BASE_ADDRESS_REGISTERS_3 = 0x1C,
 	PCI_TYPE_0_BASE_ADDRESS_REGISTERS_4 = 0x20,
 	PCI_TYPE_0_BASE_ADDRESS_REGISTERS_5 = 0x24,
+	PCI_TYPE_0_CAPABILITIES_POINTER     = 0x34,
 };
 
+#define PCI_COMMAND_BUS_MASTER        (1 << 2)
+#define PCI_COMMAND_INTERRUPT_DISABLE (1 << 10)
+
+#define PCI_STATUS_CAPABILITIES_LIST  (1 << 4)
+
+#define PCI_BAR_IO           0x01
+#define PCI_BAR_TYPE_MASK    0x06
+#define PCI_BAR_TYPE_64      0x04
+#define PCI_BAR_MEMORY_MASK  0xFFFFFFF0
+
+/**
+ * @brief      Capability IDs
+ */
+enum pci_capability_ids {
+	PCI_CAPABILITY_MSI  = 0x05,
+	PCI_CAPABILITY_MSIX = 0x11,
+};
+
+/**
+ * MSI capability, message control is the upper half of the first dword
+ */
+#define PCI_MSI_CONTROL_ENABLE          (1 << 0)
+#define PCI_MSI_CONTROL_MULTIPLE_SHIFT  1     // log2 of the vectors the device supports
+#define PCI_MSI_CONTROL_ENABLED_SHIFT   4     // log2 of the vectors enabled
+#define PCI_MSI_CONTROL_MULTIPLE_MASK   0x7
+#define PCI_MSI_CONTROL_64BIT           (1 << 7)
+#define PCI_MSI_ADDRESS                 0x4
+#define PCI_MSI_DATA_32                 0x8
+#define PCI_MSI_DATA_64                 0xC
+
+/**
+ * MSI-X capability, the table lives in one of the device's memory BARs
+ */
+#define PCI_MSIX_CONTROL_TABLE_SIZE_MASK 0x7FF // Number of entries - 1
+#define PCI_MSIX_CONTROL_FUNCTION_MASK   (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE          (1 << 15)
+#define PCI_MSIX_TABLE                   0x4   // Offset into the BAR, BAR index in the low 3 bits
+#define PCI_MSIX_TABLE_BIR_MASK          0x7
+
+#define PCI_MSIX_ENTRY_SIZE              16
+#define PCI_MSIX_ENTRY_ADDRESS_LOW       0x0
+#define PCI_MSIX_ENTRY_ADDRESS_HIGH      0x4
+#define PCI_MSIX_ENTRY_DATA              0x8
+#define PCI_MSIX_ENTRY_CONTROL           0xC
+#define PCI_MSIX_ENTRY_MASKED            (1 << 0)
+
 /**
  * Set the precision level when searching for PCI devices
  */
@@ -84,4 +137,15 @@ uint16_t pci_get_vendor_id(uint8_t bus, uint8_t device);
 uint32_t pci_get_class(uint8_t bus, uint8_t device);
 uint8_t  pci_get_header_type(uint8_t bus, uint8_t device);
 
-uint32_t pci_read32(uint8_t bus, uint8_t device, uint8_t function, enum pci_header_offsets offset);
\ No newline at end of file
+uint32_t pci_read32(uint8_t bus, uint8_t device, uint8_t function, enum pci_header_offsets offset);
+void pci_write32(uint8_t bus, uint8_t device, uint8_t function, enum pci_header_offsets offset, uint32_t value);
+
+uint8_t pci_find_capability(struct pci_device *pci_device, uint8_t capability_id);
+
+bool pci_enable_msi(struct pci_device *pci_device, uint32_t count);
+void pci_disable_msi(struct pci_device *pci_device);
+
+bool pci_enable_msix(struct pci_device *pci_device, uint32_t count);
+void pci_disable_msix(struct pci_device *pci_device);
+void pci_msix_mask(struct pci_device *pci_device, uint32_t entry);
+void pci_msix_unmask(struct pci_device *pci_device, uint32_t entry);
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+
+// Count acquisitions, contention and spinning per lock, see spinlock_dump_stats()
+#define SPINLOCK_STATS 0
+
+/**
+ * @brief      Contention statistics of a lock, only kept when SPINLOCK_STATS is set
+ */
+struct spinlock_stats {
+	const char *name;
+
+	uint32_t acquisitions;
+
+	/* Acquisitions that had to wait, and the number of times they looked at the lock again */
+	uint32_t contended;
+	uint32_t spins;
+
+	/* Added to the list dumped by spinlock_dump_stats() on first use */
+	uint32_t registered;
+	struct spinlock_stats *next;
+};
+
+/**
+ * @brief      Ticket spinlock, CPUs get the lock in the order they asked for it
+ */
+typedef struct spinlock {
+	union {
+		volatile uint32_t value;
+		struct {
+			/* Ticket being served, and the next ticket to hand out */
+			volatile uint16_t owner;
+			volatile uint16_t next;
+		} tickets;
+	};
+
+#if SPINLOCK_STATS
+	struct spinlock_stats stats;
+#endif
+} spinlock_t;
+
+/**
+ * @brief      Reader-writer spinlock, any number of readers or a single writer.
+ *              A waiting writer keeps new readers out, so writers are not starved.
+ */
+typedef struct rwlock {
+	/* Number of readers, and the writer bits below */
+	volatile uint32_t value;
+
+#if SPINLOCK_STATS
+	struct spinlock_stats stats;
+#endif
+} rwlock_t;
+
+#define RWLOCK_WRITER         (1u << 31)
+#define RWLOCK_WRITER_WAITING (1u << 30)
+
+#if SPINLOCK_STATS
+#define SPINLOCK_STATS_INITIALIZER(lock_name) , .stats = {.name = (lock_name)}
+#else
+#define SPINLOCK_STATS_INITIALIZER(lock_name)
+#endif
+
+#define SPINLOCK_INITIALIZER(name) {.value = 0 SPINLOCK_STATS_INITIALIZER(name)}
+#define RWLOCK_INITIALIZER(name)   {.value = 0 SPINLOCK_STATS_INITIALIZER(name)}
+
+void spinlock_init(spinlock_t *lock, const char *name);
+
+void spin_lock(spinlock_t *lock);
+bool spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+
+void spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock);
+
+/**
+ * @brief      Check if a spinlock is held by anyone
+ */
+static inline bool spin_is_locked(spinlock_t *lock)
+{
+	uint32_t value;
+
+	value = lock->value;
+	return (uint16_t)value != (uint16_t)(value >> 16);
+}
+
+void rwlock_init(rwlock_t *lock, const char *name);
+
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+void read_lock_irqsave(rwlock_t *lock);
+void read_unlock_irqrestore(rwlock_t *lock);
+void write_lock_irqsave(rwlock_t *lock);
+void write_unlock_irqrestore(rwlock_t *lock);
+
+void spinlock_dump_stats();
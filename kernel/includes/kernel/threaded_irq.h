@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <multitasking/process.h>
+#include <multitasking/wait_queue.h>
+
+/**
+ * @brief      An interrupt whose handler runs in its own kernel thread
+ */
+struct threaded_irq {
+	uint8_t vector;
+
+	void (*handler)(void *data);
+	void *data;
+
+	process_t thread;
+	wait_queue_t wait;
+
+	/* Raised since the thread last started the handler */
+	bool pending;
+
+	/* Line masked by the top half, unmasked once the handler is done */
+	bool masked;
+};
+
+bool install_threaded_interrupt_handler(uint8_t interrupt_number, void (*handler)(void *data), void *data,
+	priority_t priority);
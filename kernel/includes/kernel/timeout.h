@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Hierarchical timer wheel. Level 0 has one slot per tick, every level
+ * above covers TIMEOUT_LEVEL_SLOTS times the range of the level below,
+ * so together they cover the full 32 bit tick range.
+ */
+#define TIMEOUT_LEVEL0_BITS  8
+#define TIMEOUT_LEVEL0_SLOTS (1 << TIMEOUT_LEVEL0_BITS)
+#define TIMEOUT_LEVEL_BITS   6
+#define TIMEOUT_LEVEL_SLOTS  (1 << TIMEOUT_LEVEL_BITS)
+#define TIMEOUT_LEVELS       5
+
+/**
+ * @brief      A callback run once a number of timer ticks have passed
+ *
+ * Callbacks run as deferred work on exit from the timer interrupt, and must not block.
+ */
+struct timeout {
+	struct timeout *next;
+	struct timeout *prev;
+
+	/* List the timeout is in (wheel slot or expired list), NULL if not pending */
+	struct timeout **list;
+
+	/* Tick to run on */
+	uint32_t expires;
+
+	void (*callback)(void *data);
+	void *data;
+};
+
+void timeout_init(struct timeout *timeout, void (*callback)(void *data), void *data);
+
+void timeout_add(struct timeout *timeout, uint32_t ticks);
+bool timeout_cancel(struct timeout *timeout);
+bool timeout_pending(struct timeout *timeout);
+
+void timeout_wheel_init();
+void timeout_advance(uint32_t now);
+bool timeout_next_event(uint32_t now, uint32_t *ticks);
@@ -8,5 +8,46 @@
 #define PIT_CHAN2 0x42 // Channel 2 data port (read/write)
 #define PIT_CMD   0x43 // Mode/Command register (write only, a read is ignored)
 
+#define PIT_FREQUENCY  1193180 // Input clock of the PIT in HZ
+#define PIT_MAX_COUNTS 0xFFFF
+
+#define PIT_MODE_PERIODIC 0x34 // Channel 0, lo/hi byte, rate generator (repeats when it hits 0)
+#define PIT_MODE_ONESHOT  0x30 // Channel 0, lo/hi byte, interrupt on terminal count
+
+/**
+ * Program the timer for the next event instead of interrupting every tick.
+ * Set to 0 to use a periodic tick.
+ */
+#define TIMER_TICKLESS 1
+
+/**
+ * @brief      Hardware timer that raises the timer interrupt
+ */
+struct timer_event_source {
+	const char *name;
+
+	uint8_t interrupt_number;
+
+	/* Interrupt at a fixed frequency */
+	void (*set_periodic)(uint32_t frequency);
+
+	/* Interrupt once, after at most ns nanoseconds (longer delays are clamped by the source) */
+	void (*set_oneshot)(uint64_t ns);
+
+	void (*stop)();
+
+	/* Called first thing in the interrupt handler */
+	void (*acknowledge)();
+};
+
 void timer_init(uint32_t frequency);
-void timer_interrupt_handler(struct isr_arguments *args);
\ No newline at end of file
+void timer_start();
+void timer_start_cpu();
+bool timer_per_cpu();
+void timer_interrupt_handler(struct isr_arguments *args);
+
+void timer_rearm();
+
+uint32_t timer_get_ticks();
+uint64_t timer_read_counts();
+uint32_t timer_get_frequency();
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * @brief      Node of an intrusive red-black tree, embedded in the structure it sorts
+ */
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	bool red;
+};
+
+/**
+ * @brief      Red-black tree, keeps its smallest node at hand
+ */
+struct rb_tree {
+	struct rb_node *root;
+	struct rb_node *leftmost;
+};
+
+#define RB_TREE_INITIALIZER {NULL, NULL}
+
+/**
+ * @brief      Get the structure a node is embedded in
+ */
+#define rb_entry(node, type, member) ((type*)((uint8_t*)(node) - __builtin_offsetof(type, member)))
+
+/**
+ * Ordering of the tree, true if a sorts before b
+ */
+typedef bool (*rb_less_t)(struct rb_node *a, struct rb_node *b);
+
+void rb_init(struct rb_tree *tree);
+
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less);
+void rb_remove(struct rb_tree *tree, struct rb_node *node);
+
+struct rb_node *rb_last(struct rb_tree *tree);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+/**
+ * @brief      Get the smallest node of a tree, NULL if empty
+ */
+static inline struct rb_node *rb_first(struct rb_tree *tree)
+{
+	return tree->leftmost;
+}
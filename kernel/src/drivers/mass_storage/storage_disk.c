@@ -1,4 +1,5 @@
 #include <pci.h>
+#include <spinlock.h>
 #include <string.h>
 #include <mass_storage/storage_disk.h>
 #include <mass_storage/SATA/sata.h>
@@ -7,6 +8,11 @@ static disk_handler_init_t disk_handler_init_functions[MASS_STORAGE_SUBCLASS_NUM
 static struct disk_handler disk_handlers[DISK_MAX_NUMBER_HANDLERS];
 static uint32_t disk_handler_counter;
 
+// Handlers are added by drivers while disks are already in use. Readers copy the
+// handler out, the disk functions can block and are not called with the lock held.
+static rwlock_t disk_handlers_lock = RWLOCK_INITIALIZER("disk handlers");
+
+static bool get_handler(uint32_t disk_number, struct disk_handler *handler);
 static void pci_scan_callback(struct pci_device device);
 
 /**
@@ -40,16 +46,24 @@ MODULE_INIT(disk_init);
  */
 bool disk_add_handler(struct disk_handler handler)
 {
-	if(disk_handler_counter >= DISK_MAX_NUMBER_HANDLERS)
+	write_lock_irqsave(&disk_handlers_lock);
+
+	if(disk_handler_counter >= DISK_MAX_NUMBER_HANDLERS) {
+		write_unlock_irqrestore(&disk_handlers_lock);
 		return false;
+	}
 
 	memcpy((void*)(disk_handlers + disk_handler_counter), (void*)&handler, sizeof(handler));
 	disk_handler_counter++;
+
+	write_unlock_irqrestore(&disk_handlers_lock);
 	return true;
 }
 
 int32_t disk_read(uint32_t disk_number, void *buffer, uint32_t read_len, uint32_t offset)
 {
+	struct disk_handler handler;
+
 	// TODO: Set errno that disk number too large
 	if(disk_number >= DISK_MAX_NUMBER_HANDLERS)
 		return -1;
@@ -59,11 +73,11 @@ int32_t disk_read(uint32_t disk_number, void *buffer, uint32_t read_len, uint32_
 		return -1;
 
 	// TODO: Disk number too large
-	if(disk_number >= disk_handler_counter)
+	if(!get_handler(disk_number, &handler))
 		return -1;
-	
-	if(disk_handlers[disk_number].disk_read) {
-		return disk_handlers[disk_number].disk_read(disk_handlers[disk_number].data, buffer, offset, read_len);
+
+	if(handler.disk_read) {
+		return handler.disk_read(handler.data, buffer, offset, read_len);
 	}
 
 	// TODO: Set errno that no handler found for desired disk
@@ -72,20 +86,22 @@ int32_t disk_read(uint32_t disk_number, void *buffer, uint32_t read_len, uint32_
 
 int32_t disk_write(uint32_t disk_number, void *buffer, uint32_t write_len, uint32_t offset)
 {
+	struct disk_handler handler;
+
 	// TODO: Set errno that disk number too large
 	if(disk_number >= DISK_MAX_NUMBER_HANDLERS)
 		return -1;
 
 	// TODO: Mark errno that this change was done
-	if((int32_t)write_len > 0)
+	if((int32_t)write_len < 0)
 		return -1;
 
 	// TODO: Disk number too large
-	if(disk_number >= disk_handler_counter)
+	if(!get_handler(disk_number, &handler))
 		return -1;
 
-	if(disk_handlers[disk_number].disk_write) {
-		return disk_handlers[disk_number].disk_write(disk_handlers[disk_number].data, buffer, offset, write_len);
+	if(handler.disk_write) {
+		return handler.disk_write(handler.data, buffer, offset, write_len);
 	}
 
 	// TODO: Set errno that no handler found for desired disk
@@ -94,6 +110,8 @@ int32_t disk_write(uint32_t disk_number, void *buffer, uint32_t write_len, uint3
 
 void disk_info(uint32_t disk_number, struct disk_info *info)
 {
+	struct disk_handler handler;
+
 	// TODO: Set errno that disk number too large
 	if(disk_number >= DISK_MAX_NUMBER_HANDLERS)
 		return;
@@ -103,17 +121,39 @@ void disk_info(uint32_t disk_number, struct disk_info *info)
 		return;
 	
 	// TODO: Disk number too large
-	if(disk_number >= disk_handler_counter)
+	if(!get_handler(disk_number, &handler))
 		return;
 
-	if(disk_handlers[disk_number].disk_info) {
-		disk_handlers[disk_number].disk_info(disk_handlers[disk_number].data, info);
+	if(handler.disk_info) {
+		handler.disk_info(handler.data, info);
 	}
 
 	// TODO: Set errno that no handler found for desired disk
 	return;
 }
 
+/**
+ * @brief      Copy the handler of a disk
+ *
+ * @param[in]  disk_number  The disk number
+ * @param      handler      Filled with the handler
+ *
+ * @return     True if copied, False if there is no such disk
+ */
+static bool get_handler(uint32_t disk_number, struct disk_handler *handler)
+{
+	bool found;
+
+	read_lock_irqsave(&disk_handlers_lock);
+
+	found = disk_number < disk_handler_counter;
+	if(found)
+		*handler = disk_handlers[disk_number];
+
+	read_unlock_irqrestore(&disk_handlers_lock);
+	return found;
+}
+
 /**
  * @brief      Callback for pci_scan_for_device_class() that handles calling the init functions for each subclass
  *
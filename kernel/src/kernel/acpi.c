@@ -6,7 +6,12 @@
 #include <mm/kmalloc.h>
 
 static RSDP_VERSION is_rsdp_valid(RSDPv1 *rsdp);
-static SDT_Header *find_rsdt_identifier(RSDPv1 *rsdp, const char *identifier);
+static bool is_sdt_valid(SDT_Header *header);
+
+// Physical address of the RSDT, tables are copied out of it on demand
+static uintptr_t rsdt_physical;
+
+static MADT *madt;
 
 void acpi_init(struct multiboot_tag_new_acpi *acpi_tag)
 {
@@ -19,6 +24,22 @@ void acpi_init(struct multiboot_tag_new_acpi *acpi_tag)
 		kpanic("Invalid RSDP structure");
 
 	kprintf(KPRINT_DEBUG "ACPI - Version: %d - OEMID: '%s'\n", version, rsdp->oemid);
+
+	rsdt_physical = (uintptr_t)rsdp->rsdt_address;
+
+	madt = (MADT*)acpi_find_table(MADT_SIGNATURE);
+	if(madt)
+		kprintf(KPRINT_DEBUG "ACPI - MADT: %d bytes\n", madt->header.length);
+}
+
+/**
+ * @brief      Get the MADT found by acpi_init()
+ *
+ * @return     The MADT, or NULL if there is none
+ */
+MADT *acpi_get_madt()
+{
+	return madt;
 }
 
 /**
@@ -56,39 +77,65 @@ static RSDP_VERSION is_rsdp_valid(RSDPv1 *rsdp)
 }
 
 /**
- * @brief      Parses an RSDT to find an entry. Only for ACPI v1.
+ * @brief      Validate the checksum of a system description table
  *
- * @param      rsdp  The rsdp
+ * @param      header  The table
  */
-static SDT_Header *find_rsdt_identifier(RSDPv1 *rsdp, const char *identifier)
+static bool is_sdt_valid(SDT_Header *header)
 {
-	RSDT *rsdt;
-	SDT_Header *tmp;
-	uint32_t entries, length;
+	uint32_t checksum, length;
+	uint8_t *ptr;
 
-	rsdt = (RSDT*)rsdp->rsdt_address;
+	checksum = 0;
+	length   = header->length;
+	ptr      = (uint8_t*)header;
+	while(length--) {
+		checksum += *ptr++;
+	}
+
+	return (checksum & 0xFF) == 0x00;
+}
 
-	// XXX: Might not want to identity map these pages
-	paging_map2(rsdt, (void*)PAGE_ALIGN((uintptr_t)rsdp->rsdt_address), PAGE_PRESENT | PAGE_READ_WRITE, 0);
+/**
+ * @brief      Parses the RSDT to find a table. Only for ACPI v1.
+ *
+ * @param[in]  signature  The 4 character signature of the table
+ *
+ * @return     A kmalloc()'d copy of the table, or NULL if not found
+ */
+SDT_Header *acpi_find_table(const char *signature)
+{
+	SDT_Header header, *table;
+	uint32_t entries, address;
 
-	entries = (rsdt->header.length - sizeof(SDT_Header)) / sizeof(uintptr_t);
+	if(rsdt_physical == 0x00)
+		return NULL;
+
+	paging_copy_from_physical(&header, rsdt_physical, sizeof(SDT_Header));
+
+	entries = (header.length - sizeof(SDT_Header)) / sizeof(uint32_t);
 	for(uint32_t i = 0; i < entries; i++) {
-		tmp = (SDT_Header *)rsdt->sdt_ptrs[i];
-		// XXX: Might not want to identity map these pages
-		paging_map2(tmp, (void*)PAGE_ALIGN((uintptr_t)tmp), PAGE_PRESENT | PAGE_READ_WRITE, 0);
-		
+		paging_copy_from_physical(&address, rsdt_physical + sizeof(SDT_Header) + i * sizeof(uint32_t), sizeof(uint32_t));
+		paging_copy_from_physical(&header, address, sizeof(SDT_Header));
+
+		if(strncmp(header.signature, signature, sizeof(header.signature)))
+			continue;
+
 		// Check for match and copy into buffer
-		if(strncmp(tmp->signature, identifier, sizeof(tmp->signature)) == 0) {
-			length = tmp->length;
-			tmp = kmalloc(length);
-			memcpy(tmp, (void*)(rsdt->sdt_ptrs[i]), length);
-			return tmp;
+		table = kmalloc(header.length);
+		if(table == NULL)
+			return NULL;
+
+		paging_copy_from_physical(table, address, header.length);
+		if(!is_sdt_valid(table)) {
+			kprintf(KPRINT_ERROR "ACPI - Bad checksum on %c%c%c%c\n",
+				signature[0], signature[1], signature[2], signature[3]);
+			kfree(table);
+			return NULL;
 		}
-		
-		paging_unmap(tmp);
+
+		return table;
 	}
-	
-	paging_unmap(rsdt);
 
 	return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,246 @@
+#include <clocksource.h>
+#include <kprint.h>
+#include <portio.h>
+#include <timer.h>
+#include <i686/cpu.h>
+#include <i686/isr.h>
+#include <i686/math64.h>
+
+/**
+ * Clocksource
+ *
+ * 	The TSC is used when the CPU has one, calibrated at boot by counting
+ * 	cycles while PIT channel 2 counts down a known interval. Without a TSC
+ * 	(or if calibration fails) the PIT input clock counts kept by timer.c are
+ * 	used instead, which are only as precise as the PIT and stop advancing
+ * 	while the timer is stopped.
+ */
+
+// Port 0x61: bit 0 gates PIT channel 2, bit 1 enables the speaker, bit 5 is channel 2 OUT
+#define PIT_CHANNEL2_GATE_PORT 0x61
+#define PIT_CHANNEL2_GATE      0x01
+#define PIT_CHANNEL2_SPEAKER   0x02
+#define PIT_CHANNEL2_OUT       0x20
+
+// Channel 2, lo/hi byte, interrupt on terminal count
+#define PIT_MODE_CHANNEL2_ONESHOT 0xB0
+
+// Give up on a calibration run after this many polls of the OUT bit
+#define CALIBRATION_MAX_POLLS 10000000
+
+static uint64_t tsc_read();
+static uint64_t pit_read();
+static uint32_t calibrate_run(uint64_t (*read)());
+
+static struct clocksource tsc_clocksource = {
+	.name       = "tsc",
+	.read       = tsc_read,
+	.continuous = true,
+};
+
+static struct clocksource pit_clocksource = {
+	.name          = "pit",
+	.read          = pit_read,
+	.frequency_khz = PIT_FREQUENCY / 1000,
+	.continuous    = false,
+};
+
+static struct clocksource *current_clocksource;
+
+// Counter value read as time 0
+static uint64_t base_cycles;
+
+// Last PIT based value returned, keeps the PIT clocksource monotonic
+static uint64_t pit_last_read;
+
+/**
+ * @brief      Select and calibrate the clocksource. Called before timer_init(), calibration only uses PIT
+ *              channel 2, the PIT clocksource (TSC fallback) only counts once the timer is started.
+ */
+void clocksource_init()
+{
+	struct cpuid_registers registers;
+	uint32_t tsc_khz;
+
+	current_clocksource = &pit_clocksource;
+	clocksource_calculate_mult_shift(&(pit_clocksource.mult), &(pit_clocksource.shift),
+		PIT_FREQUENCY, NSEC_PER_SEC);
+
+	cpuid(CPUID_LEAF_FEATURES, &registers);
+	if(registers.edx & CPUID_FEATURE_EDX_TSC) {
+		tsc_khz = clocksource_calibrate(tsc_read);
+		if(tsc_khz) {
+			clocksource_calculate_mult_shift(&(tsc_clocksource.mult), &(tsc_clocksource.shift),
+				tsc_khz, NSEC_PER_MSEC);
+			tsc_clocksource.frequency_khz = tsc_khz;
+			current_clocksource = &tsc_clocksource;
+
+			kprintf(KPRINT_DEBUG "TSC Frequency: %d kHz\n", tsc_khz);
+
+			// Leaf only exists if the maximum extended leaf covers it
+			cpuid(CPUID_LEAF_EXTENDED_MAX, &registers);
+			if(registers.eax >= CPUID_LEAF_EXTENDED_POWER)
+				cpuid(CPUID_LEAF_EXTENDED_POWER, &registers);
+			else
+				registers.edx = 0;
+
+			if(!(registers.edx & CPUID_POWER_EDX_INVARIANT_TSC))
+				kprintf(KPRINT_DEBUG "TSC is not invariant, may drift with power states\n");
+		} else {
+			kprintf(KPRINT_ERROR "TSC calibration failed\n");
+		}
+	}
+
+	pit_last_read = 0;
+	base_cycles   = current_clocksource->read();
+
+	kprintf(KPRINT_DEBUG "Clocksource: %s\n", current_clocksource->name);
+}
+
+/**
+ * @brief      Get the clocksource in use
+ *
+ * @return     The clocksource
+ */
+const struct clocksource *clocksource_get()
+{
+	return current_clocksource;
+}
+
+/**
+ * @brief      Read the monotonic clock
+ *
+ * @return     Nanoseconds since clocksource_init()
+ */
+uint64_t clocksource_read_ns()
+{
+	return clocksource_cycles_to_ns(current_clocksource->read() - base_cycles);
+}
+
+/**
+ * @brief      Convert clocksource cycles to nanoseconds
+ *
+ * @param[in]  cycles  The number of cycles
+ *
+ * @return     The number of nanoseconds
+ */
+uint64_t clocksource_cycles_to_ns(uint64_t cycles)
+{
+	return mul_u64_u32_shr(cycles, current_clocksource->mult, current_clocksource->shift);
+}
+
+/**
+ * @brief      Read the TSC clocksource
+ */
+static uint64_t tsc_read()
+{
+	return rdtsc();
+}
+
+/**
+ * @brief      Read the PIT clocksource
+ */
+static uint64_t pit_read()
+{
+	uint64_t counts;
+
+	irq_disable();
+
+	// An expired but not yet accounted period can make the count step back
+	counts = timer_read_counts();
+	if(counts < pit_last_read)
+		counts = pit_last_read;
+	pit_last_read = counts;
+
+	irq_resume();
+	return counts;
+}
+
+/**
+ * @brief      Measure the frequency of a free running counter against PIT channel 2
+ *
+ * @param[in]  read  Function reading the counter
+ *
+ * @return     Frequency in kHz, or 0 if calibration failed
+ */
+uint32_t clocksource_calibrate(uint64_t (*read)())
+{
+	uint32_t cycles, best;
+	uint8_t gate;
+
+	irq_disable();
+
+	// Gate channel 2 on with the speaker off
+	gate = in8(PIT_CHANNEL2_GATE_PORT);
+	out8(PIT_CHANNEL2_GATE_PORT, (gate & ~PIT_CHANNEL2_SPEAKER) | PIT_CHANNEL2_GATE);
+
+	// Shortest run has the least interference (SMIs, host scheduling)
+	best = 0;
+	for(uint32_t i = 0; i < CLOCKSOURCE_CALIBRATION_RUNS; i++) {
+		cycles = calibrate_run(read);
+		if(cycles && (best == 0 || cycles < best))
+			best = cycles;
+	}
+
+	out8(PIT_CHANNEL2_GATE_PORT, gate);
+
+	irq_resume();
+
+	return best / CLOCKSOURCE_CALIBRATION_MS;
+}
+
+/**
+ * @brief      Count cycles of a counter over one PIT channel 2 countdown of CLOCKSOURCE_CALIBRATION_MS
+ *
+ * @param[in]  read  Function reading the counter
+ *
+ * @return     Number of cycles, or 0 if the countdown never finished
+ */
+static uint32_t calibrate_run(uint64_t (*read)())
+{
+	uint32_t counts;
+	uint64_t start, end;
+
+	counts = PIT_FREQUENCY / 1000 * CLOCKSOURCE_CALIBRATION_MS;
+
+	out8(PIT_CMD, PIT_MODE_CHANNEL2_ONESHOT);
+	out8(PIT_CHAN2, (uint8_t)(counts & 0xFF));
+	out8(PIT_CHAN2, (uint8_t)((counts >> 8) & 0xFF));
+
+	start = read();
+
+	for(uint32_t polls = 0; !(in8(PIT_CHANNEL2_GATE_PORT) & PIT_CHANNEL2_OUT); polls++) {
+		if(polls >= CALIBRATION_MAX_POLLS)
+			return 0;
+	}
+
+	end = read();
+
+	// Over 400GHz does not fit, not a concern
+	return (uint32_t)(end - start);
+}
+
+/**
+ * @brief      Calculate mult and shift to convert a counter at frequency from to frequency to,
+ *              as value_to = (value_from * mult) >> shift
+ *
+ * @param      mult   Set to the multiplier
+ * @param      shift  Set to the shift
+ * @param[in]  from   Frequency of the counter
+ * @param[in]  to     Frequency to convert to (same unit as from)
+ */
+void clocksource_calculate_mult_shift(uint32_t *mult, uint32_t *shift, uint32_t from, uint32_t to)
+{
+	uint64_t value;
+	uint32_t bits;
+
+	// Largest shift (best precision) where mult still fits in 32 bits
+	for(bits = 32; bits > 0; bits--) {
+		value = div_u64_u32((uint64_t)to << bits, from, NULL);
+		if(value <= 0xFFFFFFFF)
+			break;
+	}
+
+	*mult  = (uint32_t)value;
+	*shift = bits;
+}
@@ -0,0 +1,236 @@
+#include <deferred.h>
+#include <kpanic.h>
+#include <spinlock.h>
+#include <string.h>
+#include <i686/smp.h>
+#include <multitasking/process.h>
+#include <multitasking/wait_queue.h>
+
+/**
+ * Deferred work
+ *
+ * 	Interrupt handlers only do what can not wait (acknowledge the device,
+ * 	grab its status) and queue the rest, so interrupts are disabled for as
+ * 	short as possible. There are two places work can run:
+ *
+ * 	deferred_queue(): on the way out of the interrupt, with interrupts
+ * 	enabled, before returning to the interrupted code. Runs soon, but must
+ * 	not block or sleep, and the running process is not preempted meanwhile.
+ * 	Only runs when the interrupted code had interrupts enabled, otherwise it
+ * 	waits for the next interrupt that did.
+ *
+ * 	deferred_queue_worker(): in the worker kernel thread, scheduled like any
+ * 	other process. Can block and sleep.
+ *
+ * 	Both lists are shared by every CPU, whichever gets to an item first runs it.
+ */
+
+static struct deferred_list interrupt_list;
+static struct deferred_list worker_list;
+static spinlock_t deferred_lock = SPINLOCK_INITIALIZER("deferred");
+
+static wait_queue_t worker_wait;
+static process_t worker;
+
+// Interrupt exit work is running, by CPU
+static bool running[SMP_MAX_CPUS];
+
+static bool list_push(struct deferred_list *list, struct deferred_work *work);
+static struct deferred_work *list_pop(struct deferred_list *list);
+static void worker_thread(void *data);
+
+/**
+ * @brief      Start the worker thread. process_init() must have been called.
+ */
+void deferred_init()
+{
+	interrupt_list.head = NULL;
+	interrupt_list.tail = NULL;
+	worker_list.head    = NULL;
+	worker_list.tail    = NULL;
+	memset(running, 0, sizeof(running));
+
+	wait_queue_init(&worker_wait);
+
+	worker = process_create_kernel_thread(worker_thread, NULL, PRIORITY_ELEVATED, CPU_MASK_ALL);
+	if(!worker)
+		kpanic("Could not create deferred work thread");
+}
+
+/**
+ * @brief      Initialize a work item
+ *
+ * @param      work      The work item
+ * @param[in]  function  The function to run
+ * @param      data      Passed to the function
+ */
+void deferred_work_init(struct deferred_work *work, void (*function)(void *data), void *data)
+{
+	work->next     = NULL;
+	work->function = function;
+	work->data     = data;
+	work->pending  = false;
+}
+
+/**
+ * @brief      Run a work item on interrupt exit. Can be called from interrupt handlers.
+ *
+ * @param      work  The work item
+ *
+ * @return     True if queued, False if it was already pending
+ */
+bool deferred_queue(struct deferred_work *work)
+{
+	bool queued;
+
+	spin_lock_irqsave(&deferred_lock);
+	queued = list_push(&interrupt_list, work);
+	spin_unlock_irqrestore(&deferred_lock);
+
+	return queued;
+}
+
+/**
+ * @brief      Run a work item in the worker thread. Can be called from interrupt handlers.
+ *
+ * @param      work  The work item
+ *
+ * @return     True if queued, False if it was already pending
+ */
+bool deferred_queue_worker(struct deferred_work *work)
+{
+	bool queued;
+
+	spin_lock_irqsave(&deferred_lock);
+	queued = list_push(&worker_list, work);
+	spin_unlock_irqrestore(&deferred_lock);
+
+	if(queued)
+		wait_queue_wake_one(&worker_wait);
+
+	return queued;
+}
+
+/**
+ * @brief      Check if interrupt exit work is running
+ *
+ * @return     True if running (so preempting the current process would stall it), False if not
+ */
+bool deferred_running()
+{
+	return running[cpu_id()];
+}
+
+/**
+ * @brief      Run the work queued by deferred_queue(). Called from isr_common_stub after the handler.
+ *
+ * @param      args  The arguments passed from the initial ISR handler
+ */
+void deferred_interrupt_exit(struct isr_arguments *args)
+{
+	struct deferred_work *work;
+	uint32_t sync_depth, cpu;
+
+	cpu = cpu_id();
+
+	// Interrupted code relies on interrupts being disabled, or this is nested in the loop below
+	if(!(args->eflags & EFLAGS_INTERRUPT_FLAG) || running[cpu] || interrupt_list.head == NULL)
+		return;
+
+	running[cpu] = true;
+	sync_depth = irq_get_sync_depth();
+
+	// Other CPUs may take items too
+	while(1) {
+		spin_lock(&deferred_lock);
+		work = list_pop(&interrupt_list);
+		spin_unlock(&deferred_lock);
+
+		if(work == NULL)
+			break;
+
+		irq_enable();
+		work->function(work->data);
+		irq_disable();
+	}
+
+	// Work may leave the depth as if interrupts were enabled
+	irq_set_sync_depth(sync_depth);
+	running[cpu] = false;
+}
+
+/**
+ * @brief      Run work queued by deferred_queue_worker(), blocking while there is none
+ *
+ * @param      data  Unused
+ */
+static void FUNCTION_NO_RETURN worker_thread(void *data)
+{
+	struct deferred_work *work;
+
+	(void)data;
+
+	while(1) {
+		// Only this thread takes from the list, so it is still there after the wait
+		wait_queue_lock(&worker_wait);
+		while(worker_list.head == NULL)
+			wait_queue_block(&worker_wait);
+		wait_queue_unlock(&worker_wait);
+
+		spin_lock_irqsave(&deferred_lock);
+		work = list_pop(&worker_list);
+		spin_unlock_irqrestore(&deferred_lock);
+
+		work->function(work->data);
+	}
+}
+
+/**
+ * @brief      Add a work item to the back of a list. deferred_lock must be held.
+ *
+ * @param      list  The list
+ * @param      work  The work item
+ *
+ * @return     True if added, False if it was already pending
+ */
+static bool list_push(struct deferred_list *list, struct deferred_work *work)
+{
+	if(work->pending)
+		return false;
+
+	work->pending = true;
+	work->next    = NULL;
+
+	if(list->tail)
+		list->tail->next = work;
+	else
+		list->head = work;
+	list->tail = work;
+
+	return true;
+}
+
+/**
+ * @brief      Take the work item at the front of a list. deferred_lock must be held.
+ *
+ * @param      list  The list
+ *
+ * @return     The work item (no longer pending, so it can be queued again while running), or NULL if empty
+ */
+static struct deferred_work *list_pop(struct deferred_list *list)
+{
+	struct deferred_work *work;
+
+	work = list->head;
+	if(work == NULL)
+		return NULL;
+
+	list->head = work->next;
+	if(list->head == NULL)
+		list->tail = NULL;
+
+	work->next    = NULL;
+	work->pending = false;
+
+	return work;
+}
@@ -0,0 +1,297 @@
+#include <clocksource.h>
+#include <kprint.h>
+#include <macros.h>
+#include <i686/apic.h>
+#include <i686/cpu.h>
+#include <i686/descriptor_tables.h>
+#include <i686/isr.h>
+#include <i686/math64.h>
+#include <i686/smp.h>
+#include <mm/paging.h>
+
+/**
+ * Local APIC
+ *
+ * 	The local APIC of the boot CPU receives device interrupts from the I/O
+ * 	APIC (see irq.c). Every CPU uses its own local APIC for its timer and
+ * 	for inter-processor interrupts, they all sit at the same address and
+ * 	are assumed to run at the rate measured on the boot CPU.
+ *
+ * 	The APIC timer counts down at the bus clock divided by 16, the rate is
+ * 	measured against PIT channel 2. When the CPU supports it, one-shots use
+ * 	TSC-deadline mode instead, which is programmed with an absolute TSC value
+ * 	(one MSR write) and is immune to the APIC clock being slowed down.
+ */
+
+static volatile uint32_t *apic_registers;
+
+// APIC timer input clock (after the divider)
+static uint32_t apic_timer_khz;
+
+// Converts nanoseconds to APIC timer counts
+static uint32_t ns_to_counts_mult, ns_to_counts_shift;
+
+// Converts nanoseconds to TSC cycles (TSC-deadline mode)
+static uint32_t ns_to_tsc_mult, ns_to_tsc_shift;
+
+static bool tsc_deadline;
+
+// Current LVT timer mode, by CPU
+static uint32_t timer_mode[SMP_MAX_CPUS];
+
+static uint64_t apic_timer_read();
+static void apic_timer_set_mode(uint32_t mode);
+static void apic_timer_set_periodic(uint32_t frequency);
+static void apic_timer_set_oneshot(uint64_t ns);
+static void apic_timer_stop();
+
+static struct timer_event_source apic_timer_event_source = {
+	.name             = "lapic",
+	.interrupt_number = APIC_TIMER,
+	.set_periodic     = apic_timer_set_periodic,
+	.set_oneshot      = apic_timer_set_oneshot,
+	.stop             = apic_timer_stop,
+	.acknowledge      = apic_eoi,
+};
+
+/**
+ * @brief      Detect and enable the local APIC
+ *
+ * @return     True if the local APIC is enabled, False if there is none
+ */
+bool apic_init()
+{
+	struct cpuid_registers registers;
+	uint64_t base;
+
+	apic_registers = NULL;
+
+	cpuid(CPUID_LEAF_FEATURES, &registers);
+	if(!(registers.edx & CPUID_FEATURE_EDX_APIC) || !(registers.edx & CPUID_FEATURE_EDX_MSR))
+		return false;
+
+	tsc_deadline = (registers.ecx & CPUID_FEATURE_ECX_TSC_DEADLINE) != 0;
+
+	// Firmware may have disabled it, enable again at the same address
+	base = rdmsr(APIC_BASE_MSR);
+	wrmsr(APIC_BASE_MSR, base | APIC_BASE_MSR_ENABLE);
+
+	apic_registers = paging_map_mmio((uintptr_t)(base & APIC_BASE_ADDRESS_MASK), PAGE_SIZE);
+	if(apic_registers == NULL)
+		return false;
+
+	apic_init_cpu();
+
+	kprintf(KPRINT_DEBUG "Local APIC %d at 0x%x\n", apic_id(), (uint32_t)(base & APIC_BASE_ADDRESS_MASK));
+
+	return true;
+}
+
+/**
+ * @brief      Enable the local APIC of the CPU running this code. apic_init() must have been called on the boot CPU.
+ */
+void apic_init_cpu()
+{
+	uint64_t base;
+
+	base = rdmsr(APIC_BASE_MSR);
+	wrmsr(APIC_BASE_MSR, base | APIC_BASE_MSR_ENABLE);
+
+	// Accept every priority, software enable with the spurious vector
+	apic_write(APIC_REGISTER_TPR, 0);
+	apic_write(APIC_REGISTER_SPURIOUS, APIC_SPURIOUS | APIC_SPURIOUS_ENABLE);
+
+	// Timer stays quiet until used
+	apic_write(APIC_REGISTER_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_REGISTER_LVT_TIMER, APIC_TIMER | APIC_LVT_MASKED);
+	apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+
+	timer_mode[cpu_id()] = APIC_LVT_MASKED;
+}
+
+/**
+ * @brief      Send an inter-processor interrupt
+ *
+ * @param[in]  destination  The APIC ID of the destination CPU
+ * @param[in]  command      Vector, delivery mode and level (APIC_ICR_*)
+ */
+void apic_send_ipi(uint8_t destination, uint32_t command)
+{
+	// Not interrupted between the two halves
+	irq_disable();
+
+	apic_write(APIC_REGISTER_ICR_HIGH, (uint32_t)destination << APIC_ICR_DESTINATION_SHIFT);
+
+	// Writing the low half sends it
+	apic_write(APIC_REGISTER_ICR_LOW, command);
+
+	while(apic_read(APIC_REGISTER_ICR_LOW) & APIC_ICR_SEND_PENDING)
+		asm volatile("pause");
+
+	irq_resume();
+}
+
+/**
+ * @brief      Check if the local APIC was enabled by apic_init()
+ *
+ * @return     True if enabled, False if not
+ */
+bool apic_is_enabled()
+{
+	return apic_registers != NULL;
+}
+
+/**
+ * @brief      Read a local APIC register
+ *
+ * @param[in]  reg   The register offset
+ *
+ * @return     Value of the register
+ */
+uint32_t apic_read(uint32_t reg)
+{
+	return apic_registers[reg / sizeof(uint32_t)];
+}
+
+/**
+ * @brief      Write a local APIC register
+ *
+ * @param[in]  reg    The register offset
+ * @param[in]  value  The value to write
+ */
+void apic_write(uint32_t reg, uint32_t value)
+{
+	apic_registers[reg / sizeof(uint32_t)] = value;
+}
+
+/**
+ * @brief      Signal end of interrupt to the local APIC
+ */
+void apic_eoi()
+{
+	apic_write(APIC_REGISTER_EOI, 0);
+}
+
+/**
+ * @brief      Get the ID of the local APIC
+ *
+ * @return     The APIC ID
+ */
+uint8_t apic_id()
+{
+	return (uint8_t)(apic_read(APIC_REGISTER_ID) >> 24);
+}
+
+/**
+ * @brief      Calibrate the local APIC timer. The clocksource must be initialized.
+ *
+ * @return     The APIC timer event source, or NULL if it cannot be used
+ */
+struct timer_event_source *apic_timer_init()
+{
+	const struct clocksource *clocksource;
+
+	if(!apic_is_enabled())
+		return NULL;
+
+	// Free run from the top while being measured
+	apic_write(APIC_REGISTER_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_REGISTER_LVT_TIMER, APIC_TIMER | APIC_LVT_MASKED | APIC_TIMER_ONESHOT);
+	apic_write(APIC_REGISTER_TIMER_INITIAL, 0xFFFFFFFF);
+
+	apic_timer_khz = clocksource_calibrate(apic_timer_read);
+
+	apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+
+	if(apic_timer_khz == 0) {
+		kprintf(KPRINT_ERROR "Local APIC timer calibration failed\n");
+		return NULL;
+	}
+
+	clocksource_calculate_mult_shift(&ns_to_counts_mult, &ns_to_counts_shift, NSEC_PER_MSEC, apic_timer_khz);
+
+	// Deadlines are TSC values, only usable if the TSC is the (calibrated) clocksource
+	clocksource = clocksource_get();
+	if(tsc_deadline && clocksource->continuous)
+		clocksource_calculate_mult_shift(&ns_to_tsc_mult, &ns_to_tsc_shift, NSEC_PER_MSEC, clocksource->frequency_khz);
+	else
+		tsc_deadline = false;
+
+	kprintf(KPRINT_DEBUG "Local APIC Timer Frequency: %d kHz%s\n", apic_timer_khz,
+		tsc_deadline ? " (TSC-deadline)" : "");
+
+	return &apic_timer_event_source;
+}
+
+/**
+ * @brief      Read the APIC timer as an up counter. Used for calibration.
+ */
+static uint64_t apic_timer_read()
+{
+	return 0xFFFFFFFF - apic_read(APIC_REGISTER_TIMER_CURRENT);
+}
+
+/**
+ * @brief      Switch the timer mode, only touches the LVT when the mode changes
+ *
+ * @param[in]  mode  The mode (APIC_TIMER_*)
+ */
+static void apic_timer_set_mode(uint32_t mode)
+{
+	uint32_t cpu;
+
+	cpu = cpu_id();
+	if(timer_mode[cpu] == mode)
+		return;
+
+	apic_write(APIC_REGISTER_LVT_TIMER, APIC_TIMER | mode);
+	timer_mode[cpu] = mode;
+}
+
+/**
+ * @brief      Interrupt at a fixed frequency
+ *
+ * @param[in]  frequency  The frequency in HZ
+ */
+static void apic_timer_set_periodic(uint32_t frequency)
+{
+	uint64_t counts;
+
+	counts = div_u64_u32((uint64_t)apic_timer_khz * 1000, frequency, NULL);
+
+	apic_timer_set_mode(APIC_TIMER_PERIODIC);
+	apic_write(APIC_REGISTER_TIMER_INITIAL, (uint32_t)MAX(MIN(counts, 0xFFFFFFFF), 1));
+}
+
+/**
+ * @brief      Interrupt once after a delay. Replaces any pending one-shot.
+ *
+ * @param[in]  ns    The delay in nanoseconds
+ */
+static void apic_timer_set_oneshot(uint64_t ns)
+{
+	uint64_t counts;
+
+	if(tsc_deadline) {
+		apic_timer_set_mode(APIC_TIMER_TSC_DEADLINE);
+		wrmsr(TSC_DEADLINE_MSR, rdtsc() + MAX(mul_u64_u32_shr(ns, ns_to_tsc_mult, ns_to_tsc_shift), 1));
+		return;
+	}
+
+	counts = mul_u64_u32_shr(ns, ns_to_counts_mult, ns_to_counts_shift);
+
+	// Longer delays just fire early, the timer code programs the rest
+	apic_timer_set_mode(APIC_TIMER_ONESHOT);
+	apic_write(APIC_REGISTER_TIMER_INITIAL, (uint32_t)MAX(MIN(counts, 0xFFFFFFFF), 1));
+}
+
+/**
+ * @brief      Stop the timer
+ */
+static void apic_timer_stop()
+{
+	if(timer_mode[cpu_id()] == APIC_TIMER_TSC_DEADLINE)
+		wrmsr(TSC_DEADLINE_MSR, 0);
+	else
+		apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+}
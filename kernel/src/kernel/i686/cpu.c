@@ -0,0 +1,58 @@
+#include <i686/cpu.h>
+
+/**
+ * @brief      Execute the CPUID instruction
+ *
+ * @param[in]  leaf       The leaf to query (EAX)
+ * @param      registers  Set to the returned registers
+ */
+void cpuid(uint32_t leaf, struct cpuid_registers *registers)
+{
+	asm volatile("cpuid"
+				 : "=a"(registers->eax), "=b"(registers->ebx),
+				   "=c"(registers->ecx), "=d"(registers->edx)
+				 : "a"(leaf), "c"(0));
+}
+
+/**
+ * @brief      Read the time stamp counter
+ *
+ * @return     The number of cycles since reset
+ */
+uint64_t rdtsc()
+{
+	uint32_t low, high;
+
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief      Read a model specific register
+ *
+ * @param[in]  msr   The MSR number
+ *
+ * @return     Value of the MSR
+ */
+uint64_t rdmsr(uint32_t msr)
+{
+	uint32_t low, high;
+
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief      Write a model specific register
+ *
+ * @param[in]  msr    The MSR number
+ * @param[in]  value  The value to write
+ */
+void wrmsr(uint32_t msr, uint64_t value)
+{
+	asm volatile("wrmsr"
+				 :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))
+				 : "memory");
+}
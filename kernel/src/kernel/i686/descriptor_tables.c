@@ -1,14 +1,16 @@
 #include <i686/descriptor_tables.h>
 #include <i686/isr.h>
+#include <i686/smp.h>
 #include <string.h>
 
-struct gdt_entry_s gdt_entries[6];
+struct gdt_entry_s gdt_entries[GDT_PERCPU_INDEX + SMP_MAX_CPUS];
 struct gdt_ptr_s   gdt_ptr;
 
 struct idt_entry_s idt_entries[MAX_ISR_NUMBER];
 struct idt_ptr_s   idt_ptr;
 
-struct task_state_segment_s tss_entry;
+// Indexed by CPU, the TSS holds the kernel stack used when a CPU leaves user mode
+struct task_state_segment_s tss_entries[SMP_MAX_CPUS];
 
 static void gdt_init();
 static void idt_init();
@@ -16,6 +18,8 @@ static void irq_init();
 
 static void gdt_set_gate(uint8_t index, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity);
 static void tss_set_gate(uint8_t index, struct task_state_segment_s *tss_entry);
+static void percpu_set_gate(uint32_t cpu);
+static inline void percpu_load(uint32_t cpu);
 static void idt_set_gate(uint8_t index, uint32_t base, uint16_t sel, uint8_t flags);
 
 extern void isr0();
@@ -68,20 +72,52 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
+// irq48 - irq111
+extern void (*irq_device_stubs[IRQ_DEVICE_LAST - IRQ_DEVICE_FIRST + 1])();
+
+extern void irq240();
+extern void irq241();
+extern void irq255();
+
 /**
- * @brief      Initialize all descriptor tables
+ * @brief      Initialize all descriptor tables. Run before anything else, per-CPU data
+ *              (irq_disable() and cpu_id() included) is reached through the GDT.
  */
 void descriptor_tables_init()
 {
 	gdt_init();
 	gdt_flush((uint32_t)&gdt_ptr);
-	tss_flush();
+	tss_flush(GDT_TSS_SELECTOR | 3);
+	percpu_load(0);
 
 	idt_init();
 	irq_init();
 	idt_flush((uint32_t)&idt_ptr);
 }
 
+/**
+ * @brief      Load the descriptor tables on an AP. The tables are shared, only the TSS and per-CPU data segment differ.
+ *
+ * @param[in]  cpu   The index of the CPU
+ */
+void descriptor_tables_init_cpu(uint32_t cpu)
+{
+	gdt_flush((uint32_t)&gdt_ptr);
+	tss_flush((GDT_TSS_SELECTOR + cpu * sizeof(struct gdt_entry_s)) | 3);
+	percpu_load(cpu);
+	idt_flush((uint32_t)&idt_ptr);
+}
+
+/**
+ * @brief      Set the stack the CPU switches to when interrupted in user mode
+ *
+ * @param[in]  esp0  The kernel stack of the process about to run
+ */
+void tss_set_kernel_stack(uint32_t esp0)
+{
+	tss_entries[cpu_id()].esp0 = esp0;
+}
+
 /**
  * @brief      Initialize the GDT
  */
@@ -114,8 +150,39 @@ static void gdt_init()
 	gdt_set_gate(4, 0, 0xFFFFFFFF,
 		GDT_PRESENT | GDT_RING_3 | GDT_NOT_SYSTEM_SEGMENT | GDT_READ_WRITE, 0xCF);
 
-	// Task State Segment (TSS)
-	tss_set_gate(5, &tss_entry);
+	// Task State Segments (TSS), one per CPU
+	for(uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		tss_set_gate(GDT_TSS_INDEX + cpu, &tss_entries[cpu]);
+
+	// Per-CPU data segments, one per CPU
+	for(uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		percpu_set_gate(cpu);
+}
+
+/**
+ * @brief      Populate the data segment covering the struct cpu of a CPU
+ *
+ * @param[in]  cpu   The index of the CPU
+ */
+static void percpu_set_gate(uint32_t cpu)
+{
+	cpus[cpu].self = &cpus[cpu];
+	cpus[cpu].id   = cpu;
+
+	// Byte granular, only the struct itself is reachable
+	gdt_set_gate(GDT_PERCPU_INDEX + cpu, (uint32_t)&cpus[cpu], sizeof(struct cpu) - 1,
+		GDT_PRESENT | GDT_NOT_SYSTEM_SEGMENT | GDT_READ_WRITE, 0x40);
+}
+
+/**
+ * @brief      Point %gs at the per-CPU data of a CPU. Kernel code never changes it, the interrupt
+ *              stubs load it again when coming from user mode.
+ *
+ * @param[in]  cpu   The index of the CPU
+ */
+static inline void percpu_load(uint32_t cpu)
+{
+	asm volatile("mov %0, %%gs" :: "r"((uint16_t)GDT_PERCPU_SELECTOR(cpu)) : "memory");
 }
 
 /**
@@ -186,6 +253,15 @@ static void irq_init()
 	idt_set_gate(IRQ13, (uint32_t)irq13, 0x08, 0x8E);
 	idt_set_gate(IRQ14, (uint32_t)irq14, 0x08, 0x8E);
 	idt_set_gate(IRQ15, (uint32_t)irq15, 0x08, 0x8E);
+
+	// Device vectors
+	for(uint32_t vector = IRQ_DEVICE_FIRST; vector <= IRQ_DEVICE_LAST; vector++)
+		idt_set_gate(vector, (uint32_t)irq_device_stubs[vector - IRQ_DEVICE_FIRST], 0x08, 0x8E);
+
+	// Local APIC
+	idt_set_gate(APIC_TIMER,          (uint32_t)irq240, 0x08, 0x8E);
+	idt_set_gate(APIC_IPI_RESCHEDULE, (uint32_t)irq241, 0x08, 0x8E);
+	idt_set_gate(APIC_SPURIOUS,       (uint32_t)irq255, 0x08, 0x8E);
 }
 
 /**
@@ -0,0 +1,74 @@
+#include <i686/extable.h>
+
+extern struct exception_table_entry _exception_table_start, _exception_table_end;
+
+/**
+ * @brief      Sort the exception table by instruction address so it can be binary searched
+ */
+void extable_init()
+{
+	struct exception_table_entry *start, *end, tmp;
+	struct exception_table_entry *i, *j;
+
+	start = &_exception_table_start;
+	end   = &_exception_table_end;
+
+	// Insertion sort, the table is small and mostly sorted already
+	for(i = start + 1; i < end; i++) {
+		tmp = *i;
+		for(j = i; j > start && (j - 1)->instruction > tmp.instruction; j--)
+			*j = *(j - 1);
+		*j = tmp;
+	}
+}
+
+/**
+ * @brief      Find the fixup for an instruction
+ *
+ * @param[in]  instruction  The address of the faulting instruction
+ *
+ * @return     The address of the fixup code, or 0x00 if the instruction is not allowed to fault
+ */
+uintptr_t extable_search(uintptr_t instruction)
+{
+	struct exception_table_entry *table;
+	uint32_t low, high, middle;
+
+	table = &_exception_table_start;
+	low   = 0;
+	high  = &_exception_table_end - &_exception_table_start;
+
+	while(low < high) {
+		middle = low + (high - low) / 2;
+
+		if(table[middle].instruction == instruction)
+			return table[middle].fixup;
+
+		if(table[middle].instruction < instruction)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return 0x00;
+}
+
+/**
+ * @brief      Redirect a faulting instruction to its fixup code
+ *
+ * @param      args  The arguments passed from the initial ISR handler
+ *
+ * @return     True if the fault will return into fixup code, False if the fault is not expected
+ */
+bool extable_fixup(struct isr_arguments *args)
+{
+	uintptr_t fixup;
+
+	fixup = extable_search(args->eip);
+	if(fixup == 0x00)
+		return false;
+
+	// Resume at the fixup code when the ISR returns
+	args->eip = fixup;
+	return true;
+}
@@ -0,0 +1,160 @@
+#include <kprint.h>
+#include <spinlock.h>
+#include <string.h>
+#include <i686/cpu.h>
+#include <i686/interrupt_stats.h>
+#include <i686/isr.h>
+#include <i686/math64.h>
+#include <multitasking/process.h>
+
+/**
+ * Interrupt statistics
+ *
+ * 	The interrupt stubs read the TSC before calling the handler, keeping it
+ * 	in ESI:EDI (callee saved, and restored by popa on exit anyway), along with
+ * 	the switch count of this CPU in EBX. interrupt_stats_account() is called once the
+ * 	handler returns, still with interrupts disabled, and adds the run to the
+ * 	vector's counters. That is one RDTSC on each side of the handler and a
+ * 	handful of increments, cheap enough to always be on.
+ *
+ * 	A handler that switched process (the timer preempting, a page fault
+ * 	sleeping on the disk) returns long after it was entered, so those runs
+ * 	are only counted, not timed. A process resumed on another CPU compares
+ * 	against that CPU's count, which is just as unlikely to match. Without a
+ * 	TSC only the counts are kept.
+ *
+ * 	Vectors raised on every CPU (the local APIC timer) are accounted
+ * 	concurrently, each vector has a lock of its own so different vectors
+ * 	never contend.
+ */
+
+// Checked by the interrupt stubs before reading the TSC
+uint32_t interrupt_stats_use_tsc;
+
+static struct interrupt_stats stats[MAX_ISR_NUMBER];
+static spinlock_t stats_locks[MAX_ISR_NUMBER];
+
+/**
+ * @brief      Clear the statistics and check for a TSC
+ */
+void interrupt_stats_init()
+{
+	struct cpuid_registers registers;
+
+	memset(stats, 0, sizeof(stats));
+	for(uint32_t vector = 0; vector < MAX_ISR_NUMBER; vector++)
+		spinlock_init(&stats_locks[vector], "interrupt stats");
+
+	cpuid(CPUID_LEAF_FEATURES, &registers);
+	interrupt_stats_use_tsc = (registers.edx & CPUID_FEATURE_EDX_TSC) != 0;
+}
+
+/**
+ * @brief      Add a handler run to the statistics of its vector. Called by the interrupt stubs.
+ *
+ * @param      args          The interrupt arguments
+ * @param[in]  start_low     Low half of the TSC before the handler ran (0 without a TSC)
+ * @param[in]  start_high    High half of the TSC before the handler ran
+ * @param[in]  switch_count  switch count of this CPU before the handler ran
+ */
+void interrupt_stats_account(struct isr_arguments *args, uint32_t start_low, uint32_t start_high,
+	uint32_t switch_count)
+{
+	struct interrupt_stats *vector_stats;
+	uint64_t elapsed;
+	uint32_t vector, cycles, bucket;
+
+	vector = args->interrupt_number & (MAX_ISR_NUMBER - 1);
+	vector_stats = &stats[vector];
+
+	// Before taking the lock, so waiting for it is not counted
+	elapsed = interrupt_stats_use_tsc ? rdtsc() - (((uint64_t)start_high << 32) | start_low) : 0;
+	cycles  = (elapsed >> 32) ? 0xFFFFFFFF : (uint32_t)elapsed;
+
+	spin_lock(&stats_locks[vector]);
+
+	vector_stats->count++;
+
+	if(!interrupt_stats_use_tsc)
+		goto done;
+
+	if(switch_count != this_cpu_read(switch_count)) {
+		vector_stats->switched++;
+		goto done;
+	}
+
+	vector_stats->cycles += elapsed;
+	if(cycles > vector_stats->max_cycles)
+		vector_stats->max_cycles = cycles;
+
+	// log2 of the cycles, runs of 0 or 1 cycles land in the first bucket
+	bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+	vector_stats->histogram[bucket]++;
+
+done:
+	spin_unlock(&stats_locks[vector]);
+}
+
+/**
+ * @brief      Get a copy of the statistics of a vector
+ *
+ * @param[in]  vector  The interrupt vector
+ * @param      copy    Set to the statistics
+ *
+ * @return     True if the vector has fired since the last reset, False if not
+ */
+bool interrupt_stats_get(uint8_t vector, struct interrupt_stats *copy)
+{
+	spin_lock_irqsave(&stats_locks[vector]);
+	memcpy(copy, &stats[vector], sizeof(struct interrupt_stats));
+	spin_unlock_irqrestore(&stats_locks[vector]);
+
+	return copy->count != 0;
+}
+
+/**
+ * @brief      Clear the statistics of every vector
+ */
+void interrupt_stats_reset()
+{
+	for(uint32_t vector = 0; vector < MAX_ISR_NUMBER; vector++) {
+		spin_lock_irqsave(&stats_locks[vector]);
+		memset(&stats[vector], 0, sizeof(struct interrupt_stats));
+		spin_unlock_irqrestore(&stats_locks[vector]);
+	}
+}
+
+/**
+ * @brief      Print the statistics of every vector that has fired. Goes out over serial with the rest of kprintf.
+ */
+void interrupt_stats_dump()
+{
+	struct interrupt_stats copy;
+	uint32_t timed;
+
+	kprintf("------------------------\n");
+	kprintf("Interrupt statistics (%s)\n", interrupt_stats_use_tsc ? "TSC cycles" : "counts only");
+
+	for(uint32_t vector = 0; vector < MAX_ISR_NUMBER; vector++) {
+		// Copied so printing does not hold interrupts off
+		if(!interrupt_stats_get(vector, &copy))
+			continue;
+
+		kprintf("Vector %d: count %d, switched %d", vector, copy.count, copy.switched);
+
+		timed = copy.count - copy.switched;
+		if(interrupt_stats_use_tsc && timed) {
+			kprintf(", avg %d, max %d\n",
+				(uint32_t)div_u64_u32(copy.cycles, timed, NULL), copy.max_cycles);
+
+			for(uint32_t bucket = 0; bucket < INTERRUPT_STATS_BUCKETS; bucket++) {
+				if(copy.histogram[bucket])
+					kprintf("\t>= 2^%d cycles: %d\n", bucket, copy.histogram[bucket]);
+			}
+		} else {
+			kprintf("\n");
+		}
+	}
+
+	kprintf("------------------------\n");
+}
@@ -0,0 +1,307 @@
+#include <kprint.h>
+#include <spinlock.h>
+#include <i686/apic.h>
+#include <i686/descriptor_tables.h>
+#include <i686/ioapic.h>
+#include <i686/isr.h>
+#include <mm/paging.h>
+
+/**
+ * I/O APIC
+ *
+ * 	Every I/O APIC handles a range of global system interrupts (GSIs), one
+ * 	redirection entry per line holding the vector, trigger mode, polarity and
+ * 	mask. The ranges and the ISA IRQs that are not wired to the GSI of the
+ * 	same number (the PIT is usually on GSI 2) come from the ACPI MADT.
+ *
+ * 	ISA IRQs keep their 8259 vectors (IRQ0 - IRQ15), so handlers installed
+ * 	for them do not care which controller is in use. Everything is routed
+ * 	to the local APIC of the boot CPU.
+ *
+ * 	Registers are reached through an index and a data window, so every
+ * 	access after init goes through ioapic_lock (any CPU may mask a line).
+ */
+
+struct ioapic {
+	volatile uint32_t *registers;
+	uint32_t gsi_base;
+	uint32_t gsi_count;
+};
+
+static struct ioapic ioapics[IOAPIC_MAX_NUMBER];
+static uint32_t number_of_ioapics;
+
+// ISA IRQ wiring, after interrupt source overrides
+static uint32_t isa_gsi[IOAPIC_ISA_IRQS];
+static uint32_t isa_flags[IOAPIC_ISA_IRQS];
+static bool isa_present[IOAPIC_ISA_IRQS];
+
+// Line each vector was last routed from, so handlers can mask by vector
+static uint32_t vector_gsi[MAX_ISR_NUMBER];
+static bool vector_routed[MAX_ISR_NUMBER];
+
+static spinlock_t ioapic_lock = SPINLOCK_INITIALIZER("ioapic");
+
+static void add_ioapic(MADT_IO_APIC_Entry *entry);
+static void add_override(MADT_Interrupt_Override_Entry *entry);
+static struct ioapic *find_ioapic(uint32_t gsi);
+static uint32_t ioapic_read(struct ioapic *ioapic, uint8_t reg);
+static void ioapic_write(struct ioapic *ioapic, uint8_t reg, uint32_t value);
+
+/**
+ * @brief      Find the I/O APICs in the MADT, mask every line and route the ISA IRQs
+ *
+ * @param      madt  The MADT
+ *
+ * @return     True if there is an I/O APIC, False if not (keep using the 8259 PIC)
+ */
+bool ioapic_init(MADT *madt)
+{
+	MADT_Entry_Header *entry;
+	uint8_t *position, *end;
+
+	number_of_ioapics = 0;
+	if(madt == NULL)
+		return false;
+
+	// ISA IRQs are edge triggered, active high, on the GSI of the same number unless overridden
+	for(uint32_t irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+		isa_gsi[irq]     = irq;
+		isa_flags[irq]   = 0;
+		isa_present[irq] = true;
+	}
+
+	for(uint32_t vector = 0; vector < MAX_ISR_NUMBER; vector++)
+		vector_routed[vector] = false;
+
+	position = madt->entries;
+	end      = (uint8_t*)madt + madt->header.length;
+	while(position + sizeof(MADT_Entry_Header) <= end) {
+		entry = (MADT_Entry_Header*)position;
+		if(entry->length < sizeof(MADT_Entry_Header))
+			break;
+
+		if(entry->type == MADT_IO_APIC)
+			add_ioapic((MADT_IO_APIC_Entry*)entry);
+		else if(entry->type == MADT_INTERRUPT_OVERRIDE)
+			add_override((MADT_Interrupt_Override_Entry*)entry);
+
+		position += entry->length;
+	}
+
+	if(number_of_ioapics == 0)
+		return false;
+
+	for(uint32_t irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+		if(isa_present[irq])
+			ioapic_set_entry(isa_gsi[irq], IRQ0 + irq, isa_flags[irq] | IOAPIC_MASKED);
+	}
+
+	return true;
+}
+
+/**
+ * @brief      Get the GSI an ISA IRQ is wired to
+ *
+ * @param[in]  irq   The ISA IRQ
+ * @param      gsi   Set to the GSI
+ *
+ * @return     True if the IRQ is wired to an I/O APIC, False if not
+ */
+bool ioapic_isa_to_gsi(uint8_t irq, uint32_t *gsi)
+{
+	if(irq >= IOAPIC_ISA_IRQS || !isa_present[irq] || find_ioapic(isa_gsi[irq]) == NULL)
+		return false;
+
+	*gsi = isa_gsi[irq];
+	return true;
+}
+
+/**
+ * @brief      Program the redirection entry of a line
+ *
+ * @param[in]  gsi     The GSI of the line
+ * @param[in]  vector  The vector to raise
+ * @param[in]  flags   IOAPIC_ACTIVE_LOW, IOAPIC_LEVEL and IOAPIC_MASKED
+ *
+ * @return     True if programmed, False if no I/O APIC handles the GSI
+ */
+bool ioapic_set_entry(uint32_t gsi, uint8_t vector, uint32_t flags)
+{
+	struct ioapic *ioapic;
+	uint8_t reg;
+
+	ioapic = find_ioapic(gsi);
+	if(ioapic == NULL)
+		return false;
+
+	reg = IOAPIC_REDIRECTION + 2 * (gsi - ioapic->gsi_base);
+
+	spin_lock_irqsave(&ioapic_lock);
+
+	// Masked while the halves disagree
+	ioapic_write(ioapic, reg, IOAPIC_MASKED);
+	ioapic_write(ioapic, reg + 1, (uint32_t)apic_id() << IOAPIC_DESTINATION_SHIFT);
+	ioapic_write(ioapic, reg, vector | (flags & (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL | IOAPIC_MASKED)));
+
+	vector_gsi[vector]    = gsi;
+	vector_routed[vector] = true;
+
+	spin_unlock_irqrestore(&ioapic_lock);
+	return true;
+}
+
+/**
+ * @brief      Get the line a vector is routed from
+ *
+ * @param[in]  vector  The vector
+ * @param      gsi     Set to the GSI of the line
+ *
+ * @return     True if a line raises the vector, False if not (MSI, local APIC)
+ */
+bool ioapic_vector_to_gsi(uint8_t vector, uint32_t *gsi)
+{
+	if(!vector_routed[vector])
+		return false;
+
+	*gsi = vector_gsi[vector];
+	return true;
+}
+
+/**
+ * @brief      Stop a line from raising its vector
+ *
+ * @param[in]  gsi   The GSI of the line
+ */
+void ioapic_mask(uint32_t gsi)
+{
+	struct ioapic *ioapic;
+	uint8_t reg;
+
+	ioapic = find_ioapic(gsi);
+	if(ioapic == NULL)
+		return;
+
+	reg = IOAPIC_REDIRECTION + 2 * (gsi - ioapic->gsi_base);
+
+	spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(ioapic, reg, ioapic_read(ioapic, reg) | IOAPIC_MASKED);
+	spin_unlock_irqrestore(&ioapic_lock);
+}
+
+/**
+ * @brief      Let a line raise its vector
+ *
+ * @param[in]  gsi   The GSI of the line
+ */
+void ioapic_unmask(uint32_t gsi)
+{
+	struct ioapic *ioapic;
+	uint8_t reg;
+
+	ioapic = find_ioapic(gsi);
+	if(ioapic == NULL)
+		return;
+
+	reg = IOAPIC_REDIRECTION + 2 * (gsi - ioapic->gsi_base);
+
+	spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(ioapic, reg, ioapic_read(ioapic, reg) & ~IOAPIC_MASKED);
+	spin_unlock_irqrestore(&ioapic_lock);
+}
+
+/**
+ * @brief      Map an I/O APIC from the MADT and mask all of its lines
+ *
+ * @param      entry  The MADT entry
+ */
+static void add_ioapic(MADT_IO_APIC_Entry *entry)
+{
+	struct ioapic *ioapic;
+
+	if(number_of_ioapics >= IOAPIC_MAX_NUMBER) {
+		kprintf(KPRINT_ERROR "I/O APIC %d ignored, too many\n", entry->io_apic_id);
+		return;
+	}
+
+	ioapic = &(ioapics[number_of_ioapics]);
+	ioapic->registers = paging_map_mmio(entry->address, PAGE_SIZE);
+	if(ioapic->registers == NULL)
+		return;
+
+	ioapic->gsi_base  = entry->gsi_base;
+	ioapic->gsi_count = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+	for(uint32_t line = 0; line < ioapic->gsi_count; line++)
+		ioapic_write(ioapic, IOAPIC_REDIRECTION + 2 * line, IOAPIC_MASKED);
+
+	number_of_ioapics++;
+
+	kprintf(KPRINT_DEBUG "I/O APIC %d at 0x%x: GSI %d - %d\n", entry->io_apic_id, entry->address,
+		ioapic->gsi_base, ioapic->gsi_base + ioapic->gsi_count - 1);
+}
+
+/**
+ * @brief      Apply an interrupt source override from the MADT
+ *
+ * @param      entry  The MADT entry
+ */
+static void add_override(MADT_Interrupt_Override_Entry *entry)
+{
+	uint32_t flags;
+
+	// Only ISA overrides exist
+	if(entry->bus != 0 || entry->source >= IOAPIC_ISA_IRQS)
+		return;
+
+	// Flags left as "conforms to the bus" keep the ISA defaults
+	flags = 0;
+	if((entry->flags & MADT_POLARITY_MASK) == MADT_POLARITY_ACTIVE_LOW)
+		flags |= IOAPIC_ACTIVE_LOW;
+	if((entry->flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL)
+		flags |= IOAPIC_LEVEL;
+
+	isa_gsi[entry->source]   = entry->gsi;
+	isa_flags[entry->source] = flags;
+
+	// The ISA IRQ that would have used this GSI is not connected (IRQ2, the cascade, for the PIT)
+	if(entry->gsi < IOAPIC_ISA_IRQS && entry->gsi != entry->source)
+		isa_present[entry->gsi] = false;
+
+	kprintf(KPRINT_DEBUG "ISA IRQ %d -> GSI %d\n", entry->source, entry->gsi);
+}
+
+/**
+ * @brief      Find the I/O APIC handling a GSI
+ *
+ * @param[in]  gsi   The GSI
+ *
+ * @return     The I/O APIC, or NULL if none handles the GSI
+ */
+static struct ioapic *find_ioapic(uint32_t gsi)
+{
+	for(uint32_t i = 0; i < number_of_ioapics; i++) {
+		if(gsi >= ioapics[i].gsi_base && gsi - ioapics[i].gsi_base < ioapics[i].gsi_count)
+			return &(ioapics[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief      Read an I/O APIC register. Interrupts must be disabled.
+ */
+static uint32_t ioapic_read(struct ioapic *ioapic, uint8_t reg)
+{
+	ioapic->registers[IOAPIC_REGISTER_SELECT / sizeof(uint32_t)] = reg;
+	return ioapic->registers[IOAPIC_REGISTER_WINDOW / sizeof(uint32_t)];
+}
+
+/**
+ * @brief      Write an I/O APIC register. Interrupts must be disabled.
+ */
+static void ioapic_write(struct ioapic *ioapic, uint8_t reg, uint32_t value)
+{
+	ioapic->registers[IOAPIC_REGISTER_SELECT / sizeof(uint32_t)] = reg;
+	ioapic->registers[IOAPIC_REGISTER_WINDOW / sizeof(uint32_t)] = value;
+}
@@ -0,0 +1,222 @@
+#include <acpi.h>
+#include <kprint.h>
+#include <spinlock.h>
+#include <i686/apic.h>
+#include <i686/descriptor_tables.h>
+#include <i686/ioapic.h>
+#include <i686/irq.h>
+#include <i686/isr.h>
+#include <i686/pic.h>
+
+/**
+ * IRQ controller
+ *
+ * 	Device interrupts come through the I/O APIC when the MADT describes one
+ * 	(and the local APIC is enabled), otherwise through the 8259 PIC. Either
+ * 	way ISA IRQ N raises vector IRQ0 + N. The I/O APIC is acknowledged with a
+ * 	single MMIO write to the local APIC instead of port I/O to one or both PICs.
+ *
+ * 	Vectors IRQ_DEVICE_FIRST - IRQ_DEVICE_LAST are handed out by
+ * 	irq_allocate_vector() for lines beyond the ISA IRQs and for MSIs.
+ */
+
+#define NUMBER_OF_DEVICE_VECTORS (IRQ_DEVICE_LAST - IRQ_DEVICE_FIRST + 1)
+
+static bool use_ioapic;
+
+// Bit N is set when vector IRQ_DEVICE_FIRST + N is in use
+static uint32_t device_vectors[(NUMBER_OF_DEVICE_VECTORS + 31) / 32];
+static spinlock_t device_vectors_lock = SPINLOCK_INITIALIZER("device vectors");
+
+/**
+ * @brief      Switch to the I/O APIC if there is one. acpi_init() and apic_init() must have been called.
+ */
+void irq_controller_init()
+{
+	use_ioapic = false;
+
+	if(apic_is_enabled() && ioapic_init(acpi_get_madt())) {
+		// Stays remapped so a spurious IRQ can not look like an exception
+		pic_disable();
+		use_ioapic = true;
+	}
+
+	kprintf(KPRINT_DEBUG "Interrupt Controller: %s\n", use_ioapic ? "I/O APIC" : "8259 PIC");
+}
+
+/**
+ * @brief      Check if device interrupts come through the I/O APIC
+ *
+ * @return     True if the I/O APIC is used, False if the 8259 PIC is
+ */
+bool irq_using_ioapic()
+{
+	return use_ioapic;
+}
+
+/**
+ * @brief      Unmask an ISA IRQ
+ *
+ * @param[in]  irq   The IRQ (0 - 15)
+ */
+void enable_irq(uint8_t irq)
+{
+	uint32_t gsi;
+
+	if(!use_ioapic)
+		pic_enable_irq(irq);
+	else if(ioapic_isa_to_gsi(irq, &gsi))
+		ioapic_unmask(gsi);
+}
+
+/**
+ * @brief      Mask an ISA IRQ
+ *
+ * @param[in]  irq   The IRQ (0 - 15)
+ */
+void disable_irq(uint8_t irq)
+{
+	uint32_t gsi;
+
+	if(!use_ioapic)
+		pic_disable_irq(irq);
+	else if(ioapic_isa_to_gsi(irq, &gsi))
+		ioapic_mask(gsi);
+}
+
+/**
+ * @brief      Mask the line raising a vector
+ *
+ * @param[in]  vector  The vector
+ *
+ * @return     True if masked, False if no controller line raises the vector (MSI)
+ */
+bool irq_mask_vector(uint8_t vector)
+{
+	uint32_t gsi;
+
+	if(use_ioapic) {
+		if(!ioapic_vector_to_gsi(vector, &gsi))
+			return false;
+
+		ioapic_mask(gsi);
+		return true;
+	}
+
+	if(vector < IRQ0 || vector > IRQ15)
+		return false;
+
+	pic_disable_irq(vector - IRQ0);
+	return true;
+}
+
+/**
+ * @brief      Unmask the line raising a vector, after irq_mask_vector()
+ *
+ * @param[in]  vector  The vector
+ */
+void irq_unmask_vector(uint8_t vector)
+{
+	uint32_t gsi;
+
+	if(use_ioapic) {
+		if(ioapic_vector_to_gsi(vector, &gsi))
+			ioapic_unmask(gsi);
+	} else if(vector >= IRQ0 && vector <= IRQ15) {
+		pic_enable_irq(vector - IRQ0);
+	}
+}
+
+/**
+ * @brief      Signal end of interrupt to whichever controller raised a vector
+ *
+ * @param[in]  vector  The vector being handled
+ */
+void irq_acknowledge(uint8_t vector)
+{
+	if(!use_ioapic && vector >= IRQ0 && vector <= IRQ15)
+		pic_eoi(vector - IRQ0);
+	else
+		apic_eoi();
+}
+
+/**
+ * @brief      Reserve a free device vector
+ *
+ * @return     The vector, or 0 if none are left
+ */
+uint8_t irq_allocate_vector()
+{
+	return irq_allocate_vectors(1);
+}
+
+/**
+ * @brief      Reserve a block of consecutive device vectors, aligned to its size (as multiple message MSI needs)
+ *
+ * @param[in]  count  The number of vectors, a power of 2
+ *
+ * @return     The first vector, or 0 if no block is free
+ */
+uint8_t irq_allocate_vectors(uint32_t count)
+{
+	uint32_t first, i;
+	uint8_t vector;
+
+	if(count == 0 || (count & (count - 1)) || count > NUMBER_OF_DEVICE_VECTORS)
+		return 0;
+
+	vector = 0;
+
+	spin_lock_irqsave(&device_vectors_lock);
+
+	// IRQ_DEVICE_FIRST is aligned to 16, larger blocks start at the next multiple
+	first = (count - (IRQ_DEVICE_FIRST % count)) % count;
+	for(; first + count <= NUMBER_OF_DEVICE_VECTORS; first += count) {
+		for(i = first; i < first + count; i++) {
+			if(device_vectors[i / 32] & (1u << (i % 32)))
+				break;
+		}
+
+		if(i == first + count) {
+			for(i = first; i < first + count; i++)
+				device_vectors[i / 32] |= (1u << (i % 32));
+
+			vector = IRQ_DEVICE_FIRST + first;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&device_vectors_lock);
+	return vector;
+}
+
+/**
+ * @brief      Release a device vector from irq_allocate_vector()
+ *
+ * @param[in]  vector  The vector
+ */
+void irq_free_vector(uint8_t vector)
+{
+	irq_free_vectors(vector, 1);
+}
+
+/**
+ * @brief      Release a block of device vectors from irq_allocate_vectors()
+ *
+ * @param[in]  vector  The first vector
+ * @param[in]  count   The number of vectors
+ */
+void irq_free_vectors(uint8_t vector, uint32_t count)
+{
+	uint32_t i;
+
+	if(vector < IRQ_DEVICE_FIRST || vector + count - 1 > IRQ_DEVICE_LAST)
+		return;
+
+	spin_lock_irqsave(&device_vectors_lock);
+
+	for(i = vector - IRQ_DEVICE_FIRST; i < vector - IRQ_DEVICE_FIRST + count; i++)
+		device_vectors[i / 32] &= ~(1u << (i % 32));
+
+	spin_unlock_irqrestore(&device_vectors_lock);
+}
@@ -1,12 +1,21 @@
 #include <i686/isr.h>
 #include <i686/descriptor_tables.h>
-#include <i686/pic.h>
+#include <i686/irq.h>
+#include <i686/smp.h>
 #include <portio.h>
 #include <kprint.h>
 
-void (*interrupt_handlers[MAX_ISR_NUMBER])(struct isr_arguments*);
+/**
+ * Synchronisation
+ *
+ * 	irq_disable() / irq_resume() sections only keep interrupts away from the
+ * 	CPU running them, they nest and the nesting count is kept in the
+ * 	sync_depth of this CPU's struct cpu. Data shared between CPUs is protected by spinlocks
+ * 	(spinlock.h), the ones also taken from interrupt handlers are held with
+ * 	interrupts disabled through spin_lock_irqsave().
+ */
 
-static volatile uint32_t sync_depth;
+void (*interrupt_handlers[MAX_ISR_NUMBER])(struct isr_arguments*);
 
 /**
  * @brief      Initialize the interrupt handlers to the defaults below
@@ -14,49 +23,47 @@ static volatile uint32_t sync_depth;
 void isr_init()
 {
 	for(int i = 0; i < MAX_ISR_NUMBER; i++) {
-		if(i >= IRQ0 && i <= IRQ15)
+		if((i >= IRQ0 && i <= IRQ15) || (i >= IRQ_DEVICE_FIRST && i <= IRQ_DEVICE_LAST))
 			interrupt_handlers[i] = default_irq_handler;
 		else 
 			interrupt_handlers[i] = default_isr_handler;
 	}
-
-	sync_depth = 0;
 }
 
 /**
- * @brief      Sets the interrupt service routine sync depth
+ * @brief      Sets the interrupt service routine sync depth of this CPU
  *
  * @param[in]  depth  The depth to set to
  */
 void irq_set_sync_depth(uint32_t depth)
 {
-	sync_depth = depth;
+	this_cpu_write(sync_depth, depth);
 }
 
 /**
- * @brief      Gets the interrupt service routine sync depth
+ * @brief      Gets the interrupt service routine sync depth of this CPU
  */
 uint32_t irq_get_sync_depth()
 {
-	return sync_depth;
+	return this_cpu_read(sync_depth);
 }
 
 /**
- * @brief      Disable IRQs
+ * @brief      Disable IRQs on this CPU
  */
 void irq_disable()
 {
 	uint32_t eflags;
 	eflags = eflags_get();
 
-	// Disable interrupts
+	// Disable interrupts, this CPU's depth can not change under us from here
 	SYNC_CLI();
 
 	// Is interrupt flag set
-	if(eflags & (1 << 9))
-		sync_depth = 1;
+	if(eflags & EFLAGS_INTERRUPT_FLAG)
+		this_cpu_write(sync_depth, 1);
 	else
-		sync_depth++;
+		this_cpu_inc(sync_depth);
 }
 
 /**
@@ -64,25 +71,42 @@ void irq_disable()
  */
 void irq_resume()
 {
+	uint32_t depth;
+
+	depth = this_cpu_read(sync_depth);
+
 	// Only enable interrupts if returned to first call depth
-	if(sync_depth == 0 || sync_depth == 1) {
-		SYNC_STI();
+	if(depth == 0 || depth == 1) {
+		irq_enable();
 	} else {
-		sync_depth--;
+		this_cpu_write(sync_depth, depth - 1);
 	}
 }
 
 /**
- * @brief      Enable IRQs
+ * @brief      Enable IRQs on this CPU
  */
 void irq_enable()
 {
-	sync_depth = 0;
+	this_cpu_write(sync_depth, 0);
 
 	// Enable interrupts
 	SYNC_STI();
 }
 
+/**
+ * @brief      Enable IRQs and halt until the next one arrives. No interrupt can slip in before the halt.
+ */
+void irq_enable_halt()
+{
+	this_cpu_write(sync_depth, 0);
+
+	// STI only takes effect after HLT, so a pending interrupt still wakes the CPU
+	asm volatile("sti\n\t"
+				 "hlt"
+				 ::: "memory");
+}
+
 /**
  * @brief      Installs a new interrupt service routine (ISR) handler
  *
@@ -98,11 +122,7 @@ void default_isr_handler(struct isr_arguments *args)
 {}
 void default_irq_handler(struct isr_arguments *args)
 {
-	out8(PIC1, PIC_ACK);
-
-	// This is the slave that sent this
-	if(args->interrupt_number - IRQ0 > 8)
-		out8(PIC2, PIC_ACK);
+	irq_acknowledge(args->interrupt_number);
 }
 
 /**
@@ -19,7 +19,7 @@ void pic_init()
 	out8(PIC2_DATA, slave_mask);
 }
 
-void enable_irq(uint8_t irq)
+void pic_enable_irq(uint8_t irq)
 {
 	if(irq < 8) {
 		// Enable on master PIC
@@ -38,7 +38,7 @@ void enable_irq(uint8_t irq)
 	}
 }
 
-void disable_irq(uint8_t irq)
+void pic_disable_irq(uint8_t irq)
 {
 	if(irq < 8) {
 		// Disable on master PIC
@@ -58,6 +58,32 @@ void disable_irq(uint8_t irq)
 	}
 }
 
+/**
+ * @brief      Mask every IRQ line, used once the I/O APIC takes over
+ */
+void pic_disable()
+{
+	master_mask = 0xFF;
+	slave_mask  = 0xFF;
+
+	out8(PIC1_DATA, master_mask);
+	out8(PIC2_DATA, slave_mask);
+}
+
+/**
+ * @brief      Signal end of interrupt for an IRQ line
+ *
+ * @param[in]  irq   The IRQ line (0 - 15)
+ */
+void pic_eoi(uint8_t irq)
+{
+	// Slave raised it through the cascade, both need acknowledging
+	if(irq >= 8)
+		out8(PIC2, PIC_ACK);
+
+	out8(PIC1, PIC_ACK);
+}
+
 /**
  * @brief      Remap the Slave and Master PICs to new ISRs.
  * 				Each PIC uses 8 ISR entries. No checks are done
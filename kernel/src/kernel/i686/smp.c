@@ -0,0 +1,295 @@
+#include <acpi.h>
+#include <clocksource.h>
+#include <deferred.h>
+#include <kprint.h>
+#include <string.h>
+#include <timer.h>
+#include <i686/apic.h>
+#include <i686/descriptor_tables.h>
+#include <i686/isr.h>
+#include <i686/smp.h>
+#include <mm/kmalloc.h>
+#include <mm/paging.h>
+#include <multitasking/process.h>
+#include <multitasking/scheduler.h>
+
+/**
+ * SMP bring-up
+ *
+ * 	The CPUs are the enabled local APICs in the MADT, the boot CPU is always
+ * 	CPU 0. Each AP is started in turn with INIT, then two startup IPIs
+ * 	pointing at a copy of the trampoline (smp_trampoline.S) in low memory.
+ * 	The trampoline enables paging with the kernel page directory and jumps
+ * 	to smp_ap_entry() on a stack allocated here. The AP loads its own TSS
+ * 	and per-CPU data segment (which tells cpu_id() who it is), enables its
+ * 	local APIC and becomes the idle process of its run queue.
+ *
+ * 	APs are only started when every CPU can have a timer interrupt of its
+ * 	own (the local APIC timer), the PIT only interrupts the boot CPU.
+ */
+
+// Startup IPI vector, the page the AP starts executing at
+#define SMP_STARTUP_VECTOR (SMP_TRAMPOLINE_ADDRESS / PAGE_SIZE)
+
+// Mirrored by the constants in interrupt.S
+_Static_assert(__builtin_offsetof(struct cpu, sync_depth) == 4, "CPU_SYNC_DEPTH in interrupt.S is out of date");
+_Static_assert(__builtin_offsetof(struct cpu, switch_count) == 8, "CPU_SWITCH_COUNT in interrupt.S is out of date");
+_Static_assert(GDT_PERCPU_INDEX == 21, "GDT_PERCPU_INDEX in interrupt.S is out of date");
+
+struct cpu cpus[SMP_MAX_CPUS];
+
+static uint32_t number_of_cpus;
+
+// Index of the AP being started, read by smp_ap_entry()
+static volatile uint32_t starting_cpu;
+
+extern uint8_t smp_trampoline_start[], smp_trampoline_end[];
+extern uint32_t smp_trampoline_cr3, smp_trampoline_stack;
+
+static void find_cpus(MADT *madt);
+static bool start_cpu(uint32_t cpu);
+static void delay_us(uint32_t us);
+static void reschedule_handler(struct isr_arguments *args);
+
+/**
+ * @brief      Start every AP described by the MADT. timer_start() must have been called.
+ */
+void smp_init()
+{
+	uint32_t *trampoline_cr3;
+	uint32_t cpu;
+
+	cpus[0].apic_id = apic_is_enabled() ? apic_id() : 0;
+	cpus[0].online  = true;
+	number_of_cpus  = 1;
+
+	if(!apic_is_enabled() || !timer_per_cpu()) {
+		kprintf(KPRINT_DEBUG "SMP: No per CPU timer, only using the boot CPU\n");
+		return;
+	}
+
+	install_interrupt_handler(APIC_IPI_RESCHEDULE, reschedule_handler);
+
+	find_cpus(acpi_get_madt());
+	if(number_of_cpus == 1)
+		return;
+
+	// Startup IPIs can only point below 1MiB, run from there until paging is on
+	if(!paging_map2((void*)SMP_TRAMPOLINE_ADDRESS, (void*)SMP_TRAMPOLINE_ADDRESS,
+		PAGE_PRESENT | PAGE_READ_WRITE, MAPPING_FLUSH_CHANGES)) {
+		kprintf(KPRINT_ERROR "SMP: Could not map AP trampoline\n");
+		number_of_cpus = 1;
+		return;
+	}
+
+	memcpy((void*)SMP_TRAMPOLINE_ADDRESS, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+	trampoline_cr3 = (uint32_t*)(SMP_TRAMPOLINE_ADDRESS + ((uint8_t*)&smp_trampoline_cr3 - smp_trampoline_start));
+	*trampoline_cr3 = (uintptr_t)paging_virtual_to_physical(paging_directory_address());
+
+	for(cpu = 1; cpu < number_of_cpus; cpu++) {
+		if(!start_cpu(cpu))
+			break;
+	}
+
+	// CPUs that did not come online are not used
+	number_of_cpus = cpu;
+
+	paging_unmap((void*)SMP_TRAMPOLINE_ADDRESS);
+
+	kprintf(KPRINT_DEBUG "SMP: %d CPUs online\n", number_of_cpus);
+}
+
+/**
+ * @brief      Get the number of CPUs in use
+ *
+ * @return     The number of CPUs, CPU indexes go from 0 to the number - 1
+ */
+uint32_t smp_number_of_cpus()
+{
+	return number_of_cpus;
+}
+
+/**
+ * @brief      Check if a CPU is taking processes from its run queue
+ *
+ * @param[in]  cpu   The CPU index
+ *
+ * @return     True if online, False if not
+ */
+bool smp_cpu_online(uint32_t cpu)
+{
+	return cpu < SMP_MAX_CPUS && cpus[cpu].online;
+}
+
+/**
+ * @brief      Get the CPUs taking processes from their run queues. The boot CPU is always included, it
+ *              runs processes from its run queue before smp_init().
+ *
+ * @return     The mask of online CPUs
+ */
+cpu_mask_t smp_online_mask()
+{
+	cpu_mask_t mask;
+
+	mask = CPU_MASK(0);
+	for(uint32_t cpu = 1; cpu < number_of_cpus; cpu++) {
+		if(cpus[cpu].online)
+			mask |= CPU_MASK(cpu);
+	}
+
+	return mask;
+}
+
+/**
+ * @brief      Make a CPU look at its run queue again, after a process was queued on it
+ *
+ * @param[in]  cpu   The CPU index
+ */
+void smp_reschedule(uint32_t cpu)
+{
+	if(!smp_cpu_online(cpu) || cpu == cpu_id())
+		return;
+
+	apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_FIXED | APIC_ICR_LEVEL_ASSERT | APIC_IPI_RESCHEDULE);
+}
+
+/**
+ * @brief      First C code run by an AP, jumped to by the trampoline with interrupts disabled
+ */
+void FUNCTION_NO_RETURN smp_ap_entry()
+{
+	descriptor_tables_init_cpu(starting_cpu);
+	apic_init_cpu();
+
+	// Interrupts stay disabled until the idle loop resumes them
+	irq_set_sync_depth(1);
+
+	process_start_cpu();
+	__builtin_unreachable();
+}
+
+/**
+ * @brief      Add a CPU for every enabled local APIC besides the boot CPU's
+ *
+ * @param      madt  The MADT
+ */
+static void find_cpus(MADT *madt)
+{
+	MADT_Local_APIC_Entry *local_apic;
+	MADT_Entry_Header *entry;
+	uint8_t *position, *end;
+
+	if(madt == NULL)
+		return;
+
+	position = madt->entries;
+	end      = (uint8_t*)madt + madt->header.length;
+	while(position + sizeof(MADT_Entry_Header) <= end) {
+		entry = (MADT_Entry_Header*)position;
+		if(entry->length < sizeof(MADT_Entry_Header))
+			break;
+
+		position += entry->length;
+
+		if(entry->type != MADT_LOCAL_APIC)
+			continue;
+
+		local_apic = (MADT_Local_APIC_Entry*)entry;
+		if(!(local_apic->flags & MADT_LOCAL_APIC_ENABLED) || local_apic->apic_id == cpus[0].apic_id)
+			continue;
+
+		if(number_of_cpus == SMP_MAX_CPUS) {
+			kprintf(KPRINT_ERROR "SMP: More than %d CPUs, ignoring the rest\n", SMP_MAX_CPUS);
+			break;
+		}
+
+		cpus[number_of_cpus].apic_id = local_apic->apic_id;
+		cpus[number_of_cpus].online  = false;
+		number_of_cpus++;
+	}
+}
+
+/**
+ * @brief      Start an AP with INIT-SIPI-SIPI and wait for it to come online. The trampoline must be in place.
+ *
+ * @param[in]  cpu   The CPU index
+ *
+ * @return     True if online, False if it did not start in time
+ */
+static bool start_cpu(uint32_t cpu)
+{
+	uint32_t *trampoline_stack;
+	uint64_t deadline;
+
+	cpus[cpu].stack = kmalloc(KERNEL_THREAD_STACK_SIZE);
+	if(!cpus[cpu].stack) {
+		kprintf(KPRINT_ERROR "SMP: Could not allocate stack for CPU %d\n", cpu);
+		return false;
+	}
+
+	trampoline_stack = (uint32_t*)(SMP_TRAMPOLINE_ADDRESS + ((uint8_t*)&smp_trampoline_stack - smp_trampoline_start));
+	*trampoline_stack = (uintptr_t)cpus[cpu].stack + KERNEL_THREAD_STACK_SIZE;
+	starting_cpu = cpu;
+
+	// INIT, then deassert for older APICs
+	apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL_ASSERT | APIC_ICR_LEVEL_TRIGGERED);
+	apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL_TRIGGERED);
+	delay_us(10000);
+
+	// Second startup IPI in case the first was missed, ignored by an AP that already started
+	for(uint32_t attempt = 0; attempt < 2; attempt++) {
+		apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_STARTUP | APIC_ICR_LEVEL_ASSERT | SMP_STARTUP_VECTOR);
+		delay_us(200);
+	}
+
+	deadline = clocksource_read_ns() + (uint64_t)SMP_AP_TIMEOUT_MS * NSEC_PER_MSEC;
+	while(!cpus[cpu].online) {
+		if(clocksource_read_ns() > deadline) {
+			// Stack is not freed, the AP may still show up and use it
+			kprintf(KPRINT_ERROR "SMP: CPU %d (APIC %d) did not start\n", cpu, cpus[cpu].apic_id);
+			return false;
+		}
+
+		asm volatile("pause");
+	}
+
+	kprintf(KPRINT_DEBUG "SMP: CPU %d (APIC %d) online\n", cpu, cpus[cpu].apic_id);
+	return true;
+}
+
+/**
+ * @brief      Busy wait
+ *
+ * @param[in]  us    Microseconds to wait for
+ */
+static void delay_us(uint32_t us)
+{
+	uint64_t end;
+
+	end = clocksource_read_ns() + (uint64_t)us * 1000;
+	while(clocksource_read_ns() < end)
+		asm volatile("pause");
+}
+
+/**
+ * @brief      A process was queued on this CPU by another one, or there is work to steal
+ *
+ * @param      args  The interrupt arguments
+ */
+static void reschedule_handler(struct isr_arguments *args)
+{
+	(void)args;
+
+	apic_eoi();
+
+	// Idle and kicked by a busy CPU, take some of its work
+	if(!scheduler_has_runnable())
+		scheduler_steal();
+
+	// Preempt for it right away if it outranks the running process, otherwise just account for it
+	if(scheduler_should_preempt() && !deferred_running())
+		process_yield();
+	else
+		timer_rearm();
+}
@@ -1,4 +1,6 @@
 #include <acpi.h>
+#include <clocksource.h>
+#include <deferred.h>
 #include <drivers.h>
 #include <kpanic.h>
 #include <kprint.h>
@@ -6,13 +8,21 @@
 #include <pci.h>
 #include <serial.h>
 #include <string.h>
+#include <timeout.h>
 #include <timer.h>
+#include <i686/apic.h>
 #include <i686/descriptor_tables.h>
+#include <i686/extable.h>
+#include <i686/interrupt_stats.h>
+#include <i686/irq.h>
 #include <i686/isr.h>
 #include <i686/pic.h>
+#include <i686/smp.h>
+#include <mm/disk_map.h>
 #include <mm/kmalloc.h>
 #include <mm/paging.h>
 #include <mm/palloc.h>
+#include <mm/shm.h>
 #include <multiboot/multiboot2.h>
 #include <multiboot/multiboot_parser.h>
 #include <multitasking/process.h>
@@ -34,10 +44,14 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 
 	uint32_t palloc_init_address;
 
+	// First, per-CPU data (irq_disable() included) is reached through the GDT
+	descriptor_tables_init();
+
 	// Initialization
 	kprint_init();
 	serial_init();
 	enable_serial_output();
+	kprintf(KPRINT_DEBUG "Descriptor Tables Initialized\n");
 
 	// Multiboot validation
 	if(mb_magic != MULTIBOOT2_BOOTLOADER_MAGIC) {
@@ -62,6 +76,12 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 	isr_init();
 	kprintf(KPRINT_DEBUG "Installed default ISR handlers\n");
 
+	interrupt_stats_init();
+	kprintf(KPRINT_DEBUG "Interrupt Statistics Initialized\n");
+
+	extable_init();
+	kprintf(KPRINT_DEBUG "Exception Table Sorted\n");
+
 	palloc_init(palloc_init_address);
 	kprintf(KPRINT_DEBUG "Page Allocator Initialized\n");
 	// Mark multiboot header (page) in use
@@ -77,20 +97,35 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 	palloc_init2(palloc_init_address, mb_mmap);
 	kprintf(KPRINT_DEBUG "Page Allocator (Stage 2) Initialized\n");
 
+	shm_init();
+	kprintf(KPRINT_DEBUG "Shared Memory Initialized\n");
+
+	disk_map_init();
+	kprintf(KPRINT_DEBUG "Disk Mappings Initialized\n");
+
 	pic_init();
 	kprintf(KPRINT_DEBUG "PIC Initialized\n");
 
-	descriptor_tables_init();
-	kprintf(KPRINT_DEBUG "Descriptor Tables Initialized\n");
+	if(apic_init())
+		kprintf(KPRINT_DEBUG "Local APIC Initialized\n");
+
+	clocksource_init();
+	kprintf(KPRINT_DEBUG "Clocksource Initialized\n");
 
 	timer_init(50);
-	kprintf(KPRINT_DEBUG "PIT Initialized\n");
+	kprintf(KPRINT_DEBUG "Timer Initialized\n");
+
+	timeout_wheel_init();
+	kprintf(KPRINT_DEBUG "Timeouts Initialized\n");
 
 	// TODO: ACPI information being overwritten, need to mark it inuse
 	mb_acpi = multiboot_get_tag(mb_header, MULTIBOOT_TAG_TYPE_ACPI_OLD);
 	acpi_init(mb_acpi);
 	kprintf(KPRINT_DEBUG "ACPI Initialized\n");
 
+	irq_controller_init();
+	kprintf(KPRINT_DEBUG "Interrupt Controller Initialized\n");
+
 	pci_init();
 	kprintf(KPRINT_DEBUG "PCI Initialized\n");
 
@@ -100,6 +135,9 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 	process_init();
 	kprintf(KPRINT_DEBUG "Multitasking Initialized\n");
 
+	deferred_init();
+	kprintf(KPRINT_DEBUG "Deferred Work Initialized\n");
+
 	// Enable interrupts
 	irq_enable();
 
@@ -111,7 +149,10 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 	// XXX: Setup processes to run
 
 	// Start timer which runs scheduling code, etc.
-	install_interrupt_handler(IRQ0, timer_interrupt_handler);
+	timer_start();
+
+	// APs need their timer, and take processes from their own run queues
+	smp_init();
 
 	char buf[1024];
 	int32_t bytes_read;
@@ -122,7 +163,8 @@ void FUNCTION_NO_RETURN kinit(void * mb_header, uint32_t mb_magic)
 		kprintf("<%s>\n", buf);
 	}
 
-	while(1);
+	// Nothing left to initialize, only run when no process is runnable
+	process_idle();
 	__builtin_unreachable();
 }
 
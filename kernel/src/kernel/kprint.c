@@ -1,5 +1,6 @@
 #include <kprint.h>
 #include <serial.h>
+#include <spinlock.h>
 
 #include <stdarg.h>
 #include <string.h>
@@ -25,6 +26,9 @@ struct terminal_screen_s {
 static volatile uint16_t       *VGA_BUFFER;
 static struct terminal_screen_s screen;
 
+// Keeps lines printed by different CPUs from interleaving
+static spinlock_t kprint_lock = SPINLOCK_INITIALIZER("kprint");
+
 static inline int  putchar(const char c);
 static inline int  putint(const int i);
 static inline int  puthex(const int i);
@@ -122,6 +126,8 @@ int kprintf(const char *format, ...)
 
 	va_start(args, format);
 
+	spin_lock_irqsave(&kprint_lock);
+
 	while(*fmt) {
 		if(*fmt != '%') {
 			bytes_written += putchar(*fmt);
@@ -154,6 +160,8 @@ int kprintf(const char *format, ...)
 		fmt++;
 	}
 
+	spin_unlock_irqrestore(&kprint_lock);
+
 	va_end(args);
 
 	return bytes_written;
@@ -0,0 +1,307 @@
+#include <i686/isr.h>
+#include <mm/disk_map.h>
+#include <mm/palloc.h>
+#include <mm/paging.h>
+#include <kpanic.h>
+#include <kprint.h>
+#include <spinlock.h>
+#include <string.h>
+#include <mass_storage/storage_disk.h>
+
+/**
+ * Disk backed memory mappings
+ *
+ * 	Nothing is read when a region is created. The first access to each page
+ * 	faults, and page_fault_handler() hands the fault to disk_map_fault() which
+ * 	reads the page from the disk. The dirty bit of the page table entry is
+ * 	cleared after the read so only pages modified by the process are written back.
+ * 	A page that fails to read is left unmapped, the fault is then an error.
+ *
+ * 	A region is only used by the process it belongs to. disk_map_lock only
+ * 	covers the region table (finding and claiming slots), never the disk
+ * 	I/O, which may block.
+ *
+ * TODO: Back regions with files once a VFS exists
+ */
+
+static struct disk_map_region disk_map_regions[DISK_MAP_MAX_REGIONS];
+static spinlock_t disk_map_lock = SPINLOCK_INITIALIZER("disk map");
+
+static struct disk_map_region *find_region(pid_t pid, uintptr_t address);
+static bool region_sync(struct disk_map_region *region);
+static uint32_t region_page_length(struct disk_map_region *region, uintptr_t page);
+
+/**
+ * @brief      Initialize disk backed mappings
+ */
+void disk_map_init()
+{
+	memset(disk_map_regions, 0, sizeof(disk_map_regions));
+}
+
+/**
+ * @brief      Map a range of a disk into the current address space. Pages are loaded on access.
+ *
+ * @param[in]  disk_number      The disk to map
+ * @param[in]  disk_offset      The (page aligned) byte offset into the disk
+ * @param[in]  length           The number of bytes to map
+ * @param      virtual_address  The (page aligned) virtual address to map the range to
+ * @param[in]  page_flags       The flags for the pages when they are loaded
+ *
+ * @return     True if the mapping was created, False if not
+ */
+bool disk_map(uint32_t disk_number, uint32_t disk_offset, size_t length,
+	void *virtual_address, uint32_t page_flags)
+{
+	struct disk_map_region *region;
+	uintptr_t start, end;
+
+	start = (uintptr_t)virtual_address;
+	end   = start + length;
+
+	if(length == 0 || end < start)
+		return false;
+
+	if((start & (PAGE_SIZE - 1)) || (disk_offset & (PAGE_SIZE - 1)))
+		return false;
+
+	spin_lock_irqsave(&disk_map_lock);
+
+	// Region cannot overlap an existing region or existing pages
+	for(uintptr_t address = start; address < end; address += PAGE_SIZE) {
+		if(find_region(current_process->pid, address) || paging_is_present((void*)address))
+			goto fail;
+	}
+
+	region = NULL;
+	for(uint32_t i = 0; i < DISK_MAP_MAX_REGIONS; i++) {
+		if(!disk_map_regions[i].in_use) {
+			region = &(disk_map_regions[i]);
+			break;
+		}
+	}
+	if(region == NULL)
+		goto fail;
+
+	region->pid             = current_process->pid;
+	region->disk_number     = disk_number;
+	region->disk_offset     = disk_offset;
+	region->virtual_address = start;
+	region->length          = length;
+	region->page_flags      = page_flags | PAGE_PRESENT;
+	region->in_use          = true;
+
+	spin_unlock_irqrestore(&disk_map_lock);
+	return true;
+fail:
+	spin_unlock_irqrestore(&disk_map_lock);
+	return false;
+}
+
+/**
+ * @brief      Write back dirty pages and remove a disk mapping from the current address space
+ *
+ * @param      virtual_address  The virtual address the region was mapped at
+ *
+ * @return     True if all dirty pages were written and the region removed, False if not
+ */
+bool disk_unmap(void *virtual_address)
+{
+	struct disk_map_region *region;
+	uintptr_t physical_address;
+	bool synced;
+
+	spin_lock_irqsave(&disk_map_lock);
+	region = find_region(current_process->pid, (uintptr_t)virtual_address);
+	spin_unlock_irqrestore(&disk_map_lock);
+
+	if(region == NULL || region->virtual_address != (uintptr_t)virtual_address)
+		return false;
+
+	synced = region_sync(region);
+
+	for(uintptr_t page = region->virtual_address; page < region->virtual_address + region->length; page += PAGE_SIZE) {
+		if(!paging_is_present((void*)page))
+			continue;
+
+		physical_address = PAGE_ALIGN((uintptr_t)paging_virtual_to_physical((void*)page));
+		paging_unmap((void*)page);
+		palloc_release(physical_address);
+	}
+
+	spin_lock_irqsave(&disk_map_lock);
+	memset(region, 0, sizeof(struct disk_map_region));
+	spin_unlock_irqrestore(&disk_map_lock);
+
+	return synced;
+}
+
+/**
+ * @brief      Write back all dirty pages of a disk mapping in the current address space
+ *
+ * @param      virtual_address  The virtual address the region was mapped at
+ *
+ * @return     True if all dirty pages were written, False if not
+ */
+bool disk_sync(void *virtual_address)
+{
+	struct disk_map_region *region;
+
+	spin_lock_irqsave(&disk_map_lock);
+	region = find_region(current_process->pid, (uintptr_t)virtual_address);
+	spin_unlock_irqrestore(&disk_map_lock);
+
+	if(region == NULL)
+		return false;
+
+	return region_sync(region);
+}
+
+/**
+ * @brief      Write back and remove every disk mapping of the current process. Used on process exit.
+ */
+void disk_map_release_current()
+{
+	struct disk_map_region *region;
+	uint32_t disk_number;
+	uintptr_t virtual_address;
+
+	for(uint32_t i = 0; i < DISK_MAP_MAX_REGIONS; i++) {
+		region = &(disk_map_regions[i]);
+
+		if(!region->in_use || region->pid != current_process->pid)
+			continue;
+
+		// Region is cleared by disk_unmap()
+		disk_number     = region->disk_number;
+		virtual_address = region->virtual_address;
+
+		if(!disk_unmap((void*)virtual_address)) {
+			kprintf(KPRINT_ERROR "Lost writes to disk %d mapped at 0x%x\n",
+				disk_number, virtual_address);
+		}
+	}
+}
+
+/**
+ * @brief      Load a page of a disk mapping. Called from page_fault_handler() for non-present pages.
+ *
+ * @param      fault_address  The address that caused the page fault
+ *
+ * @return     DISK_MAP_FAULT_LOADED if the page was read in, DISK_MAP_FAULT_READ_ERROR if it belongs to a
+ *              disk mapping but could not be read, DISK_MAP_FAULT_NOT_MAPPED if it is not disk mapped
+ */
+disk_map_fault_t disk_map_fault(void *fault_address)
+{
+	struct disk_map_region *region;
+	uintptr_t page, physical;
+	uint32_t offset, length;
+
+	// No process (and no mappings) exist yet
+	if(current_process == NULL)
+		return DISK_MAP_FAULT_NOT_MAPPED;
+
+	spin_lock_irqsave(&disk_map_lock);
+	region = find_region(current_process->pid, (uintptr_t)fault_address);
+	spin_unlock_irqrestore(&disk_map_lock);
+
+	if(region == NULL)
+		return DISK_MAP_FAULT_NOT_MAPPED;
+
+	page   = PAGE_ALIGN((uintptr_t)fault_address);
+	offset = region->disk_offset + (page - region->virtual_address);
+	length = region_page_length(region, page);
+
+	/**
+	 * Needs to be writable while the contents are being read in. A page table created here
+	 * 	gets the user bit of the region, the final flags only change the page itself.
+	 */
+	if(!paging_map((void*)page, PAGE_PRESENT | PAGE_READ_WRITE | (region->page_flags & PAGE_USER_ACCESS),
+		MAPPING_WIPE_PAGE))
+		kpanic("Could not allocate page for disk mapping");
+
+	if(disk_read(region->disk_number, (void*)page, length, offset) < 0) {
+		kprintf(KPRINT_ERROR "Failed to read disk %d at offset 0x%x\n",
+			region->disk_number, offset);
+
+		// Zeros must never pass for the disk contents, or be written back over them by disk_sync()
+		physical = PAGE_ALIGN((uintptr_t)paging_virtual_to_physical((void*)page));
+		paging_unmap((void*)page);
+		palloc_release(physical);
+		return DISK_MAP_FAULT_READ_ERROR;
+	}
+
+	// Final permissions and clear the dirty bit set by the read
+	paging_set_page_flags((void*)page, region->page_flags);
+
+	return DISK_MAP_FAULT_LOADED;
+}
+
+/**
+ * @brief      Find the region containing an address. disk_map_lock must be held.
+ *
+ * @param[in]  pid      The process the region belongs to
+ * @param[in]  address  The address
+ *
+ * @return     The region, or NULL if not found
+ */
+static struct disk_map_region *find_region(pid_t pid, uintptr_t address)
+{
+	struct disk_map_region *region;
+
+	for(uint32_t i = 0; i < DISK_MAP_MAX_REGIONS; i++) {
+		region = &(disk_map_regions[i]);
+
+		if(region->in_use && region->pid == pid &&
+			address >= region->virtual_address &&
+			address - region->virtual_address < region->length)
+			return region;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief      Write all dirty pages of a region back to the disk
+ *
+ * @param      region  The region
+ *
+ * @return     True if all dirty pages were written, False if not
+ */
+static bool region_sync(struct disk_map_region *region)
+{
+	uint32_t flags, offset, length;
+	bool synced;
+
+	synced = true;
+	for(uintptr_t page = region->virtual_address; page < region->virtual_address + region->length; page += PAGE_SIZE) {
+		flags = paging_get_page_flags((void*)page);
+		if(!(flags & PAGE_PRESENT) || !(flags & PAGE_DIRTY))
+			continue;
+
+		offset = region->disk_offset + (page - region->virtual_address);
+		length = region_page_length(region, page);
+
+		if(disk_write(region->disk_number, (void*)page, length, offset) != (int32_t)length) {
+			synced = false;
+			continue;
+		}
+
+		paging_set_page_flags((void*)page, flags & ~PAGE_DIRTY);
+	}
+
+	return synced;
+}
+
+/**
+ * @brief      Get the number of bytes of a page that are backed by the disk
+ *
+ * @param      region  The region
+ * @param[in]  page    The page (virtual address)
+ *
+ * @return     Number of bytes, at most PAGE_SIZE
+ */
+static uint32_t region_page_length(struct disk_map_region *region, uintptr_t page)
+{
+	return MIN(PAGE_SIZE, region->virtual_address + region->length - page);
+}
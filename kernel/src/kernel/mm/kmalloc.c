@@ -3,16 +3,22 @@
 #include <assert.h>
 #include <string.h>
 #include <kpanic.h>
+#include <spinlock.h>
+#include <i686/isr.h>
 
 /**
  * Simple buddy based memory allocator
  * 
  * Can use some improvement
  * 	- Memory boundary regions to check for overflows
+ *
+ * The buddy tree is shared by every CPU, walks of it are done under
+ * kmalloc_lock with interrupts disabled.
  */
 
 static struct buddy_metadata * const buddy_nodes = (struct buddy_metadata *)0xC0800000;
 static uint8_t *heap_base_address, *heap_top_address;
+static spinlock_t kmalloc_lock = SPINLOCK_INITIALIZER("kmalloc");
 
 static size_t free_node_from_offset(size_t ptr_offset, size_t current_size, size_t current_offset, size_t current_index);
 static size_t find_free_node(size_t desired_size, size_t current_size, size_t index);
@@ -66,7 +72,9 @@ void *kmalloc(size_t size)
 	if(size > HEAP_MAX_SIZE)
 		return NULL;
 
+	spin_lock_irqsave(&kmalloc_lock);
 	index = find_free_node(size, HEAP_MAX_SIZE, 0);
+	spin_unlock_irqrestore(&kmalloc_lock);
 	
 	if(index == BUDDY_NODE_NOT_FOUND)
 		return NULL;
@@ -134,7 +142,9 @@ void kfree(void * ptr)
 	
 	// Get offset into start of heap region
 	heap_offset = ((uintptr_t)ptr - (uintptr_t)heap_base_address);
+	spin_lock_irqsave(&kmalloc_lock);
 	node = free_node_from_offset(heap_offset, HEAP_MAX_SIZE, 0, 0);
+	spin_unlock_irqrestore(&kmalloc_lock);
 	
 	if(node == BUDDY_NODE_NOT_FOUND) {
 		// XXX: Node not found, do we care???
@@ -1,10 +1,15 @@
+#include <i686/extable.h>
 #include <i686/isr.h>
+#include <mm/disk_map.h>
 #include <mm/kmalloc.h>
 #include <mm/palloc.h>
 #include <mm/paging.h>
+#include <i686/smp.h>
 #include <assert.h>
 #include <kpanic.h>
 #include <kprint.h>
+#include <macros.h>
+#include <spinlock.h>
 #include <string.h>
 
 /**
@@ -13,11 +18,36 @@
  * 	page table     -> physical address of mapped page
  * 	
  * 	page_directory recursively mapped to 0xFFFFF000
+ *
+ * 	Page tables shared between CPUs (the kernel tables, the temporary
+ * 	windows and the MMIO window) and directories that are not the current
+ * 	one are edited under paging_lock. paging_lock may take palloc_lock, but
+ * 	kmalloc must not be called while holding it.
 */
 
+/**
+ * @brief      Physical page a temporary mapping window shows, and the CPU whose TLB is known to have it
+ */
+struct temporary_window {
+    uintptr_t physical;
+    uint32_t cpu;
+};
+
 static bool map_implementation(void *physical_address, void *virtual_address, uint32_t page_flags, uint32_t mapping_flags);
+static uint32_t *temporary_map_table(uintptr_t physical_address);
+static void *temporary_map_page(uintptr_t physical_address);
+static void *temporary_map(uintptr_t window, struct temporary_window *window_state, uintptr_t physical_address);
+static bool is_current_directory(uint32_t *paging_directory_virtual);
 static inline void native_flush_tlb_single(uintptr_t addr);
 
+// Pages currently visible through the temporary mapping windows
+static struct temporary_window temporary_table_window, temporary_page_window;
+
+static spinlock_t paging_lock = SPINLOCK_INITIALIZER("paging");
+
+// Next unused page of the MMIO window
+static uintptr_t mmio_next_address;
+
 extern uintptr_t * kernel_page_directory;
 
 /**
@@ -27,6 +57,8 @@ void paging_init()
 {
 	kprintf(KPRINT_DEBUG "Paging Directory Address: 0x%x\n", paging_virtual_to_physical(&kernel_page_directory));
     install_interrupt_handler(14, page_fault_handler);
+
+    mmio_next_address = PAGING_MMIO_BASE_ADDRESS;
 }
 
 /**
@@ -70,6 +102,85 @@ void * paging_virtual_to_physical(void *virtual_address)
     return (void *)((pt[ptindex] & ~0xFFF) + ((uintptr_t)virtual_address & 0xFFF));
 }
 
+/**
+ * @brief      Check if a virtual address is mapped to a present page
+ *
+ * @param      virtual_address  The virtual address to check
+ *
+ * @return     True if the page is present, False if not
+ */
+bool paging_is_present(void *virtual_address)
+{
+    uintptr_t *paging_directory, pdindex, ptindex;
+    uintptr_t *pt;
+
+    paging_directory = (uintptr_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS;
+
+    pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
+    ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
+
+    if((paging_directory[pdindex] & PAGE_PRESENT) == 0x00)
+        return false;
+
+    pt = (uintptr_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
+    return (pt[ptindex] & PAGE_PRESENT) ? true : false;
+}
+
+/**
+ * @brief      Get the flags of the page a virtual address is mapped to
+ *
+ * @param      virtual_address  The virtual address
+ *
+ * @return     The page table entry flags (enum page_entry_flags), or 0 if not mapped
+ */
+uint32_t paging_get_page_flags(void *virtual_address)
+{
+    uintptr_t *paging_directory, pdindex, ptindex;
+    uintptr_t *pt;
+
+    paging_directory = (uintptr_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS;
+
+    pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
+    ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
+
+    if((paging_directory[pdindex] & PAGE_PRESENT) == 0x00)
+        return 0;
+
+    pt = (uintptr_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
+    return pt[ptindex] & 0xFFF;
+}
+
+/**
+ * @brief      Replace the flags of an already mapped page, keeping the physical page
+ *
+ * @param      virtual_address  The virtual address
+ * @param[in]  page_flags       The new flags for the page
+ *
+ * @return     True if the flags were updated, False if the page is not mapped
+ */
+bool paging_set_page_flags(void *virtual_address, uint32_t page_flags)
+{
+    uintptr_t *paging_directory, pdindex, ptindex;
+    uintptr_t *pt;
+
+    paging_directory = (uintptr_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS;
+
+    pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
+    ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
+
+    if((paging_directory[pdindex] & PAGE_PRESENT) == 0x00)
+        return false;
+
+    pt = (uintptr_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
+    if(!(pt[ptindex] & PAGE_PRESENT))
+        return false;
+
+    pt[ptindex] = (pt[ptindex] & ~0xFFF) | (page_flags & 0xFFF);
+    native_flush_tlb_single(PAGE_ALIGN((uintptr_t)virtual_address));
+
+    return true;
+}
+
 /**
  * @brief      Clone a page directory
  *
@@ -83,7 +194,12 @@ void * paging_clone_directory(void *directory_virtual, uint32_t clone_flags)
     uint32_t entry;
 
     dst = (uintptr_t*)kmalloc(PAGE_SIZE);
+    if(dst == NULL)
+        return NULL;
     src = (uintptr_t*)directory_virtual;
+
+    // Entries that are not copied must not point at stale page tables
+    memset(dst, 0, PAGE_SIZE);
     
     // Start entry to copy over from passed page directory
     entry = 0;
@@ -103,6 +219,50 @@ void * paging_clone_directory(void *directory_virtual, uint32_t clone_flags)
     return (void*)dst;
 }
 
+/**
+ * @brief      Free a page directory created by paging_clone_directory(), with every page table
+ *              and page it owns. Page tables shared with the kernel page directory are left alone.
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address) to free. Cannot be the current one.
+ */
+void paging_destroy_directory(uint32_t *paging_directory_virtual)
+{
+    uint32_t *kernel_directory, *pt;
+    uintptr_t pt_physical;
+
+    kernel_directory = (uint32_t*)&kernel_page_directory;
+
+    if(paging_directory_virtual == kernel_directory || is_current_directory(paging_directory_virtual))
+        kpanic("Trying to destroy an active page directory!");
+
+    for(uint32_t pdindex = 0; pdindex < REFLECTED_PAGE_DIRECTORY_ENTRY; pdindex++) {
+        if(!(paging_directory_virtual[pdindex] & PAGE_PRESENT))
+            continue;
+
+        // Copied from the kernel page directory, shared by every process
+        if(paging_directory_virtual[pdindex] == kernel_directory[pdindex])
+            continue;
+
+        pt_physical = paging_directory_virtual[pdindex] & ~0xFFF;
+
+        spin_lock_irqsave(&paging_lock);
+
+        pt = temporary_map_table(pt_physical);
+        for(uint32_t ptindex = 0; ptindex < PAGE_TABLE_ENTRIES; ptindex++) {
+            // Shared pages are reference counted by palloc
+            if(pt[ptindex] & PAGE_PRESENT)
+                palloc_release(pt[ptindex] & ~0xFFF);
+        }
+
+        spin_unlock_irqrestore(&paging_lock);
+
+        paging_directory_virtual[pdindex] = 0;
+        palloc_release(pt_physical);
+    }
+
+    kfree(paging_directory_virtual);
+}
+
 /**
  * @brief      Creates a new page table entry for a given virtual address in a provided page directory
  *
@@ -114,36 +274,223 @@ void * paging_clone_directory(void *directory_virtual, uint32_t clone_flags)
  */
 bool paging_create_page_table(void *virtual_address, uint32_t page_flags, uint32_t *paging_directory_virtual)
 {
-    uint32_t pdindex, ptindex, physical_address;
-    uint32_t *pt, *pt_physical, pt_entry;
+    uintptr_t physical_address;
 
-    physical_address = (uint32_t)palloc_physical();
+    physical_address = palloc_physical();
     if(physical_address == 0x00)
         return false;
 
+    if(!paging_map_foreign(paging_directory_virtual, (void*)physical_address, virtual_address,
+        page_flags, MAPPING_WIPE_PAGE)) {
+        palloc_release(physical_address);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief      Map a physical page into a page directory that does not need to be the current one.
+ *              The directory is edited through temporary mappings, so CR3 is never switched.
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address) to map into
+ * @param      physical_address          The physical address of the page. Must already be owned by the caller.
+ * @param      virtual_address           The virtual address to map the page to
+ * @param[in]  page_flags                The flags for the page when it is created
+ * @param[in]  mapping_flags             The flags for how to map the page (MAPPING_WIPE_PAGE)
+ *
+ * @return     True if mapping successful, False if not
+ */
+bool paging_map_foreign(uint32_t *paging_directory_virtual, void *physical_address,
+    void *virtual_address, uint32_t page_flags, uint32_t mapping_flags)
+{
+    uint32_t pdindex, ptindex, *pt;
+    uintptr_t pt_physical;
+
+    virtual_address  = (void*)PAGE_ALIGN((uint32_t)virtual_address);
+    physical_address = (void*)PAGE_ALIGN((uint32_t)physical_address);
+    if(virtual_address == 0x00 || physical_address == 0x00)
+        return false;
+
     pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
     ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
 
-    // XXX: Page table entry already exists
-    if(paging_directory_virtual[pdindex] != 0x00)
-        return false;
+    spin_lock_irqsave(&paging_lock);
 
-    pt = kmalloc(PAGE_SIZE);
-    if(!pt)
-        kpanic("Failed to malloc region to create page table!");
+    if(paging_directory_virtual[pdindex] == 0x00) {
+        pt_physical = palloc_physical();
+        if(pt_physical == 0x00) {
+            spin_unlock_irqrestore(&paging_lock);
+            return false;
+        }
 
-    pt_physical = paging_virtual_to_physical(pt);
-    if(!pt_physical)
-        kpanic("Failed to get physical address of new page table!");
-    paging_directory_virtual[pdindex] = ((uint32_t)pt_physical & ~0xFFF) | page_flags;
+        pt = temporary_map_table(pt_physical);
+        memset(pt, 0, PAGE_SIZE);
 
-    pt_entry = page_flags & 0xFFF;
-    pt_entry |= physical_address; 
-    pt[ptindex] = pt_entry;
+        paging_directory_virtual[pdindex] = pt_physical | (page_flags & 0xFFF);
+    } else {
+        pt = temporary_map_table(paging_directory_virtual[pdindex] & ~0xFFF);
+    }
+
+    if(mapping_flags & MAPPING_WIPE_PAGE)
+        memset(temporary_map_page((uintptr_t)physical_address), 0, PAGE_SIZE);
+
+    pt[ptindex] = (uint32_t)physical_address | (page_flags & 0xFFF);
+
+    // Editing the active directory, drop any stale translation
+    if(is_current_directory(paging_directory_virtual))
+        native_flush_tlb_single((uintptr_t)virtual_address);
+
+    spin_unlock_irqrestore(&paging_lock);
+    return true;
+}
+
+/**
+ * @brief      Unmap a virtual address from a page directory that does not need to be the current one
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address) to unmap from
+ * @param      virtual_address           The virtual address to unmap
+ *
+ * @return     The physical address that was mapped (not released), or 0x00 if nothing was mapped
+ */
+uintptr_t paging_unmap_foreign(uint32_t *paging_directory_virtual, void *virtual_address)
+{
+    uint32_t pdindex, ptindex, *pt;
+    uintptr_t physical_address;
+
+    pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
+    ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
+
+    spin_lock_irqsave(&paging_lock);
+
+    if(!(paging_directory_virtual[pdindex] & PAGE_PRESENT)) {
+        spin_unlock_irqrestore(&paging_lock);
+        return 0x00;
+    }
+
+    pt = temporary_map_table(paging_directory_virtual[pdindex] & ~0xFFF);
+    if(!(pt[ptindex] & PAGE_PRESENT)) {
+        spin_unlock_irqrestore(&paging_lock);
+        return 0x00;
+    }
+
+    physical_address = pt[ptindex] & ~0xFFF;
+    pt[ptindex] = 0;
+
+    if(is_current_directory(paging_directory_virtual))
+        native_flush_tlb_single(PAGE_ALIGN((uintptr_t)virtual_address));
+
+    spin_unlock_irqrestore(&paging_lock);
+    return physical_address;
+}
+
+/**
+ * @brief      Convert a virtual address to a physical address in a page directory that does not need to be the current one
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address) to look in
+ * @param      virtual_address           The virtual address to convert
+ *
+ * @return     Pointer to physical address, or NULL if not mapped
+ */
+void * paging_virtual_to_physical_foreign(uint32_t *paging_directory_virtual, void *virtual_address)
+{
+    uint32_t pdindex, ptindex, *pt, pt_entry;
+
+    pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
+    ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
+
+    if(!(paging_directory_virtual[pdindex] & PAGE_PRESENT))
+        return NULL;
+
+    spin_lock_irqsave(&paging_lock);
+    pt = temporary_map_table(paging_directory_virtual[pdindex] & ~0xFFF);
+    pt_entry = pt[ptindex];
+    spin_unlock_irqrestore(&paging_lock);
+
+    if(!(pt_entry & PAGE_PRESENT))
+        return NULL;
+
+    return (void*)((pt_entry & ~0xFFF) + ((uintptr_t)virtual_address & 0xFFF));
+}
+
+/**
+ * @brief      Copy a buffer into already mapped pages of a page directory that does not need to be the current one
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address) to copy into
+ * @param      virtual_address           The destination virtual address in that directory
+ * @param[in]  buffer                    The source buffer (current address space)
+ * @param[in]  length                    The number of bytes to copy
+ *
+ * @return     True if everything was copied, False if a destination page is not mapped
+ */
+bool paging_copy_to_foreign(uint32_t *paging_directory_virtual, void *virtual_address,
+    const void *buffer, size_t length)
+{
+    uintptr_t destination, physical_address;
+    uint8_t *source;
+    size_t chunk;
+
+    destination = (uintptr_t)virtual_address;
+    source      = (uint8_t*)buffer;
+
+    while(length) {
+        chunk = MIN(length, PAGE_SIZE - (destination & 0xFFF));
+
+        physical_address = (uintptr_t)paging_virtual_to_physical_foreign(paging_directory_virtual, (void*)destination);
+        if(physical_address == 0x00)
+            return false;
+
+        spin_lock_irqsave(&paging_lock);
+        memcpy((uint8_t*)temporary_map_page(PAGE_ALIGN(physical_address)) + (destination & 0xFFF), source, chunk);
+        spin_unlock_irqrestore(&paging_lock);
+
+        destination += chunk;
+        source      += chunk;
+        length      -= chunk;
+    }
 
     return true;
 }
 
+/**
+ * @brief      Copy physical memory that is not mapped anywhere (firmware tables) into a buffer
+ *
+ * @param      buffer            The destination buffer (current address space)
+ * @param[in]  physical_address  The physical address to copy from
+ * @param[in]  length            The number of bytes to copy
+ */
+void paging_copy_from_physical(void *buffer, uintptr_t physical_address, size_t length)
+{
+    uint8_t *destination;
+    size_t chunk;
+
+    destination = (uint8_t*)buffer;
+
+    while(length) {
+        chunk = MIN(length, PAGE_SIZE - (physical_address & 0xFFF));
+
+        spin_lock_irqsave(&paging_lock);
+        memcpy(destination, (uint8_t*)temporary_map_page(PAGE_ALIGN(physical_address)) + (physical_address & 0xFFF), chunk);
+        spin_unlock_irqrestore(&paging_lock);
+
+        destination      += chunk;
+        physical_address += chunk;
+        length           -= chunk;
+    }
+}
+
+/**
+ * @brief      Zero a physical page that is not mapped in the current address space
+ *
+ * @param[in]  physical_address  The physical address of the page
+ */
+void paging_wipe_physical(uintptr_t physical_address)
+{
+    spin_lock_irqsave(&paging_lock);
+    memset(temporary_map_page(PAGE_ALIGN(physical_address)), 0, PAGE_SIZE);
+    spin_unlock_irqrestore(&paging_lock);
+}
+
 /**
  * @brief      Map a virtual address into memory
  *
@@ -199,6 +546,7 @@ static bool map_implementation(void *physical_address, void *virtual_address, ui
 {
 	uint32_t *paging_directory, pdindex, ptindex;
 	uint32_t *pt, pt_entry;
+	uintptr_t pt_physical;
     
     paging_directory = (uint32_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS;
 
@@ -209,26 +557,22 @@ static bool map_implementation(void *physical_address, void *virtual_address, ui
     pdindex = GET_PAGE_DIR_INDEX((uint32_t)virtual_address);
     ptindex = GET_PAGE_TABLE_INDEX((uint32_t)virtual_address);
     
+    pt = (uint32_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
+
+    // Kernel threads share the kernel page directory, two CPUs could create the same page table
+    spin_lock_irqsave(&paging_lock);
+
     if((paging_directory[pdindex]) == 0x00) {
     	// Create a new page table entry and update page directory
-    	pt = kmalloc(PAGE_SIZE);
-    	if(!pt)
-    		kpanic("Failed to malloc region to create page table!");
-    	
-    	pt = paging_virtual_to_physical(pt);
-    	if(!pt)
-    		kpanic("Failed to get physical address of new page table!");
-
-    	paging_directory[pdindex] = ((uint32_t)pt & ~0xFFF) | page_flags;
-    }
-    
-    pt = (uint32_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
-    
-    if(pt == 0x00) {
-    	// TODO: Page already exists, what do we do now???
-    	kprintf(KPRINT_DEBUG "Page already exists! (Physical: 0x%x, Virtual: 0x%x)\n",
-    		(uintptr_t)physical_address, (uintptr_t)virtual_address);
-    	return false;
+    	pt_physical = palloc_physical();
+    	if(!pt_physical)
+    		kpanic("Failed to allocate page for new page table!");
+
+    	paging_directory[pdindex] = (pt_physical & ~0xFFF) | (page_flags & 0xFFF);
+
+    	// Page table is now visible through the recursive mapping
+    	native_flush_tlb_single((uintptr_t)pt);
+    	memset(pt, 0, PAGE_SIZE);
     }
 
     // TODO: Might cause problems if a page is READ_WRITE and a non-READ_WRITE page is mapped into same table
@@ -236,6 +580,8 @@ static bool map_implementation(void *physical_address, void *virtual_address, ui
     pt_entry |= (uint32_t)physical_address; 
     pt[ptindex] = pt_entry;
 
+    spin_unlock_irqrestore(&paging_lock);
+
     /**
      * Switch to the page table, flushing changes
      */
@@ -266,7 +612,6 @@ static bool map_implementation(void *physical_address, void *virtual_address, ui
 bool paging_unmap(void *virtual_address)
 {
     uint32_t *paging_directory, pdindex, ptindex, *pt;
-    uintptr_t physical_address;
 
     paging_directory = (uintptr_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS;
 
@@ -278,20 +623,59 @@ bool paging_unmap(void *virtual_address)
         return false;
 
     pt = (uint32_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * pdindex);
-    if(pt != 0x00)
+    if(!(pt[ptindex] & PAGE_PRESENT))
         return false;
     
-    native_flush_tlb_single((uintptr_t)virtual_address);
-
-    physical_address = pt[ptindex] & ~0xFFF;
     pt[ptindex] = 0;
+    native_flush_tlb_single((uintptr_t)virtual_address);
 
-    // XXX: Might need reference counts when a page is mapped into multiple virtual / page directories
-    //palloc_release((uintptr_t)physical_address);
+    // NOTE: The physical page is not released here. Owners of the page call palloc_release(),
+    //  which is reference counted for pages mapped into multiple virtual addresses / page directories
     
     return true;
 }
 
+/**
+ * @brief      Map device registers into the MMIO window, uncached. The window is part of the
+ *              kernel page tables, so the mapping is visible from every page directory.
+ *              Mappings are permanent.
+ *
+ * @param[in]  physical_address  The physical address of the registers
+ * @param[in]  length            The number of bytes to map
+ *
+ * @return     Virtual address of the registers, or NULL if the window is full
+ */
+void * paging_map_mmio(uintptr_t physical_address, size_t length)
+{
+    uintptr_t virtual_address, page;
+    uint32_t number_of_pages, *pt;
+
+    number_of_pages = PAGE_ALIGN((physical_address & 0xFFF) + length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    spin_lock_irqsave(&paging_lock);
+
+    if(number_of_pages > (PAGING_MMIO_END_ADDRESS - mmio_next_address) / PAGE_SIZE) {
+        spin_unlock_irqrestore(&paging_lock);
+        return NULL;
+    }
+
+    virtual_address = mmio_next_address;
+    mmio_next_address += number_of_pages * PAGE_SIZE;
+
+    // Not palloc frames, so the page tables are edited directly instead of through paging_map2()
+    page = PAGE_ALIGN(physical_address);
+    for(uint32_t i = 0; i < number_of_pages; i++, page += PAGE_SIZE) {
+        pt = (uint32_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * GET_PAGE_DIR_INDEX(virtual_address + i * PAGE_SIZE));
+        pt[GET_PAGE_TABLE_INDEX(virtual_address + i * PAGE_SIZE)] = page |
+            PAGE_PRESENT | PAGE_READ_WRITE | PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLED;
+
+        native_flush_tlb_single(virtual_address + i * PAGE_SIZE);
+    }
+
+    spin_unlock_irqrestore(&paging_lock);
+    return (void*)(virtual_address + (physical_address & 0xFFF));
+}
+
 /**
  * @brief      Switch out the current page directory
  *
@@ -316,6 +700,7 @@ void paging_switch_directory(uint32_t * page_dir, uint32_t phys)
  */
 void page_fault_handler(struct isr_arguments *args)
 {
+    disk_map_fault_t disk_map_result;
     uintptr_t accessed_page;
 
     // Move to page boundary
@@ -325,6 +710,26 @@ void page_fault_handler(struct isr_arguments *args)
         kprintf("Page Fault at Address: 0x%x\n", args->eip);
         kpanic("Attempted to access page 0x00000000");
     }
+
+    // Non-present page backed by a disk mapping
+    if(!(args->error_code & 0x1)) {
+        disk_map_result = disk_map_fault((void*)args->cr2);
+        if(disk_map_result == DISK_MAP_FAULT_LOADED)
+            return;
+
+        // Not demand-zeroed, a routine allowed to fault returns an error, anything else can not go on
+        if(disk_map_result == DISK_MAP_FAULT_READ_ERROR) {
+            if(extable_fixup(args))
+                return;
+
+            kprintf(KPRINT_ERROR "Page Fault at Address: 0x%x\n", args->eip);
+            kpanic("Could not read in a disk mapped page");
+        }
+    }
+
+    // Bad pointer (unmapped or protected) inside a routine allowed to fault (ie. copy_to_user()), return an error from it
+    if(extable_fixup(args))
+        return;
     
     // Does page exist, but not present?
     if(args->error_code & 0x1) {
@@ -360,6 +765,80 @@ void page_fault_handler(struct isr_arguments *args)
     }
 }
 
+/**
+ * @brief      Make a page table visible through the temporary page table window. paging_lock must be held.
+ *
+ * @param[in]  physical_address  The physical address of the page table
+ *
+ * @return     Virtual address of the page table
+ */
+static uint32_t *temporary_map_table(uintptr_t physical_address)
+{
+    return temporary_map(PAGING_TEMPORARY_TABLE_ADDRESS, &temporary_table_window, physical_address);
+}
+
+/**
+ * @brief      Make a page visible through the temporary page window. paging_lock must be held.
+ *
+ * @param[in]  physical_address  The physical address of the page
+ *
+ * @return     Virtual address of the page
+ */
+static void *temporary_map_page(uintptr_t physical_address)
+{
+    return temporary_map(PAGING_TEMPORARY_PAGE_ADDRESS, &temporary_page_window, physical_address);
+}
+
+/**
+ * @brief      Point a temporary mapping window at a physical page.
+ *
+ * The windows live in the kernel page table shared by every page directory,
+ * so the mapping is valid whichever directory is loaded. The TLB entry is
+ * only invalidated when the window changes page, which makes runs of edits
+ * to the same page table free. Only the TLB of the CPU that last moved the
+ * window is known to be current, another CPU may still hold an older
+ * translation and always invalidates it.
+ *
+ * @param[in]  window            The virtual address of the window
+ * @param      window_state      The physical page the window currently maps
+ * @param[in]  physical_address  The physical page to map
+ *
+ * @return     Virtual address of the window
+ */
+static void *temporary_map(uintptr_t window, struct temporary_window *window_state, uintptr_t physical_address)
+{
+    uint32_t *pt;
+
+    if(window_state->physical != physical_address || window_state->cpu != cpu_id()) {
+        pt = (uint32_t*)(REFLECTED_PAGE_TABLE_BASE_ADDRESS + PAGE_SIZE * GET_PAGE_DIR_INDEX(window));
+        pt[GET_PAGE_TABLE_INDEX(window)] = physical_address | PAGE_PRESENT | PAGE_READ_WRITE;
+        native_flush_tlb_single(window);
+
+        window_state->physical = physical_address;
+        window_state->cpu      = cpu_id();
+    }
+
+    return (void*)window;
+}
+
+/**
+ * @brief      Check if a page directory is the one currently loaded in CR3
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address)
+ *
+ * @return     True if currently loaded, False if not
+ */
+static bool is_current_directory(uint32_t *paging_directory_virtual)
+{
+    uint32_t cr3;
+
+    if(paging_directory_virtual == (uint32_t*)REFLECTED_PAGE_DIRECTORY_ADDRESS)
+        return true;
+
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return PAGE_ALIGN((uintptr_t)paging_virtual_to_physical(paging_directory_virtual)) == cr3;
+}
+
 /**
  * @brief      Invalidate a TLB entry given an address. (Perform TLB shootdown).
  *
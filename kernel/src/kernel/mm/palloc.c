@@ -5,6 +5,8 @@
 
 #include <string.h>
 #include <kpanic.h>
+#include <spinlock.h>
+#include <i686/isr.h>
 
 static uint32_t initial_palloc_bitmap[PALLOC_INITIAL_BITMAP_SIZE];
 
@@ -14,8 +16,14 @@ static struct multiboot_mmap_entry *mmap_entries;
 static void * allocated_pages_bitmap;
 static uint32_t bitmap_size;
 
+// Number of references held on a page beyond the first (0 == single owner)
+static uint16_t *page_share_counts;
+
 static uintptr_t base_address;
 
+// Taken by every CPU allocating or freeing, also from interrupt handlers
+static spinlock_t palloc_lock = SPINLOCK_INITIALIZER("palloc");
+
 static uint32_t find_index_by_address(uintptr_t address);
 
 /**
@@ -36,6 +44,9 @@ void palloc_init(uintptr_t low_address)
 	allocated_pages_bitmap = initial_palloc_bitmap;
 	bitmap_size = sizeof(initial_palloc_bitmap);
 
+	// Sharing pages is not supported until stage 2
+	page_share_counts = NULL;
+
 	// Set base address. Will not change between init stage 1 and stage 2.
 	base_address = PAGE_ALIGN(low_address) + PAGE_SIZE;
 }
@@ -79,6 +90,11 @@ void palloc_init2(uintptr_t low_address, struct multiboot_tag_mmap *mb_mmap)
 		kpanic("Could not allocate space for memory map");
 	}
 	memcpy(mmap_entries, mb_mmap->entries, sizeof(struct multiboot_mmap_entry) * number_mmap_entries);
+
+	page_share_counts = kcalloc(bitmap_size, sizeof(uint16_t));
+	if(page_share_counts == NULL) {
+		kpanic("Could not allocate space for page share counts");
+	}
 }
 
 /**
@@ -91,16 +107,19 @@ uintptr_t palloc_physical()
 	uint32_t index;
 	uintptr_t address;
 
+	spin_lock_irqsave(&palloc_lock);
+
 	index = bitmap_get_first_clear(allocated_pages_bitmap, bitmap_size);
 	if(index >= bitmap_size) {
 		// Could not find any clear bits in the bitmap
+		spin_unlock_irqrestore(&palloc_lock);
 		goto fail;
 	}
 
 	// Mark page as allocated
 	bitmap_set(allocated_pages_bitmap, bitmap_size, index);
 
-	// XXX: Should be end of thread un-safe region
+	spin_unlock_irqrestore(&palloc_lock);
 
 	// Just need to find the base for this offset
 	address = index * PAGE_SIZE;
@@ -139,7 +158,8 @@ success:
 }
 
 /**
- * @brief      Release possession of a physical page
+ * @brief      Release possession of a physical page. The page is only freed once
+ * 				every reference taken through palloc_reference() is released.
  *
  * @param[in]  address  The physical page address
  * 
@@ -152,8 +172,48 @@ void palloc_release(uintptr_t address)
 	if(index >= bitmap_size) {
 		return;
 	}
-	
-	bitmap_clear(allocated_pages_bitmap, bitmap_size, index);
+
+	spin_lock_irqsave(&palloc_lock);
+
+	// Page is still mapped somewhere else, drop a reference
+	if(page_share_counts && page_share_counts[index])
+		page_share_counts[index]--;
+	else
+		bitmap_clear(allocated_pages_bitmap, bitmap_size, index);
+
+	spin_unlock_irqrestore(&palloc_lock);
+}
+
+/**
+ * @brief      Take an additional reference on an in-use physical page. Used when
+ * 				the same page is mapped into multiple virtual addresses / page directories.
+ *
+ * @param[in]  address  The physical page address
+ *
+ * @return     True if the reference was taken, False if not
+ */
+bool palloc_reference(uintptr_t address)
+{
+	uint32_t index;
+
+	if(page_share_counts == NULL)
+		return false;
+
+	index = find_index_by_address(address);
+	if(index >= bitmap_size)
+		return false;
+
+	spin_lock_irqsave(&palloc_lock);
+
+	if(bitmap_get(allocated_pages_bitmap, bitmap_size, index) != 1 || page_share_counts[index] == (uint16_t)-1) {
+		spin_unlock_irqrestore(&palloc_lock);
+		return false;
+	}
+
+	page_share_counts[index]++;
+
+	spin_unlock_irqrestore(&palloc_lock);
+	return true;
 }
 
 /**
@@ -169,7 +229,9 @@ void palloc_mark_inuse(uintptr_t address)
 		return;
 	}
 	
+	spin_lock_irqsave(&palloc_lock);
 	bitmap_set(allocated_pages_bitmap, bitmap_size, index);
+	spin_unlock_irqrestore(&palloc_lock);
 }
 
 /**
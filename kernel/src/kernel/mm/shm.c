@@ -0,0 +1,365 @@
+#include <i686/isr.h>
+#include <mm/kmalloc.h>
+#include <mm/palloc.h>
+#include <mm/paging.h>
+#include <mm/shm.h>
+#include <spinlock.h>
+#include <string.h>
+
+/**
+ * Shared memory regions
+ *
+ * 	Each region owns a set of physical pages. The region holds one palloc
+ * 	reference on every page, and every virtual mapping of the region takes
+ * 	another. Pages are only returned to palloc once the region is destroyed
+ * 	and unmapped from every page directory.
+ *
+ * 	Each region remembers the page directory and address of its mappings.
+ * 	A process that exits with a region still mapped has its pages released
+ * 	along with its page directory, shm_release_directory() drops the
+ * 	region's side of those mappings so a destroyed region can be freed.
+ */
+
+static struct shm_region shm_regions[SHM_MAX_REGIONS];
+static spinlock_t shm_lock = SPINLOCK_INITIALIZER("shm");
+
+static struct shm_region *get_region(int32_t id);
+static void region_free(struct shm_region *region);
+static void region_unmapped(struct shm_region *region);
+
+/**
+ * @brief      Initialize shared memory handling
+ */
+void shm_init()
+{
+	memset(shm_regions, 0, sizeof(shm_regions));
+}
+
+/**
+ * @brief      Create a new shared memory region
+ *
+ * @param[in]  size  The size of the region in bytes. Rounded up to a page.
+ *
+ * @return     ID of the new region, or SHM_INVALID_ID on failure
+ */
+int32_t shm_create(size_t size)
+{
+	struct shm_region *region;
+	int32_t id;
+
+	if(size == 0)
+		return SHM_INVALID_ID;
+
+	spin_lock_irqsave(&shm_lock);
+
+	for(id = 0; id < SHM_MAX_REGIONS; id++) {
+		if(!shm_regions[id].in_use)
+			break;
+	}
+	if(id >= SHM_MAX_REGIONS)
+		goto fail;
+
+	region = &(shm_regions[id]);
+	region->number_of_pages = PAGE_ALIGN(size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	region->frames = kcalloc(region->number_of_pages, sizeof(uintptr_t));
+	if(region->frames == NULL)
+		goto fail;
+
+	for(size_t i = 0; i < region->number_of_pages; i++) {
+		region->frames[i] = palloc_physical();
+		if(region->frames[i] == 0x00)
+			goto fail_release;
+
+		// Handed to other processes, never with what was left in the frame
+		paging_wipe_physical(region->frames[i]);
+	}
+
+	region->mappings     = 0;
+	region->mapping_list = NULL;
+	region->destroyed    = false;
+	region->in_use    = true;
+
+	spin_unlock_irqrestore(&shm_lock);
+	return id;
+
+fail_release:
+	region_free(region);
+fail:
+	spin_unlock_irqrestore(&shm_lock);
+	return SHM_INVALID_ID;
+}
+
+/**
+ * @brief      Destroy a shared memory region. Pages stay valid until the last mapping is removed.
+ *
+ * @param[in]  id    The ID of the region
+ *
+ * @return     True if destroyed, False if not
+ */
+bool shm_destroy(int32_t id)
+{
+	struct shm_region *region;
+
+	spin_lock_irqsave(&shm_lock);
+
+	region = get_region(id);
+	if(region == NULL) {
+		spin_unlock_irqrestore(&shm_lock);
+		return false;
+	}
+
+	// Drop the reference held by the region itself
+	for(size_t i = 0; i < region->number_of_pages; i++)
+		palloc_release(region->frames[i]);
+
+	region->destroyed = true;
+	if(region->mappings == 0) {
+		kfree(region->frames);
+		memset(region, 0, sizeof(struct shm_region));
+	}
+
+	spin_unlock_irqrestore(&shm_lock);
+	return true;
+}
+
+/**
+ * @brief      Map a shared memory region into the current page directory
+ *
+ * @param[in]  id               The ID of the region
+ * @param      virtual_address  The (page aligned) virtual address to map the region at
+ * @param[in]  page_flags       The flags for the pages when they are mapped
+ *
+ * @return     True if mapping successful, False if not
+ */
+bool shm_map(int32_t id, void *virtual_address, uint32_t page_flags)
+{
+	struct shm_region *region;
+	struct shm_mapping *mapping;
+	uint8_t *address;
+	size_t mapped;
+
+	if((uintptr_t)virtual_address & (PAGE_SIZE - 1))
+		return false;
+
+	spin_lock_irqsave(&shm_lock);
+
+	region = get_region(id);
+	if(region == NULL)
+		goto fail;
+
+	// Do not silently replace existing mappings
+	address = virtual_address;
+	for(size_t i = 0; i < region->number_of_pages; i++, address += PAGE_SIZE) {
+		if(paging_is_present(address))
+			goto fail;
+	}
+
+	mapping = kmalloc(sizeof(struct shm_mapping));
+	if(mapping == NULL)
+		goto fail;
+
+	address = virtual_address;
+	for(mapped = 0; mapped < region->number_of_pages; mapped++, address += PAGE_SIZE) {
+		if(!palloc_reference(region->frames[mapped]))
+			goto fail_unmap;
+
+		if(!paging_map2((void*)region->frames[mapped], address, page_flags | PAGE_PRESENT, 0)) {
+			palloc_release(region->frames[mapped]);
+			goto fail_unmap;
+		}
+	}
+
+	mapping->directory = (uintptr_t)paging_virtual_to_physical(paging_directory_address());
+	mapping->address   = virtual_address;
+	mapping->next      = region->mapping_list;
+	region->mapping_list = mapping;
+	region->mappings++;
+
+	spin_unlock_irqrestore(&shm_lock);
+	return true;
+
+fail_unmap:
+	address = virtual_address;
+	for(size_t i = 0; i < mapped; i++, address += PAGE_SIZE) {
+		paging_unmap(address);
+		palloc_release(region->frames[i]);
+	}
+	kfree(mapping);
+fail:
+	spin_unlock_irqrestore(&shm_lock);
+	return false;
+}
+
+/**
+ * @brief      Unmap a shared memory region from the current page directory
+ *
+ * @param[in]  id               The ID of the region
+ * @param      virtual_address  The virtual address the region was mapped at
+ *
+ * @return     True if unmapped, False if not
+ */
+bool shm_unmap(int32_t id, void *virtual_address)
+{
+	struct shm_mapping *mapping, *previous;
+	struct shm_region *region;
+	uintptr_t directory;
+	uint8_t *address;
+
+	spin_lock_irqsave(&shm_lock);
+
+	if(id < 0 || id >= SHM_MAX_REGIONS || !shm_regions[id].in_use)
+		goto fail;
+	region = &(shm_regions[id]);
+
+	// Mapped here by shm_map()
+	directory = (uintptr_t)paging_virtual_to_physical(paging_directory_address());
+	previous  = NULL;
+	for(mapping = region->mapping_list; mapping; mapping = mapping->next) {
+		if(mapping->directory == directory && mapping->address == virtual_address)
+			break;
+		previous = mapping;
+	}
+	if(mapping == NULL)
+		goto fail;
+
+	// Verify the region is actually mapped here before touching anything
+	address = virtual_address;
+	for(size_t i = 0; i < region->number_of_pages; i++, address += PAGE_SIZE) {
+		if(!paging_is_present(address) ||
+			PAGE_ALIGN((uintptr_t)paging_virtual_to_physical(address)) != region->frames[i])
+			goto fail;
+	}
+
+	address = virtual_address;
+	for(size_t i = 0; i < region->number_of_pages; i++, address += PAGE_SIZE) {
+		paging_unmap(address);
+		palloc_release(region->frames[i]);
+	}
+
+	if(previous)
+		previous->next = mapping->next;
+	else
+		region->mapping_list = mapping->next;
+	kfree(mapping);
+
+	region_unmapped(region);
+
+	spin_unlock_irqrestore(&shm_lock);
+	return true;
+fail:
+	spin_unlock_irqrestore(&shm_lock);
+	return false;
+}
+
+/**
+ * @brief      Forget every mapping in a page directory about to be destroyed. The pages themselves are released
+ *              by paging_destroy_directory().
+ *
+ * @param      paging_directory_virtual  The paging directory (virtual address)
+ */
+void shm_release_directory(void *paging_directory_virtual)
+{
+	struct shm_mapping *mapping, **link;
+	struct shm_region *region;
+	uintptr_t directory;
+
+	directory = (uintptr_t)paging_virtual_to_physical(paging_directory_virtual);
+
+	spin_lock_irqsave(&shm_lock);
+
+	for(int32_t id = 0; id < SHM_MAX_REGIONS; id++) {
+		region = &(shm_regions[id]);
+		if(!region->in_use)
+			continue;
+
+		link = &(region->mapping_list);
+		while(*link) {
+			mapping = *link;
+			if(mapping->directory != directory) {
+				link = &(mapping->next);
+				continue;
+			}
+
+			*link = mapping->next;
+			kfree(mapping);
+
+			// May free the region, nothing else in it is looked at afterwards
+			region_unmapped(region);
+		}
+	}
+
+	spin_unlock_irqrestore(&shm_lock);
+}
+
+/**
+ * @brief      Get the size of a shared memory region
+ *
+ * @param[in]  id    The ID of the region
+ *
+ * @return     Size of the region in bytes, or 0 if the region does not exist
+ */
+size_t shm_size(int32_t id)
+{
+	struct shm_region *region;
+	size_t size;
+
+	spin_lock_irqsave(&shm_lock);
+
+	region = get_region(id);
+	size = region ? region->number_of_pages * PAGE_SIZE : 0;
+
+	spin_unlock_irqrestore(&shm_lock);
+	return size;
+}
+
+/**
+ * @brief      Get a region that can still be mapped. shm_lock must be held.
+ *
+ * @param[in]  id    The ID of the region
+ *
+ * @return     The region, or NULL if it does not exist or was destroyed
+ */
+static struct shm_region *get_region(int32_t id)
+{
+	if(id < 0 || id >= SHM_MAX_REGIONS)
+		return NULL;
+
+	if(!shm_regions[id].in_use || shm_regions[id].destroyed)
+		return NULL;
+
+	return &(shm_regions[id]);
+}
+
+/**
+ * @brief      Account for a mapping removed from a region, freeing it after the last mapping of a destroyed
+ *              region. shm_lock must be held.
+ *
+ * @param      region  The region
+ */
+static void region_unmapped(struct shm_region *region)
+{
+	region->mappings--;
+
+	// Last mapping of a destroyed region
+	if(region->destroyed && region->mappings == 0) {
+		kfree(region->frames);
+		memset(region, 0, sizeof(struct shm_region));
+	}
+}
+
+/**
+ * @brief      Release all pages allocated to a region that was never mapped
+ *
+ * @param      region  The region
+ */
+static void region_free(struct shm_region *region)
+{
+	for(size_t i = 0; i < region->number_of_pages; i++) {
+		if(region->frames[i])
+			palloc_release(region->frames[i]);
+	}
+
+	kfree(region->frames);
+	memset(region, 0, sizeof(struct shm_region));
+}
@@ -0,0 +1,63 @@
+#include <mm/usercopy.h>
+#include <multitasking/elf.h>
+
+/**
+ * Copying to/from user buffers
+ *
+ * 	Only a range check is done before copying. Pages are not walked, if the
+ * 	copy faults on a page that cannot be made present, page_fault_handler()
+ * 	finds the faulting instruction in the exception table and the copy
+ * 	returns early with the number of bytes not copied.
+ */
+
+/**
+ * @brief      Check that a buffer lies entirely within user space
+ *
+ * @param[in]  address  The start of the buffer
+ * @param[in]  length   The length of the buffer
+ *
+ * @return     True if the buffer is within user space, False if not
+ */
+bool user_access_ok(const void *address, size_t length)
+{
+	uintptr_t start;
+
+	start = (uintptr_t)address;
+
+	return start >= ELF_USER_CODE_BASE_ADDRESS && start < ELF_USER_STACK_BASE_ADDRESS &&
+		length <= ELF_USER_STACK_BASE_ADDRESS - start;
+}
+
+/**
+ * @brief      Copy a kernel buffer into a user buffer
+ *
+ * @param      to    The user buffer
+ * @param[in]  from  The kernel buffer
+ * @param[in]  n     Number of bytes to copy
+ *
+ * @return     Number of bytes NOT copied (0 on success)
+ */
+size_t copy_to_user(void *to, const void *from, size_t n)
+{
+	if(!user_access_ok(to, n))
+		return n;
+
+	return copy_user_unchecked(to, from, n);
+}
+
+/**
+ * @brief      Copy a user buffer into a kernel buffer
+ *
+ * @param      to    The kernel buffer
+ * @param[in]  from  The user buffer
+ * @param[in]  n     Number of bytes to copy
+ *
+ * @return     Number of bytes NOT copied (0 on success)
+ */
+size_t copy_from_user(void *to, const void *from, size_t n)
+{
+	if(!user_access_ok(from, n))
+		return n;
+
+	return copy_user_unchecked(to, from, n);
+}
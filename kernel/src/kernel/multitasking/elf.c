@@ -1,5 +1,6 @@
 #include <string.h>
 #include <i686/isr.h>
+#include <mm/palloc.h>
 #include <mm/paging.h>
 #include <multitasking/elf.h>
 
@@ -12,37 +13,55 @@ void test_program()
 }
 
 /**
- * @brief      Load an elf into the current process's memory space
+ * @brief      Start executing the image loaded by elf_setup_image(). Runs in the new process.
  */
 void FUNCTION_NO_RETURN elf_load()
 {
-	uint32_t page_permissions;
-
-	// Get page permissions to set
-	page_permissions = PAGE_PRESENT | PAGE_READ_WRITE;
-	if(!(current_process->creation_flags & KERNEL_MODE))
-		page_permissions |= PAGE_USER_ACCESS;
-	
-	// Load ELF code, etc
-	paging_map((void*)ELF_USER_CODE_BASE_ADDRESS,
-		page_permissions, MAPPING_WIPE_PAGE | MAPPING_FLUSH_CHANGES);
-
-	// TODO: Remove test program once actually loading things
-	memcpy((void*)ELF_USER_CODE_BASE_ADDRESS, test_program, PAGE_SIZE);
-
-	// TODO: Remove PAGE_READ_WRITE permission
-
 	// Is program to run in usermode or kernel mode?
 	if(!(current_process->creation_flags & KERNEL_MODE))
 		current_process->user_mode = 1;
 
 	// Jump execution to new EIP
-	process_creation_complete((void*)ELF_USER_CODE_BASE_ADDRESS);
+	process_creation_complete(current_process, (void*)ELF_USER_CODE_BASE_ADDRESS);
 
 	// XXX: Should never reach here
 	while(1);
 }
 
+/**
+ * @brief      Load an elf into a process's memory space. Runs in the creating process,
+ * 				the new process's page directory is edited without switching to it.
+ *
+ * @param[in]  process  The process to load the image into
+ *
+ * @return     True if the image was loaded, False if not
+ */
+bool elf_setup_image(process_t process)
+{
+	uint32_t page_permissions;
+	uintptr_t physical_address;
+
+	// Code is not writable once loaded
+	page_permissions = PAGE_PRESENT;
+	if(!(process->creation_flags & KERNEL_MODE))
+		page_permissions |= PAGE_USER_ACCESS;
+
+	// Load ELF code, etc
+	physical_address = palloc_physical();
+	if(physical_address == 0x00)
+		return false;
+
+	if(!paging_map_foreign(process->pagedir_virtual, (void*)physical_address,
+		(void*)ELF_USER_CODE_BASE_ADDRESS, page_permissions, MAPPING_WIPE_PAGE)) {
+		palloc_release(physical_address);
+		return false;
+	}
+
+	// TODO: Remove test program once actually loading things
+	return paging_copy_to_foreign(process->pagedir_virtual, (void*)ELF_USER_CODE_BASE_ADDRESS,
+		test_program, PAGE_SIZE);
+}
+
 /**
  * @brief      Setup the initial stack for a program
  *
@@ -0,0 +1,225 @@
+#include <kpanic.h>
+#include <macros.h>
+#include <spinlock.h>
+#include <multitasking/mutex.h>
+#include <multitasking/scheduler.h>
+
+/**
+ * Mutexes
+ *
+ * 	Processes waiting for a mutex are blocked on its wait queue, so they use
+ * 	no CPU time until it is released. Only processes can take a mutex, not
+ * 	interrupt handlers or deferred work run on interrupt exit. Releasing it
+ * 	wakes the highest priority waiter, which then takes it like anyone else
+ * 	(a process that is already running may get there first).
+ *
+ * 	Priority inheritance
+ *
+ * 	A process that has to wait lends its effective priority to the owner,
+ * 	and on along the chain when that owner is itself waiting on a mutex. A
+ * 	low priority owner preempted by normal work can then not hold up a
+ * 	critical process indefinitely. Each mutex remembers the highest
+ * 	priority waiting on it, and an owner runs at the highest of those over
+ * 	every mutex it holds. The priority is given back when the mutex is
+ * 	released. A fair process (FAIR_SCHEDULING) has no priority to lend, it
+ * 	runs below every priority anyway, but one that owns a mutex is lifted
+ * 	out of the fair class by a waiter that has one.
+ *
+ * 	Owners, the held and blocked on links and inherited priorities only
+ * 	change with pi_lock held, so a chain can be followed without taking
+ * 	the lock of every mutex along it. Lock order: mutex wait queue,
+ * 	pi_lock, run queue.
+ */
+
+static spinlock_t pi_lock = SPINLOCK_INITIALIZER("priority inheritance");
+
+static void take(mutex_t *mutex);
+static void boost_owners(mutex_t *mutex, priority_t priority);
+static void remove_held(process_t process, mutex_t *mutex);
+static void update_inherited(process_t process);
+
+/**
+ * @brief      Initialize an unlocked mutex
+ *
+ * @param      mutex  The mutex
+ */
+void mutex_init(mutex_t *mutex)
+{
+	mutex->owner           = NULL;
+	mutex->waiter_priority = PRIORITY_NUMBER_OF_PRIORITIES;
+	mutex->next_held       = NULL;
+	wait_queue_init(&(mutex->wait));
+}
+
+/**
+ * @brief      Take a mutex, sleeping until it is released if someone else holds it. Not from interrupt handlers.
+ *
+ * @param      mutex  The mutex
+ */
+void mutex_lock(mutex_t *mutex)
+{
+	wait_queue_lock(&(mutex->wait));
+
+	if(mutex->owner == current_process)
+		kpanic("Mutex locked recursively!");
+
+	while(mutex->owner) {
+		spin_lock(&pi_lock);
+		current_process->blocked_on = mutex;
+		boost_owners(mutex, process_effective_priority(current_process));
+		spin_unlock(&pi_lock);
+
+		wait_queue_block(&(mutex->wait));
+	}
+
+	spin_lock(&pi_lock);
+	current_process->blocked_on = NULL;
+	take(mutex);
+	spin_unlock(&pi_lock);
+
+	wait_queue_unlock(&(mutex->wait));
+}
+
+/**
+ * @brief      Take a mutex if it is free
+ *
+ * @param      mutex  The mutex
+ *
+ * @return     True if taken, False if someone holds it
+ */
+bool mutex_trylock(mutex_t *mutex)
+{
+	bool taken;
+
+	wait_queue_lock(&(mutex->wait));
+
+	taken = mutex->owner == NULL;
+	if(taken) {
+		spin_lock(&pi_lock);
+		take(mutex);
+		spin_unlock(&pi_lock);
+	}
+
+	wait_queue_unlock(&(mutex->wait));
+	return taken;
+}
+
+/**
+ * @brief      Release a mutex held by the current process, giving back the priority inherited through it
+ *
+ * @param      mutex  The mutex
+ */
+void mutex_unlock(mutex_t *mutex)
+{
+	wait_queue_lock(&(mutex->wait));
+
+	if(mutex->owner != current_process)
+		kpanic("Unlocking a mutex not held by the current process!");
+
+	spin_lock(&pi_lock);
+	mutex->owner = NULL;
+	remove_held(current_process, mutex);
+	update_inherited(current_process);
+	spin_unlock(&pi_lock);
+
+	wait_queue_unlock(&(mutex->wait));
+
+	wait_queue_wake_highest(&(mutex->wait));
+
+	// Without the inherited priority a waiter may now outrank this process
+	if(scheduler_should_preempt())
+		process_yield();
+}
+
+/**
+ * @brief      Make the current process the owner of a free mutex. The wait queue and pi_lock must be held.
+ *
+ * @param      mutex  The mutex
+ */
+static void take(mutex_t *mutex)
+{
+	process_t waiter;
+
+	mutex->owner     = current_process;
+	mutex->next_held = current_process->held_mutexes;
+	current_process->held_mutexes = mutex;
+
+	// Whoever is still waiting now waits on this process
+	mutex->waiter_priority = PRIORITY_NUMBER_OF_PRIORITIES;
+	for(waiter = mutex->wait.head; waiter; waiter = waiter->wait_next)
+		mutex->waiter_priority = MIN(mutex->waiter_priority, process_effective_priority(waiter));
+
+	update_inherited(current_process);
+}
+
+/**
+ * @brief      Lend a priority to the owner of a mutex, and on along the chain of mutexes the owners wait on.
+ *              pi_lock must be held.
+ *
+ * @param      mutex     The mutex waited on
+ * @param[in]  priority  The priority of the waiter
+ */
+static void boost_owners(mutex_t *mutex, priority_t priority)
+{
+	process_t owner;
+
+	for(uint32_t depth = 0; mutex && depth < MUTEX_MAX_INHERITANCE_DEPTH; depth++) {
+		mutex->waiter_priority = MIN(mutex->waiter_priority, priority);
+
+		// Already running at least as high, so is everyone further down the chain
+		owner = mutex->owner;
+		if(owner == NULL || process_effective_priority(owner) <= priority)
+			break;
+
+		owner->inherited_priority = priority;
+		scheduler_update_priority(owner);
+
+		mutex = owner->blocked_on;
+	}
+}
+
+/**
+ * @brief      Remove a mutex from the list of mutexes held by a process. pi_lock must be held.
+ *
+ * @param[in]  process  The owner
+ * @param      mutex    The mutex
+ */
+static void remove_held(process_t process, mutex_t *mutex)
+{
+	mutex_t *held, *previous;
+
+	previous = NULL;
+	for(held = process->held_mutexes; held && held != mutex; held = held->next_held)
+		previous = held;
+
+	if(held) {
+		if(previous)
+			previous->next_held = mutex->next_held;
+		else
+			process->held_mutexes = mutex->next_held;
+	}
+
+	mutex->next_held = NULL;
+}
+
+/**
+ * @brief      Recompute the priority a process inherits from the waiters of the mutexes it holds, and
+ *              requeue it if that changed. pi_lock must be held.
+ *
+ * @param[in]  process  The process
+ */
+static void update_inherited(process_t process)
+{
+	priority_t inherited;
+	mutex_t *held;
+
+	inherited = PRIORITY_NUMBER_OF_PRIORITIES;
+	for(held = process->held_mutexes; held; held = held->next_held)
+		inherited = MIN(inherited, held->waiter_priority);
+
+	if(inherited == process->inherited_priority)
+		return;
+
+	process->inherited_priority = inherited;
+	scheduler_update_priority(process);
+}
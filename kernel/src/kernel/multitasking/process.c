@@ -1,24 +1,68 @@
+#include <kpanic.h>
 #include <kprint.h>
+#include <spinlock.h>
 #include <string.h>
+#include <timer.h>
 #include <i686/isr.h>
+#include <mm/disk_map.h>
 #include <mm/kmalloc.h>
 #include <mm/palloc.h>
 #include <mm/paging.h>
+#include <mm/shm.h>
 #include <multitasking/elf.h>
 #include <multitasking/process.h>
 #include <multitasking/scheduler.h>
+#include <structures/bitmap.h>
 
-process_t current_process;
+// Bitmap of PIDs in use, freed PIDs are reused
+static void *pid_bitmap;
+static spinlock_t pid_lock = SPINLOCK_INITIALIZER("pid");
 
-// TODO: Get a better method for PID creation
-static pid_t pid_current = 0;
+// Processes that have exited and wait for their resources to be freed
+static process_t zombie_list;
+static spinlock_t zombie_lock = SPINLOCK_INITIALIZER("zombie");
+
+// Sleeping processes, sorted by the tick they wake up on
+static process_t sleep_list;
+static spinlock_t sleep_lock = SPINLOCK_INITIALIZER("sleep");
+
+// Wake tick of the head of sleep_list, read by timer_rearm() without the lock
+static volatile uint32_t next_wake_tick;
+
+// Kernel threads run in the page directory of the initial kernel process
+static void *kernel_pagedir_virtual;
+static uintptr_t kernel_pagedir_physical;
+
+static bool pid_allocate(pid_t *pid);
+static void pid_release(pid_t pid);
+static void process_destroy(process_t process);
+static void kernel_thread_start();
 
 /**
  * @brief      Initialize process handling
  */
 void process_init()
 {
-	current_process = process_create2(0, paging_directory_address(), COPY_SYNC_DEPTH, PRIORITY_LOW);
+	process_t process;
+
+	pid_bitmap = bitmap_create(MAX_PROCESS_PID);
+	if(!pid_bitmap)
+		kpanic("Could not allocate PID bitmap");
+
+	zombie_list = NULL;
+	sleep_list  = NULL;
+
+	process = process_create2(0, paging_directory_address(), COPY_SYNC_DEPTH, PRIORITY_LOW, CPU_MASK_ALL);
+	if(!process)
+		kpanic("Could not create initial kernel process");
+
+	// Already running, the registers are saved on the first switch
+	process->on_cpu = true;
+	this_cpu_write(process, process);
+	scheduler_add_process(process);
+
+	kernel_pagedir_virtual  = process->pagedir_virtual;
+	kernel_pagedir_physical = process->registers.cr3;
 }
 
 /**
@@ -26,42 +70,121 @@ void process_init()
  *
  * @param[in]  creation_flags   Flags used for the creation of the process
  * @param[in]  priority         The priority of the process
+ * @param[in]  affinity         The CPUs it may run on (CPU_MASK_ALL for any), must include an online CPU
  *
  * @return     Pointer to the Process Control Block, or NULL on failure
  */
-process_t process_create(uint32_t creation_flags, priority_t priority)
+process_t process_create(uint32_t creation_flags, priority_t priority, cpu_mask_t affinity)
 {
 	uint32_t eflags;
 	void *pagedir_virtual;
+	process_t process;
 	
+	// Would never be scheduled
+	if(!(affinity & smp_online_mask()))
+		return NULL;
+
+	// Free exited processes first, so process churn does not depend on the idle process running
+	process_reap();
+
 	// XXX: Do I need to get the current process's eflags? Should I set to a static number? Set to 0?
 	eflags = eflags_get();
 	pagedir_virtual = paging_clone_directory(paging_directory_address(), CLONE_KERNEL_ONLY);
+	if(!pagedir_virtual)
+		return NULL;
+
+	process = process_create2(eflags, pagedir_virtual, creation_flags, priority, affinity);
+	if(process) {
+		// Populate the new address space from here, no need to switch to it
+		elf_setup_stack(process);
+		if(!elf_setup_image(process))
+			kpanic("Failed to load process image!");
+
+		// Schedulable now that the address space is fully setup
+		scheduler_add_process(process);
+	}
 
-	return process_create2(eflags, pagedir_virtual, creation_flags, priority);
+	return process;
 }
 
 /**
- * @brief      Create a new process control block
+ * @brief      Create a kernel thread. It shares the kernel page directory and exits when entry returns.
+ *
+ * @param[in]  entry     The function to run
+ * @param      data      Passed to entry
+ * @param[in]  priority  The priority of the thread
+ * @param[in]  affinity  The CPUs it may run on (CPU_MASK_ALL for any), must include an online CPU
+ *
+ * @return     Pointer to the Process Control Block, or NULL on failure
+ */
+process_t process_create_kernel_thread(void (*entry)(void *data), void *data, priority_t priority,
+	cpu_mask_t affinity)
+{
+	process_t process;
+	void *stack;
+
+	if(!(affinity & smp_online_mask()))
+		return NULL;
+
+	process_reap();
+
+	stack = kmalloc(KERNEL_THREAD_STACK_SIZE);
+	if(!stack)
+		return NULL;
+
+	// Starts with interrupts enabled
+	process = process_create2(EFLAGS_INTERRUPT_FLAG | EFLAGS_RESERVED, kernel_pagedir_virtual,
+		KERNEL_MODE | KERNEL_THREAD, priority, affinity);
+	if(!process) {
+		kfree(stack);
+		return NULL;
+	}
+
+	process->registers.cr3 = kernel_pagedir_physical;
+	process->registers.eip = (uintptr_t)kernel_thread_start;
+	process->registers.esp = (uintptr_t)stack + KERNEL_THREAD_STACK_SIZE;
+	process->registers.ebp = 0;
+	process->tss_esp0      = process->registers.esp;
+
+	process->kernel_stack = stack;
+	process->thread_entry = entry;
+	process->thread_data  = data;
+
+	// Schedulable now that the registers are setup
+	scheduler_add_process(process);
+
+	return process;
+}
+
+/**
+ * @brief      Create a new process control block. The process is not scheduled until it is
+ *              passed to scheduler_add_process().
  *
  * @param[in]  eflags           The value to set to eflags on startup
  * @param      pagedir_virtual  The page dirirectory (virtual address) of the process
  * @param[in]  creation_flags   Flags used for the creation of the process
  * @param[in]  priority         The priority of the process
+ * @param[in]  affinity         The CPUs it may run on
  *
  * @return     Pointer to the Process Control Block, or NULL on failure
  */
 process_t process_create2(uint32_t eflags,
 	void *pagedir_virtual, uint32_t creation_flags,
-	priority_t priority)
+	priority_t priority, cpu_mask_t affinity)
 {
 	process_t process;
-	
-    irq_disable();
+	pid_t pid;
+
+	if(!pid_allocate(&pid))
+		goto fail;
 
 	process = (process_t)kmalloc(sizeof(struct process_control_block));
-	if(!process)
-		goto fail;;
+	if(!process) {
+		pid_release(pid);
+		goto fail;
+	}
+
+	process->pid = pid;
 
 	process->registers.eax = 0;
 	process->registers.ebx = 0;
@@ -83,43 +206,420 @@ process_t process_create2(uint32_t eflags,
 
     // Only allow running in kernel mode if the current process is also running in kernel mode
     // XXX: I think this is secure, might need to revisit
-    if((creation_flags & KERNEL_MODE) && !(current_process->user_mode))
-        process->creation_flags |= KERNEL_MODE;
+    process->creation_flags = 0;
+    if((creation_flags & KERNEL_MODE) && (!current_process || !(current_process->user_mode)))
+        process->creation_flags |= creation_flags & (KERNEL_MODE | KERNEL_THREAD);
+
+    process->creation_flags |= creation_flags & FAIR_SCHEDULING;
 
     // Need to start in kernel mode to allow for elf_load() to run
     process->user_mode = 0;
 
     process->pagedir_virtual = pagedir_virtual;
-    process->pid             = pid_current++;
     process->priority        = priority;
+    process->affinity        = affinity;
+    process->state           = PROCESS_RUNNABLE;
+    process->exit_status     = 0;
+    process->on_cpu          = false;
+    process->scheduler_entry = NULL;
+    process->next_zombie     = NULL;
+    process->wait_next       = NULL;
+    process->wake_tick       = 0;
+    process->thread_entry    = NULL;
+    process->thread_data     = NULL;
+    process->kernel_stack    = NULL;
 
-    // Setup process stack
-    elf_setup_stack(process);
+    // No mutexes held yet, so nothing inherited
+    process->inherited_priority = PRIORITY_NUMBER_OF_PRIORITIES;
+    process->held_mutexes       = NULL;
+    process->blocked_on         = NULL;
 
-    // Add the process to the scheduler
-    scheduler_add_process(process);
+    // Stacks are setup by the creator once the address space exists
+    process->registers.esp = 0;
+    process->registers.ebp = 0;
+    process->tss_esp0      = 0;
 
-    irq_resume();
     return process;
 fail:
-    irq_resume();
     return NULL;
 }
 
+/**
+ * @brief      Change the CPUs a process may run on. It is moved off a CPU it is no longer allowed on, right
+ *              away if it is the current process, otherwise the next time that CPU schedules.
+ *
+ * @param[in]  process   The process
+ * @param[in]  affinity  The CPUs it may run on
+ *
+ * @return     True if changed, False if no CPU in the mask is online
+ */
+bool process_set_affinity(process_t process, cpu_mask_t affinity)
+{
+	if(!(affinity & smp_online_mask()))
+		return false;
+
+	process->affinity = affinity;
+	scheduler_affinity_changed(process);
+
+	if(process == current_process && !(affinity & CPU_MASK(cpu_id())))
+		process_yield();
+
+	return true;
+}
+
 /**
  * @brief      Yield control of the current process to the next process in the PCB linked-list
  */
 void process_yield()
 {
-	process_t next;
+	process_t previous, next;
+
+	irq_disable();
+
+	// Held until the switch is done, released by process_switch_finish() in the next process
+	scheduler_lock();
 
 	next = scheduler_get_next();
-	
-	if(current_process->pid != next->pid) {
-		process_switch(next);
+
+	if(current_process != next) {
+		this_cpu_inc(switch_count);
+
+		previous = current_process;
+		this_cpu_write(process, next);
+		next->on_cpu = true;
+		process_switch(previous, next);
+	} else {
+		scheduler_unlock();
+
+		// Next event depends on who runs next
+		timer_rearm();
+	}
+
+	irq_resume();
+}
+
+/**
+ * @brief      Finish a context switch, called by process_switch() on the stack of the next process
+ *              once the previous one is saved
+ *
+ * @param[in]  previous_process  The process switched away from
+ */
+void process_switch_finish(process_t previous_process)
+{
+	// Other CPUs may run it (or free it) from here on
+	previous_process->on_cpu = false;
+	scheduler_unlock();
+
+	// Taken off this CPU by its affinity, queue it where it may run now that its registers are saved
+	scheduler_finish_migration(previous_process);
+
+	// Next event depends on who runs next
+	timer_rearm();
+}
+
+/**
+ * @brief      Get the number of context switches since boot, over every CPU
+ *
+ * @return     The number of switches
+ */
+uint32_t process_get_switch_count()
+{
+	uint32_t count;
+
+	count = 0;
+	for(uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		count += cpus[cpu].switch_count;
+
+	return count;
+}
+
+/**
+ * @brief      Turn the current process into the idle process. Only scheduled when nothing else is runnable.
+ */
+void FUNCTION_NO_RETURN process_idle()
+{
+	scheduler_set_idle_process(current_process);
+
+	while(1) {
+		// Free resources of exited processes
+		process_reap();
+
+		irq_disable();
+
+		if(scheduler_has_runnable() || scheduler_steal()) {
+			process_yield();
+		} else {
+			irq_enable_halt();
+		}
+
+		irq_enable();
 	}
 }
 
+/**
+ * @brief      Become the idle process of a CPU that was just started. Called with interrupts disabled.
+ */
+void FUNCTION_NO_RETURN process_start_cpu()
+{
+	struct cpu *cpu;
+	process_t idle;
+
+	cpu = cpu_current();
+
+	// Kernel thread on the stack the CPU started on
+	idle = process_create2(0, kernel_pagedir_virtual,
+		COPY_SYNC_DEPTH | KERNEL_MODE | KERNEL_THREAD, PRIORITY_LOW, CPU_MASK(cpu->id));
+	if(!idle)
+		kpanic("Could not create idle process for CPU");
+
+	// Never in a run queue, only run when this CPU has nothing else to do
+	idle->registers.cr3 = kernel_pagedir_physical;
+	idle->kernel_stack  = cpu->stack;
+	idle->on_cpu        = true;
+	this_cpu_write(process, idle);
+
+	cpu->online = true;
+	timer_start_cpu();
+
+	process_idle();
+}
+
+/**
+ * @brief      Sleep the current process for a number of timer ticks
+ *
+ * @param[in]  ticks  The number of ticks to sleep for
+ */
+void process_sleep(uint32_t ticks)
+{
+	process_sleep_until(timer_get_ticks() + ticks);
+}
+
+/**
+ * @brief      Sleep the current process until a timer tick. The process is not in a run queue while asleep.
+ *
+ * @param[in]  tick  The timer tick to wake up on
+ */
+void process_sleep_until(uint32_t tick)
+{
+	process_t previous, next;
+
+	irq_disable();
+
+	// Already passed (handles the tick counter wrapping)
+	if((int32_t)(tick - timer_get_ticks()) <= 0) {
+		irq_resume();
+		return;
+	}
+
+	spin_lock(&sleep_lock);
+
+	current_process->state     = PROCESS_SLEEPING;
+	current_process->wake_tick = tick;
+
+	// Keep sorted so the timer only ever looks at the head
+	previous = NULL;
+	for(next = sleep_list; next && (int32_t)(next->wake_tick - tick) <= 0; next = next->wait_next)
+		previous = next;
+
+	current_process->wait_next = next;
+	if(previous) {
+		previous->wait_next = current_process;
+	} else {
+		sleep_list     = current_process;
+		next_wake_tick = tick;
+	}
+
+	scheduler_block_process(current_process);
+
+	// Woken up from here on by whichever CPU gets to it, yielding then just keeps running
+	spin_unlock(&sleep_lock);
+
+	// Returns once woken up and scheduled again
+	process_yield();
+
+	irq_resume();
+}
+
+/**
+ * @brief      Wake every sleeping process whose tick has come. Called from the timer interrupt.
+ *
+ * @param[in]  now   The current timer tick
+ */
+void process_wake_sleepers(uint32_t now)
+{
+	process_t process;
+
+	// Nothing due, skip the lock
+	if(sleep_list == NULL || (int32_t)(next_wake_tick - now) > 0)
+		return;
+
+	spin_lock_irqsave(&sleep_lock);
+
+	while(sleep_list && (int32_t)(sleep_list->wake_tick - now) <= 0) {
+		process = sleep_list;
+		sleep_list = process->wait_next;
+
+		process->wait_next = NULL;
+		process->state     = PROCESS_RUNNABLE;
+
+		scheduler_unblock_process(process);
+	}
+
+	if(sleep_list)
+		next_wake_tick = sleep_list->wake_tick;
+
+	spin_unlock_irqrestore(&sleep_lock);
+}
+
+/**
+ * @brief      Get the tick the next sleeping process wakes up on. Does not take the sleep lock, it is
+ *              called while waking sleepers. May be a tick early when racing with another CPU.
+ *
+ * @param      tick  Set to the tick of the next wake up
+ *
+ * @return     True if a process is sleeping, False if not
+ */
+bool process_next_wake_tick(uint32_t *tick)
+{
+	if(sleep_list == NULL)
+		return false;
+
+	*tick = next_wake_tick;
+	return true;
+}
+
+/**
+ * @brief      Terminate the current process. Its resources are freed later by process_reap().
+ *
+ * @param[in]  status  The exit status of the process
+ */
+void FUNCTION_NO_RETURN process_exit(int32_t status)
+{
+	// The initial kernel process owns the kernel page directory and reaps everyone else
+	if(current_process->pid == 0)
+		kpanic("Initial kernel process cannot exit!");
+
+	// Waiters would never get the mutex
+	if(current_process->held_mutexes)
+		kpanic("Process exited while holding a mutex!");
+
+	// Write back disk mappings while the address space is still loaded
+	disk_map_release_current();
+
+	irq_disable();
+
+	current_process->exit_status = status;
+	current_process->state       = PROCESS_ZOMBIE;
+
+	scheduler_remove_process(current_process);
+
+	// Not freed before this CPU switched away from it, see process_destroy()
+	spin_lock(&zombie_lock);
+	current_process->next_zombie = zombie_list;
+	zombie_list = current_process;
+	spin_unlock(&zombie_lock);
+
+	// Never scheduled again
+	process_yield();
+
+	kpanic("Exited process was scheduled!");
+	__builtin_unreachable();
+}
+
+/**
+ * @brief      Free the resources of every process that has exited
+ */
+void process_reap()
+{
+	process_t zombie;
+
+	while(zombie_list) {
+		spin_lock_irqsave(&zombie_lock);
+
+		// Another CPU may have taken it meanwhile
+		zombie = zombie_list;
+		if(zombie)
+			zombie_list = zombie->next_zombie;
+
+		spin_unlock_irqrestore(&zombie_lock);
+
+		if(zombie)
+			process_destroy(zombie);
+	}
+}
+
+/**
+ * @brief      Free the address space, PID and PCB of an exited process
+ *
+ * @param[in]  process  The process to destroy
+ */
+static void process_destroy(process_t process)
+{
+	// Its CPU may still be switching away from it, on its stack
+	while(process->on_cpu)
+		asm volatile("pause");
+
+	// Page tables, pages (reference counted), and the directory itself. Kernel threads only own their stack.
+	if(process->creation_flags & KERNEL_THREAD) {
+		kfree(process->kernel_stack);
+	} else {
+		// Shared memory regions still mapped lose this mapping with the directory
+		shm_release_directory(process->pagedir_virtual);
+		paging_destroy_directory(process->pagedir_virtual);
+	}
+
+	pid_release(process->pid);
+	kfree(process);
+}
+
+/**
+ * @brief      First code run by a kernel thread
+ */
+static void FUNCTION_NO_RETURN kernel_thread_start()
+{
+	current_process->thread_entry(current_process->thread_data);
+
+	process_exit(0);
+}
+
+/**
+ * @brief      Allocate an unused PID
+ *
+ * @param      pid   Set to the allocated PID
+ *
+ * @return     True if a PID was allocated, False if all PIDs are in use
+ */
+static bool pid_allocate(pid_t *pid)
+{
+	size_t index;
+
+	spin_lock_irqsave(&pid_lock);
+
+	index = bitmap_get_first_clear(pid_bitmap, MAX_PROCESS_PID);
+	if(index < MAX_PROCESS_PID)
+		bitmap_set(pid_bitmap, MAX_PROCESS_PID, index);
+
+	spin_unlock_irqrestore(&pid_lock);
+
+	if(index >= MAX_PROCESS_PID)
+		return false;
+
+	*pid = (pid_t)index;
+	return true;
+}
+
+/**
+ * @brief      Release a PID for reuse
+ *
+ * @param[in]  pid   The PID to release
+ */
+static void pid_release(pid_t pid)
+{
+	spin_lock_irqsave(&pid_lock);
+	bitmap_clear(pid_bitmap, MAX_PROCESS_PID, pid);
+	spin_unlock_irqrestore(&pid_lock);
+}
+
 /**
  * @brief      Dump information about a provided process
  *
@@ -143,5 +643,6 @@ void dump_process(process_t process)
     kprintf("\n\t> Misc:\n");
     kprintf("\t\tTSS_ESP0:    0x%x\n", process->tss_esp0);
     kprintf("\t\tPCB Address: 0x%x\n", process);
+    kprintf("\t\tAffinity:    0x%x\n", process->affinity);
     kprintf("------------------------\n");
 }
\ No newline at end of file
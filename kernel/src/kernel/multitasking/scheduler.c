@@ -1,15 +1,120 @@
 #include <kpanic.h>
 #include <kprint.h>
 #include <string.h>
+#include <timer.h>
+#include <i686/isr.h>
+#include <i686/smp.h>
 #include <mm/kmalloc.h>
 #include <multitasking/process.h>
 #include <multitasking/scheduler.h>
 
-static struct scheduler_priority_bucket priority_buckets[PRIORITY_NUMBER_OF_PRIORITIES];
-static struct scheduler_process processes[MAX_PROCESS_PID];
-static struct scheduler_process *currently_running_process;
+/**
+ * Priority scheduler
+ *
+ * 	Each priority has a circular run queue, the head of the queue is the next
+ * 	process to run at that priority. Bit N of priority_bitmap is set when the
+ * 	run queue for priority N is non-empty, so the highest runnable priority is
+ * 	found with a single find-first-set no matter how many processes or priorities exist.
+ *
+ * 	Only runnable processes are in the run queues. Blocked and sleeping
+ * 	processes keep their entry (allocated when added, pointed to by the PCB)
+ * 	but are unlinked from their queue.
+ * 	When every run queue is empty the idle process is run. Processes are
+ * 	queued at their effective priority, which includes a priority inherited
+ * 	from a process waiting on one of their mutexes (see mutex.c).
+ *
+ * 	Fair scheduling
+ *
+ * 	Processes created with FAIR_SCHEDULING are not run by strict priority,
+ * 	but share the CPU by weight (SCHEDULER_FAIR_WEIGHT() of their priority).
+ * 	Each keeps a virtual runtime, the ticks it ran scaled down by its weight,
+ * 	and the one furthest behind runs next. They sit below every priority
+ * 	at SCHEDULER_FAIR_LEVEL, in a red-black tree sorted by virtual runtime
+ * 	instead of a circular queue, so picking is still cheap (the leftmost
+ * 	node is cached). Every fair process gets a slice of
+ * 	SCHEDULER_FAIR_LATENCY_TICKS by weight, at least
+ * 	SCHEDULER_FAIR_MIN_GRANULARITY_TICKS. One that falls more than that
+ * 	granularity behind the running process preempts it. Processes are
+ * 	placed relative to min_vruntime when queued, woken up processes at
+ * 	most half a latency period ahead, so a process that slept can not
+ * 	bank CPU time but still gets to run soon. Virtual runtimes are
+ * 	rebased when a process moves to another CPU. A fair process that
+ * 	inherits a priority through a mutex is queued at that priority until
+ * 	it is given back, aging can also lift one out of the tree for a slice.
+ *
+ * 	Every CPU has its own set of run queues and only ever runs processes from
+ * 	them, the running process stays at the head of its queue. New processes go
+ * 	to the CPU with the fewest queued, woken up processes go back to the CPU
+ * 	they last ran on (its caches are still warm). Queueing on another CPU
+ * 	sends it a reschedule IPI, so it can preempt or leave its idle loop.
+ *
+ * 	Work stealing
+ *
+ * 	A CPU that runs out of processes steals one from the CPU with the most
+ * 	waiting, instead of idling while others have a backlog. When a process
+ * 	is queued on a busy CPU, an idle one is kicked with a reschedule IPI to
+ * 	come and take it. Busy CPUs also pull from the busiest every
+ * 	SCHEDULER_BALANCE_TICKS if it is clearly more loaded. The victim is
+ * 	picked from the per-queue counters alone, only its queue is touched
+ * 	for the single process moved. Processes that ran very recently are
+ * 	cache hot and left alone, unless an idle CPU would otherwise have
+ * 	nothing to run. The running process is never taken.
+ *
+ * 	Affinity
+ *
+ * 	A process only runs on the CPUs in its affinity mask. New processes go
+ * 	to the least loaded allowed CPU, and a CPU only steals processes allowed
+ * 	on it. When the mask changes, a waiting process is moved to an allowed
+ * 	CPU right away and a blocked one when it wakes up. A running process is
+ * 	preempted, taken out of its run queue by scheduler_get_next() and queued
+ * 	on an allowed CPU once it is switched away from (scheduler_finish_migration()),
+ * 	no other CPU can pick it up before its registers are saved.
+ *
+ * 	Locking
+ *
+ * 	Each run queue has its own lock, which also covers the entries queued
+ * 	in it. A CPU holds its own across a context switch (see process_yield()),
+ * 	so the process it switches away from can not be picked up anywhere until
+ * 	its registers are saved. Only one run queue lock is waited on at a time,
+ * 	a steal only tries the lock of the victim. Moving a process for its
+ * 	affinity needs two, the second is only waited on if it belongs to a
+ * 	higher CPU index, otherwise both are retaken in that order. Choosing a
+ * 	CPU (least loaded, busiest, idle) reads the counters of other run queues
+ * 	without their locks, the worst that can happen is a less than ideal
+ * 	choice. Other CPUs are told about queued processes after the lock is
+ * 	dropped, so the wait queue and sleep locks can be held while waking.
+ */
+
+_Static_assert(SCHEDULER_FAIR_LEVEL < 32, "Priority bitmap must fit in 32 bits");
+
+// Placement of a woken up fair process, and how far behind one must be to preempt another
+#define FAIR_WAKEUP_CREDIT    (SCHEDULER_FAIR_LATENCY_TICKS * SCHEDULER_FAIR_TICK_VRUNTIME / 2)
+#define FAIR_PREEMPT_VRUNTIME (SCHEDULER_FAIR_MIN_GRANULARITY_TICKS * SCHEDULER_FAIR_TICK_VRUNTIME)
 
-static struct scheduler_process *find_next_process();
+static struct scheduler_run_queue run_queues[SMP_MAX_CPUS];
+
+static struct scheduler_run_queue *lock_queue_of(struct scheduler_process *entry);
+static void enqueue(struct scheduler_process *entry, uint32_t cpu, priority_t priority);
+static void dequeue(struct scheduler_process *entry);
+static void queued_on(uint32_t cpu);
+static uint32_t least_loaded_cpu(cpu_mask_t allowed);
+static void migrate(struct scheduler_process *entry, struct scheduler_run_queue *queue);
+static bool lock_second_queue(uint32_t held, uint32_t other);
+static inline bool allowed_on(struct scheduler_process *entry, uint32_t cpu);
+static inline uint32_t number_waiting(struct scheduler_run_queue *queue);
+static bool steal_from_busiest(uint32_t cpu, uint32_t imbalance, bool take_hot);
+static struct scheduler_process *find_stealable(struct scheduler_run_queue *queue, uint32_t cpu, bool take_hot);
+static void kick_idle_cpu(uint32_t busy_cpu);
+static inline bool stealable(struct scheduler_run_queue *queue, struct scheduler_process *entry, uint32_t cpu);
+static void age_processes(struct scheduler_run_queue *queue);
+static inline priority_t highest_priority(struct scheduler_run_queue *queue);
+static inline priority_t lowest_priority(struct scheduler_run_queue *queue);
+static inline struct scheduler_process *level_head(struct scheduler_run_queue *queue, priority_t level);
+static uint32_t timeslice_of(struct scheduler_run_queue *queue, struct scheduler_process *entry);
+static void account_fair(struct scheduler_run_queue *queue, struct scheduler_process *entry, uint32_t elapsed);
+static bool fair_preempts(struct scheduler_run_queue *queue, struct scheduler_process *running);
+static void update_min_vruntime(struct scheduler_run_queue *queue);
+static bool fair_less(struct rb_node *a, struct rb_node *b);
 
 /**
  * @brief      Initialize the process scheduler
@@ -17,10 +122,12 @@ static struct scheduler_process *find_next_process();
 void scheduler_init()
 {
 	// Clear out everything
-	memset(priority_buckets, 0, sizeof(priority_buckets));
-	memset(processes, 0, sizeof(processes));
+	memset(run_queues, 0, sizeof(run_queues));
 
-	currently_running_process = NULL;
+	for(uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		spinlock_init(&(run_queues[cpu].lock), "run queue");
+		rb_init(&(run_queues[cpu].fair_tree));
+	}
 }
 
 /**
@@ -30,37 +137,44 @@ void scheduler_init()
  */
 void scheduler_add_process(process_t process)
 {
-	struct scheduler_priority_bucket *bucket;
-	pid_t pid;
-
-	pid = process->pid;
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+	uint32_t cpu;
 
 	// Check valid priority
 	if(process->priority < PRIORITY_CRITICAL || process->priority >= PRIORITY_NUMBER_OF_PRIORITIES)
 		goto failed;
 
-	// Check if PID valid and not being used
-	if(pid >= MAX_PROCESS_PID || processes[pid].process)
+	// Check not already added
+	if(process->scheduler_entry)
 		goto failed;
 
-	// Add to process list
-	processes[pid].process = process;
-	processes[pid].next    = NULL;
+	entry = kcalloc(1, sizeof(struct scheduler_process));
+	if(!entry)
+		goto failed;
 
-	// Get the bucket for the priority to be added to
-	bucket = &(priority_buckets[process->priority]);
+	irq_disable();
 
-	// Add to head of list
-	if(bucket->head == NULL || bucket->head->process == NULL) {
-		bucket->head = &(processes[pid]);
-		goto process_added;
-	}
+	// Add to back of the run queue of the least busy CPU it may run on, never ran so not cache hot
+	cpu   = least_loaded_cpu(process->affinity);
+	queue = &run_queues[cpu];
+	spin_lock(&(queue->lock));
+
+	// Fair processes start level with the one furthest behind
+	entry->process   = process;
+	entry->timeslice = 0;
+	entry->cpu       = cpu;
+	entry->vruntime  = queue->min_vruntime;
+	enqueue(entry, cpu, process_effective_priority(process));
+	entry->last_ran = queue->clock - SCHEDULER_CACHE_HOT_TICKS;
+
+	process->scheduler_entry = entry;
+
+	spin_unlock(&(queue->lock));
 
-	// Add to head of list
-	processes[pid].next = bucket->head;
-	bucket->head = &(processes[pid]);
+	queued_on(cpu);
 
-process_added:
+	irq_resume();
 	return;
 
 failed:
@@ -76,55 +190,982 @@ failed:
  */
 void scheduler_remove_process(process_t process)
 {
-	// TODO: Remove process from scheduler list
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+
+	entry = process->scheduler_entry;
+	if(entry == NULL)
+		return;
+
+	irq_disable();
+	queue = lock_queue_of(entry);
+
+	dequeue(entry);
+
+	if(queue->running == entry)
+		queue->running = NULL;
+
+	process->scheduler_entry = NULL;
+
+	spin_unlock(&(queue->lock));
+	irq_resume();
+
+	kfree(entry);
+}
+
+/**
+ * @brief      Take a process out of its run queue until scheduler_unblock_process() is called
+ *
+ * @param[in]  process  The process to block
+ */
+void scheduler_block_process(process_t process)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+
+	entry = process->scheduler_entry;
+	if(entry == NULL)
+		return;
+
+	irq_disable();
+	queue = lock_queue_of(entry);
+
+	dequeue(entry);
+
+	if(queue->running == entry) {
+		queue->running  = NULL;
+		entry->last_ran = queue->clock;
+	}
+
+	spin_unlock(&(queue->lock));
+	irq_resume();
+}
+
+/**
+ * @brief      Put a blocked process back at the back of its run queue
+ *
+ * @param[in]  process  The process to unblock
+ */
+void scheduler_unblock_process(process_t process)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+	uint32_t cpu;
+
+	entry = process->scheduler_entry;
+	if(entry == NULL)
+		return;
+
+	irq_disable();
+	queue = lock_queue_of(entry);
+
+	if(entry->queued) {
+		spin_unlock(&(queue->lock));
+		irq_resume();
+		return;
+	}
+
+	entry->timeslice = 0;
+
+	// Affinity changed while it was blocked
+	if(!allowed_on(entry, entry->cpu)) {
+		if(process->on_cpu) {
+			// Still switching away from its CPU, which moves it once its registers are saved
+			entry->migrating = true;
+			spin_unlock(&(queue->lock));
+		} else {
+			migrate(entry, queue);
+		}
+
+		irq_resume();
+		return;
+	}
+
+	// Back on the CPU it last ran on
+	cpu = entry->cpu;
+	enqueue(entry, cpu, process_effective_priority(process));
+
+	spin_unlock(&(queue->lock));
+
+	queued_on(cpu);
+
+	irq_resume();
+}
+
+/**
+ * @brief      Requeue a process after its effective priority changed (a priority was inherited through a
+ *              mutex, or given back). Drops a boost from aging. Blocked processes pick it up when unblocked.
+ *
+ * @param[in]  process  The process
+ */
+void scheduler_update_priority(process_t process)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+	priority_t priority;
+	uint32_t cpu;
+	bool raised;
+
+	entry = process->scheduler_entry;
+	if(entry == NULL)
+		return;
+
+	irq_disable();
+	queue = lock_queue_of(entry);
+
+	priority = process_effective_priority(process);
+	if(!entry->queued || entry->priority == priority) {
+		spin_unlock(&(queue->lock));
+		irq_resume();
+		return;
+	}
+
+	raised = priority < entry->priority;
+	cpu    = entry->cpu;
+
+	dequeue(entry);
+	enqueue(entry, cpu, priority);
+
+	spin_unlock(&(queue->lock));
+
+	// May now outrank the process running there
+	if(raised)
+		queued_on(cpu);
+
+	irq_resume();
+}
+
+/**
+ * @brief      Move a process off a CPU its affinity no longer allows. Called after process->affinity changed.
+ *
+ * @param[in]  process  The process
+ */
+void scheduler_affinity_changed(process_t process)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+	uint32_t cpu;
+
+	entry = process->scheduler_entry;
+	if(entry == NULL)
+		return;
+
+	irq_disable();
+	queue = lock_queue_of(entry);
+
+	cpu = entry->cpu;
+	if(allowed_on(entry, cpu)) {
+		spin_unlock(&(queue->lock));
+		irq_resume();
+		return;
+	}
+
+	if(process->on_cpu) {
+		// Preempted by its CPU, which moves it once switched away from
+		spin_unlock(&(queue->lock));
+		queued_on(cpu);
+	} else if(entry->queued) {
+		migrate(entry, queue);
+	} else {
+		// Blocked, moved when woken up
+		spin_unlock(&(queue->lock));
+	}
+
+	irq_resume();
+}
+
+/**
+ * @brief      Queue a process taken off this CPU by scheduler_get_next() on a CPU its affinity allows. Called
+ *              once it is switched away from, with interrupts disabled and no run queue locked.
+ *
+ * @param[in]  process  The process switched away from
+ */
+void scheduler_finish_migration(process_t process)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *entry;
+
+	entry = process->scheduler_entry;
+
+	// Set with the run queue of this CPU locked, which was held until the process was switched away from
+	if(entry == NULL || !entry->migrating)
+		return;
+
+	queue = lock_queue_of(entry);
+
+	entry->migrating = false;
+	migrate(entry, queue);
+}
+
+/**
+ * @brief      Set the process this CPU runs when no other process is runnable. Removes it from the run queues.
+ *
+ * @param[in]  process  The idle process
+ */
+void scheduler_set_idle_process(process_t process)
+{
+	irq_disable();
+
+	scheduler_block_process(process);
+	run_queues[cpu_id()].idle_process = process;
+
+	irq_resume();
+}
+
+/**
+ * @brief      Check if any process (besides the idle process) can be run on this CPU. Read without the lock.
+ *
+ * @return     True if a process is waiting in a run queue, False if not
+ */
+bool scheduler_has_runnable()
+{
+	return run_queues[cpu_id()].priority_bitmap != 0;
+}
+
+/**
+ * @brief      Take a waiting process from the busiest CPU when this one has nothing to run. Interrupts must be disabled.
+ *
+ * @return     True if a process was moved to this CPU, False if not
+ */
+bool scheduler_steal()
+{
+	struct scheduler_run_queue *queue;
+	uint32_t cpu;
+	bool stolen;
+
+	cpu   = cpu_id();
+	queue = &run_queues[cpu];
+
+	spin_lock(&(queue->lock));
+
+	// Better to pull a cache hot process than to idle
+	stolen = queue->priority_bitmap == 0 && steal_from_busiest(cpu, 1, true);
+
+	spin_unlock(&(queue->lock));
+	return stolen;
+}
+
+/**
+ * @brief      Account timer ticks to the process running on this CPU
+ *
+ * @param[in]  elapsed  The number of ticks since the last call (more than 1 in tickless mode)
+ *
+ * @return     True if a different process should be run (timeslice over or preempted), False if not
+ */
+bool scheduler_tick(uint32_t elapsed)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *running;
+	bool switch_process;
+
+	queue = &run_queues[cpu_id()];
+	spin_lock_irqsave(&(queue->lock));
+
+	queue->clock += elapsed;
+
+	queue->aging_ticks += elapsed;
+	if(SCHEDULER_AGING_TICKS && queue->aging_ticks >= SCHEDULER_AGING_TICKS) {
+		queue->aging_ticks = 0;
+		age_processes(queue);
+	}
+
+	queue->balance_ticks += elapsed;
+	if(SCHEDULER_BALANCE_TICKS && queue->balance_ticks >= SCHEDULER_BALANCE_TICKS) {
+		queue->balance_ticks = 0;
+		steal_from_busiest(cpu_id(), SCHEDULER_BALANCE_IMBALANCE, false);
+	}
+
+	running = queue->running;
+	if(running == NULL) {
+		switch_process = queue->priority_bitmap != 0;
+	} else {
+		running->timeslice -= MIN(elapsed, running->timeslice);
+		account_fair(queue, running, elapsed);
+
+		// Timeslice over, a higher priority (or fair process far behind) is waiting, or no longer allowed on this CPU
+		switch_process = running->timeslice == 0 || highest_priority(queue) < running->priority ||
+			fair_preempts(queue, running) || !allowed_on(running, cpu_id());
+	}
+
+	spin_unlock_irqrestore(&(queue->lock));
+	return switch_process;
 }
 
 /**
- * @brief      Gets a process by a given pid.
+ * @brief      Check if a higher priority process than the one running on this CPU is runnable
  *
- * @param[in]  pid   The pid of the process
+ * @return     True if the running process should be preempted now, False if not
+ */
+bool scheduler_should_preempt()
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *running;
+	bool preempt;
+
+	queue = &run_queues[cpu_id()];
+	spin_lock_irqsave(&(queue->lock));
+
+	running = queue->running;
+	if(running == NULL)
+		preempt = queue->priority_bitmap != 0;
+	else
+		preempt = highest_priority(queue) < running->priority || fair_preempts(queue, running) ||
+			!allowed_on(running, cpu_id());
+
+	spin_unlock_irqrestore(&(queue->lock));
+	return preempt;
+}
+
+/**
+ * @brief      Get the number of ticks until the process running on this CPU needs to be preempted.
+ *              Used by tickless mode.
  *
- * @return     The process control block (PCB) for a given PID, or NULL if not found
+ * @return     Number of ticks, or 0 if no preemption is needed (nothing else is runnable)
+ */
+uint32_t scheduler_ticks_until_preempt()
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *running;
+	uint32_t ticks;
+
+	queue = &run_queues[cpu_id()];
+	spin_lock_irqsave(&(queue->lock));
+
+	running = queue->running;
+
+	if(running == NULL) {
+		// Idle process, switch as soon as anything is runnable
+		ticks = queue->priority_bitmap ? 1 : 0;
+	} else if(!allowed_on(running, cpu_id())) {
+		// Affinity changed, move it on the next tick
+		ticks = 1;
+	} else if(queue->number_queued == 1) {
+		// Only runnable process, it keeps running until something wakes up
+		ticks = 0;
+	} else if(highest_priority(queue) < running->priority || fair_preempts(queue, running)) {
+		// Higher priority (or fair process far behind) is waiting, preempt on the next tick
+		ticks = 1;
+	} else {
+		ticks = MAX(running->timeslice, 1);
+	}
+
+	spin_unlock_irqrestore(&(queue->lock));
+	return ticks;
+}
+
+/**
+ * @brief      Lock the run queue of this CPU. Held across a context switch, until
+ *              process_switch_finish() runs in the next process. Interrupts must be disabled.
+ */
+void scheduler_lock()
+{
+	spin_lock(&(run_queues[cpu_id()].lock));
+}
+
+/**
+ * @brief      Unlock the run queue of this CPU
  */
-process_t get_process_by_pid(pid_t pid)
+void scheduler_unlock()
 {
-	// Should never reach out of bounds as the size of the processes array
-	// Is the same size as the max value of pid
-	// pid_t is also unsigned, so value cannot be negative
-	return processes[pid].process;
+	spin_unlock(&(run_queues[cpu_id()].lock));
 }
 
 /**
- * @brief      Get the next process to run
+ * @brief      Get the next process to run on this CPU. Its run queue must be locked with scheduler_lock().
  *
  * @return     The process control block (PCB) for the next process to run
  */
 process_t scheduler_get_next()
 {
-	if(currently_running_process && currently_running_process->next) {
-		currently_running_process = currently_running_process->next;
+	struct scheduler_run_queue *queue;
+	struct scheduler_process *running;
+
+	queue = &run_queues[cpu_id()];
+	running = queue->running;
+
+	/**
+	 * Move the running process to the back of its run queue, unless it was
+	 * 	preempted by a higher priority with timeslice left. A fair process
+	 * 	stays where its virtual runtime puts it in the tree.
+	 */
+	if(running) {
+		running->last_ran = queue->clock;
+
+		// Affinity changed while it ran, moved by scheduler_finish_migration() once switched away from
+		if(!allowed_on(running, cpu_id())) {
+			dequeue(running);
+			running->migrating = true;
+			running = NULL;
+			queue->running = NULL;
+		}
+	}
+
+	if(running && (running->timeslice == 0 || highest_priority(queue) >= running->priority)) {
+		running->timeslice = 0;
+
+		if(running->priority != process_effective_priority(running->process)) {
+			// Boost from aging is over
+			dequeue(running);
+			enqueue(running, cpu_id(), process_effective_priority(running->process));
+		} else if(running->priority != SCHEDULER_FAIR_LEVEL && queue->buckets[running->priority].head == running) {
+			queue->buckets[running->priority].head = running->next;
+		}
+	}
+
+	// Out of processes, look for work elsewhere before idling
+	if(queue->priority_bitmap == 0)
+		steal_from_busiest(cpu_id(), 1, true);
+
+	if(queue->priority_bitmap == 0) {
+		if(queue->idle_process == NULL)
+			kpanic("Could not find any process for scheduler");
+
+		queue->running = NULL;
+		return queue->idle_process;
+	}
+
+	queue->running = level_head(queue, highest_priority(queue));
+	if(queue->running->timeslice == 0)
+		queue->running->timeslice = timeslice_of(queue, queue->running);
+
+	return queue->running->process;
+}
+
+/**
+ * @brief      Lock the run queue a process is in, or was last in. A steal can move the process until it is locked.
+ *
+ * @param      entry  The run queue entry of the process
+ *
+ * @return     The locked run queue
+ */
+static struct scheduler_run_queue *lock_queue_of(struct scheduler_process *entry)
+{
+	struct scheduler_run_queue *queue;
+
+	while(1) {
+		queue = &run_queues[entry->cpu];
+		spin_lock(&(queue->lock));
+
+		if(queue == &run_queues[entry->cpu])
+			return queue;
+
+		spin_unlock(&(queue->lock));
+	}
+}
+
+/**
+ * @brief      Add a process to the back of a run queue, or a fair process to the tree by its virtual
+ *              runtime. The run queue must be locked.
+ *
+ * @param      entry     The run queue entry of the process
+ * @param[in]  cpu       The CPU whose run queue to add to
+ * @param[in]  priority  The priority to queue at
+ */
+static void enqueue(struct scheduler_process *entry, uint32_t cpu, priority_t priority)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_priority_bucket *bucket;
+
+	queue = &run_queues[cpu];
+
+	if(priority == SCHEDULER_FAIR_LEVEL) {
+		// Virtual runtimes are relative to the run queue they were gained in
+		if(entry->cpu != cpu)
+			entry->vruntime += queue->min_vruntime - run_queues[entry->cpu].min_vruntime;
+
+		// Back from sleeping (or a boost), only a little ahead of everyone else
+		if((int32_t)(entry->vruntime - (queue->min_vruntime - FAIR_WAKEUP_CREDIT)) < 0)
+			entry->vruntime = queue->min_vruntime - FAIR_WAKEUP_CREDIT;
+
+		entry->weight = SCHEDULER_FAIR_WEIGHT(entry->process->priority);
+		rb_insert(&(queue->fair_tree), &(entry->fair_node), fair_less);
+		queue->fair_weight += entry->weight;
+	} else {
+		bucket = &(queue->buckets[priority]);
+
+		if(bucket->head == NULL) {
+			entry->next  = entry;
+			entry->prev  = entry;
+			bucket->head = entry;
+		} else {
+			// Back of a circular queue is just before the head
+			entry->next = bucket->head;
+			entry->prev = bucket->head->prev;
+			bucket->head->prev->next = entry;
+			bucket->head->prev       = entry;
+		}
+	}
+
+	entry->priority = priority;
+	entry->cpu      = cpu;
+	entry->queued   = true;
+
+	queue->priority_bitmap |= (1 << priority);
+	queue->number_queued++;
+}
+
+/**
+ * @brief      Remove a process from its run queue. The run queue must be locked.
+ *
+ * @param      entry  The run queue entry of the process
+ */
+static void dequeue(struct scheduler_process *entry)
+{
+	struct scheduler_run_queue *queue;
+	struct scheduler_priority_bucket *bucket;
+
+	if(!entry->queued)
+		return;
+
+	queue = &run_queues[entry->cpu];
+	entry->queued = false;
+	queue->number_queued--;
+
+	if(entry->priority == SCHEDULER_FAIR_LEVEL) {
+		rb_remove(&(queue->fair_tree), &(entry->fair_node));
+		queue->fair_weight -= entry->weight;
+
+		if(rb_first(&(queue->fair_tree)) == NULL)
+			queue->priority_bitmap &= ~(1 << SCHEDULER_FAIR_LEVEL);
+		else
+			update_min_vruntime(queue);
+		return;
+	}
+
+	bucket = &(queue->buckets[entry->priority]);
+
+	if(entry->next == entry) {
+		// Last process at this priority
+		bucket->head = NULL;
+		queue->priority_bitmap &= ~(1 << entry->priority);
 	} else {
-		// Need to cycle and find a new full priority list
-		currently_running_process = find_next_process();
+		entry->prev->next = entry->next;
+		entry->next->prev = entry->prev;
+
+		if(bucket->head == entry)
+			bucket->head = entry->next;
+	}
+
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+/**
+ * @brief      Let a CPU know a process was queued on it. Interrupts must be disabled, no run queue locked.
+ *
+ * @param[in]  cpu   The CPU
+ */
+static void queued_on(uint32_t cpu)
+{
+	struct scheduler_run_queue *queue;
+
+	// Timer may be stopped, or need to fire sooner to preempt the running process
+	if(cpu == cpu_id())
+		timer_rearm();
+	else
+		smp_reschedule(cpu);
+
+	// More than the CPU can run right away, someone idle can take the rest
+	queue = &run_queues[cpu];
+	if(number_waiting(queue) > (queue->running ? 0 : 1))
+		kick_idle_cpu(cpu);
+}
+
+/**
+ * @brief      Find the online CPU with the fewest processes queued, out of a set. Ties go to this CPU.
+ *
+ * @param[in]  allowed  The CPUs to choose from, must include an online CPU
+ *
+ * @return     The CPU index
+ */
+static uint32_t least_loaded_cpu(cpu_mask_t allowed)
+{
+	cpu_mask_t candidates;
+	uint32_t cpu, best;
+
+	candidates = allowed & smp_online_mask();
+	if(candidates == 0)
+		return cpu_id();
+
+	best = (candidates & CPU_MASK(cpu_id())) ? cpu_id() : (uint32_t)__builtin_ctz(candidates);
+
+	for(; candidates; candidates &= candidates - 1) {
+		cpu = __builtin_ctz(candidates);
+		if(run_queues[cpu].number_queued < run_queues[best].number_queued)
+			best = cpu;
+	}
+
+	return best;
+}
+
+/**
+ * @brief      Move a process that is not running to the least loaded CPU its affinity allows. Its run queue
+ *              must be locked, it is unlocked on return. Interrupts must be disabled.
+ *
+ * @param      entry  The run queue entry of the process, queued or not
+ * @param      queue  Its locked run queue
+ */
+static void migrate(struct scheduler_process *entry, struct scheduler_run_queue *queue)
+{
+	priority_t priority;
+	uint32_t from, to;
+	bool queued;
+
+	from   = entry->cpu;
+	to     = least_loaded_cpu(entry->process->affinity);
+	queued = entry->queued;
+
+	if(to != from && !lock_second_queue(from, to)) {
+		// Dropped its lock for a moment, leave it be if it was stolen, queued or picked to run meanwhile
+		if(entry->cpu != from || entry->queued != queued || entry->process->on_cpu) {
+			spin_unlock(&(run_queues[to].lock));
+			spin_unlock(&(queue->lock));
+			return;
+		}
+	}
+
+	// Keeps a boost from aging when it was waiting
+	priority = queued ? entry->priority : process_effective_priority(entry->process);
+
+	dequeue(entry);
+	enqueue(entry, to, priority);
+
+	// Cold on the new CPU
+	entry->last_ran = run_queues[to].clock - SCHEDULER_CACHE_HOT_TICKS;
+
+	if(to != from)
+		spin_unlock(&(run_queues[to].lock));
+	spin_unlock(&(queue->lock));
+
+	queued_on(to);
+}
+
+/**
+ * @brief      Lock the run queue of another CPU while holding one. Locks are only waited on in CPU index
+ *              order, so two CPUs doing this can not deadlock.
+ *
+ * @param[in]  held   The CPU whose run queue is locked
+ * @param[in]  other  The CPU whose run queue to lock
+ *
+ * @return     True if the held lock was kept, False if it was dropped and retaken (recheck what it covers)
+ */
+static bool lock_second_queue(uint32_t held, uint32_t other)
+{
+	if(held < other) {
+		spin_lock(&(run_queues[other].lock));
+		return true;
 	}
 
-	if(currently_running_process == NULL)
-		kpanic("Could not find any process for scheduler");
+	// Out of order, only try it
+	if(spin_trylock(&(run_queues[other].lock)))
+		return true;
 
-	return currently_running_process->process;
+	spin_unlock(&(run_queues[held].lock));
+	spin_lock(&(run_queues[other].lock));
+	spin_lock(&(run_queues[held].lock));
+	return false;
 }
 
 /**
- * @brief      Finds the next process to run. Looks for the first non-empty bucket of the higher priority.
+ * @brief      Check if the affinity of a process allows it on a CPU
+ */
+static inline bool allowed_on(struct scheduler_process *entry, uint32_t cpu)
+{
+	return (entry->process->affinity & CPU_MASK(cpu)) != 0;
+}
+
+/**
+ * @brief      Get the number of processes waiting in a run queue, not counting the running one
+ */
+static inline uint32_t number_waiting(struct scheduler_run_queue *queue)
+{
+	return queue->number_queued - (queue->running ? 1 : 0);
+}
+
+/**
+ * @brief      Move a waiting process from the CPU with the most waiting to another CPU. The run queue of
+ *              that CPU must be locked, the busiest is skipped if its lock is taken.
+ *
+ * @param[in]  cpu        The CPU to move to
+ * @param[in]  imbalance  How many more processes the busiest CPU must have waiting than this one
+ * @param[in]  take_hot   Take a cache hot process if there is nothing else
  *
- * @return     The head of the first non-empty priority bucket, or NULL if no processes are found
+ * @return     True if a process was moved, False if not
  */
-static struct scheduler_process *find_next_process()
+static bool steal_from_busiest(uint32_t cpu, uint32_t imbalance, bool take_hot)
 {
-	for(priority_t p = PRIORITY_CRITICAL; p < PRIORITY_NUMBER_OF_PRIORITIES; p++) {
-		if(priority_buckets[p].head)
-			return priority_buckets[p].head;
+	struct scheduler_process *entry;
+	uint32_t victim, waiting, most_waiting;
+
+	// Only the counters are looked at to pick a victim
+	victim = cpu;
+	most_waiting = number_waiting(&run_queues[cpu]) + imbalance - 1;
+	for(uint32_t other = 0; other < smp_number_of_cpus(); other++) {
+		if(other == cpu || !smp_cpu_online(other))
+			continue;
+
+		waiting = number_waiting(&run_queues[other]);
+		if(waiting > most_waiting) {
+			victim = other;
+			most_waiting = waiting;
+		}
+	}
+
+	if(victim == cpu)
+		return false;
+
+	// Never wait while holding a run queue lock, the victim may be stealing from us
+	if(!spin_trylock(&(run_queues[victim].lock)))
+		return false;
+
+	entry = find_stealable(&run_queues[victim], cpu, take_hot);
+	if(entry) {
+		dequeue(entry);
+		enqueue(entry, cpu, entry->priority);
+
+		// Ran on another CPU, cold here
+		entry->last_ran = run_queues[cpu].clock - SCHEDULER_CACHE_HOT_TICKS;
 	}
 
-	return NULL;
-}
\ No newline at end of file
+	spin_unlock(&(run_queues[victim].lock));
+	return entry != NULL;
+}
+
+/**
+ * @brief      Find the process to steal from a run queue, the highest priority one that is not running
+ *              (or still being switched away from), cache cold first, and from the back (waited longest
+ *              since it last ran). Only processes allowed on the thief are taken.
+ *
+ * @param      queue     The run queue of the victim
+ * @param[in]  cpu       The CPU stealing
+ * @param[in]  take_hot  Take a cache hot process if there is nothing else
+ *
+ * @return     The run queue entry, or NULL if there is nothing worth taking
+ */
+static struct scheduler_process *find_stealable(struct scheduler_run_queue *queue, uint32_t cpu, bool take_hot)
+{
+	struct scheduler_process *entry, *hot;
+	struct rb_node *node;
+	uint32_t bitmap;
+	priority_t priority;
+
+	hot = NULL;
+
+	for(bitmap = queue->priority_bitmap; bitmap; bitmap &= bitmap - 1) {
+		priority = __builtin_ctz(bitmap);
+
+		// Fair processes furthest ahead in virtual runtime first, the others are due to run there soon
+		if(priority == SCHEDULER_FAIR_LEVEL) {
+			for(node = rb_last(&(queue->fair_tree)); node; node = rb_prev(node)) {
+				entry = rb_entry(node, struct scheduler_process, fair_node);
+				if(!stealable(queue, entry, cpu))
+					continue;
+
+				if(queue->clock - entry->last_ran >= SCHEDULER_CACHE_HOT_TICKS)
+					return entry;
+
+				if(hot == NULL)
+					hot = entry;
+			}
+
+			continue;
+		}
+
+		entry = queue->buckets[priority].head;
+		do {
+			entry = entry->prev;
+			if(!stealable(queue, entry, cpu))
+				continue;
+
+			if(queue->clock - entry->last_ran >= SCHEDULER_CACHE_HOT_TICKS)
+				return entry;
+
+			if(hot == NULL)
+				hot = entry;
+		} while(entry != queue->buckets[priority].head);
+	}
+
+	return take_hot ? hot : NULL;
+}
+
+/**
+ * @brief      Check if a process can be moved to another CPU, it is not running (or still being switched away
+ *              from) and its affinity allows it there
+ */
+static inline bool stealable(struct scheduler_run_queue *queue, struct scheduler_process *entry, uint32_t cpu)
+{
+	return entry != queue->running && !entry->process->on_cpu && allowed_on(entry, cpu);
+}
+
+/**
+ * @brief      Wake an idle CPU to steal from a busy one. Looks at the other run queues without their locks.
+ *
+ * @param[in]  busy_cpu  The CPU with processes waiting
+ */
+static void kick_idle_cpu(uint32_t busy_cpu)
+{
+	for(uint32_t cpu = 0; cpu < smp_number_of_cpus(); cpu++) {
+		if(cpu == busy_cpu || !smp_cpu_online(cpu))
+			continue;
+
+		// Halted in its idle loop with nothing queued
+		if(run_queues[cpu].running == NULL && run_queues[cpu].priority_bitmap == 0) {
+			smp_reschedule(cpu);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief      Boost the longest waiting process of the lowest non-empty priority by one level
+ *
+ * @param      queue  The run queues of this CPU
+ */
+static void age_processes(struct scheduler_run_queue *queue)
+{
+	struct scheduler_process *entry;
+	priority_t lowest;
+
+	if(queue->priority_bitmap == 0)
+		return;
+
+	// Nothing below the highest runnable priority is waiting
+	lowest = lowest_priority(queue);
+	if(lowest <= highest_priority(queue))
+		return;
+
+	entry = level_head(queue, lowest);
+	if(entry == queue->running)
+		return;
+
+	dequeue(entry);
+	enqueue(entry, entry->cpu, lowest - 1);
+}
+
+/**
+ * @brief      Get the highest non-empty priority. priority_bitmap must not be 0.
+ */
+static inline priority_t highest_priority(struct scheduler_run_queue *queue)
+{
+	return __builtin_ctz(queue->priority_bitmap);
+}
+
+/**
+ * @brief      Get the lowest non-empty priority. priority_bitmap must not be 0.
+ */
+static inline priority_t lowest_priority(struct scheduler_run_queue *queue)
+{
+	return 31 - __builtin_clz(queue->priority_bitmap);
+}
+
+/**
+ * @brief      Get the process to run next at a non-empty priority, the head of its bucket or the fair process
+ *              furthest behind
+ */
+static inline struct scheduler_process *level_head(struct scheduler_run_queue *queue, priority_t level)
+{
+	if(level == SCHEDULER_FAIR_LEVEL)
+		return rb_entry(rb_first(&(queue->fair_tree)), struct scheduler_process, fair_node);
+
+	return queue->buckets[level].head;
+}
+
+/**
+ * @brief      Work out the timeslice of a process picked to run. A fair process gets its share of the latency
+ *              period by weight, but at least the minimum granularity.
+ *
+ * @param      queue  The run queue of the process
+ * @param      entry  The run queue entry of the process
+ *
+ * @return     The timeslice in ticks
+ */
+static uint32_t timeslice_of(struct scheduler_run_queue *queue, struct scheduler_process *entry)
+{
+	uint32_t slice;
+
+	if(entry->priority != SCHEDULER_FAIR_LEVEL)
+		return SCHEDULER_TIMESLICE_TICKS(entry->priority);
+
+	slice = SCHEDULER_FAIR_LATENCY_TICKS * entry->weight / queue->fair_weight;
+	return MAX(slice, SCHEDULER_FAIR_MIN_GRANULARITY_TICKS);
+}
+
+/**
+ * @brief      Add the ticks a fair process ran to its virtual runtime, keeping the fair tree sorted. Time
+ *              spent lifted above the fair level (inherited priority, aging) counts too.
+ *
+ * @param      queue    The run queue of this CPU
+ * @param      entry    The run queue entry of the running process
+ * @param[in]  elapsed  The number of ticks it ran
+ */
+static void account_fair(struct scheduler_run_queue *queue, struct scheduler_process *entry, uint32_t elapsed)
+{
+	uint32_t delta;
+	bool in_tree;
+
+	if(!(entry->process->creation_flags & FAIR_SCHEDULING))
+		return;
+
+	// Heavier processes gain virtual runtime slower, so they run for longer
+	delta = elapsed * (SCHEDULER_FAIR_TICK_VRUNTIME * SCHEDULER_FAIR_WEIGHT(PRIORITY_NORMAL) /
+		SCHEDULER_FAIR_WEIGHT(entry->process->priority));
+
+	in_tree = entry->queued && entry->priority == SCHEDULER_FAIR_LEVEL;
+	if(in_tree)
+		rb_remove(&(queue->fair_tree), &(entry->fair_node));
+
+	entry->vruntime += delta;
+
+	if(in_tree) {
+		rb_insert(&(queue->fair_tree), &(entry->fair_node), fair_less);
+		update_min_vruntime(queue);
+	}
+}
+
+/**
+ * @brief      Check if a fair process waiting is far enough behind the running one to preempt it
+ *
+ * @param      queue    The run queue of this CPU
+ * @param      running  The run queue entry of the running process
+ *
+ * @return     True if the running process should be preempted, False if not
+ */
+static bool fair_preempts(struct scheduler_run_queue *queue, struct scheduler_process *running)
+{
+	struct scheduler_process *first;
+
+	if(running->priority != SCHEDULER_FAIR_LEVEL)
+		return false;
+
+	// The running process is in the tree, so it is never empty
+	first = level_head(queue, SCHEDULER_FAIR_LEVEL);
+	return first != running && (int32_t)(running->vruntime - first->vruntime) > FAIR_PREEMPT_VRUNTIME;
+}
+
+/**
+ * @brief      Move min_vruntime up to the smallest virtual runtime in the fair tree, it never goes back
+ *
+ * @param      queue  The run queue
+ */
+static void update_min_vruntime(struct scheduler_run_queue *queue)
+{
+	struct rb_node *first;
+	uint32_t vruntime;
+
+	first = rb_first(&(queue->fair_tree));
+	if(first == NULL)
+		return;
+
+	vruntime = rb_entry(first, struct scheduler_process, fair_node)->vruntime;
+	if((int32_t)(vruntime - queue->min_vruntime) > 0)
+		queue->min_vruntime = vruntime;
+}
+
+/**
+ * @brief      Order of the fair tree, by virtual runtime (compared so it can wrap around)
+ */
+static bool fair_less(struct rb_node *a, struct rb_node *b)
+{
+	return (int32_t)(rb_entry(a, struct scheduler_process, fair_node)->vruntime -
+		rb_entry(b, struct scheduler_process, fair_node)->vruntime) < 0;
+}
@@ -0,0 +1,75 @@
+#include <multitasking/semaphore.h>
+
+/**
+ * Semaphores
+ *
+ * 	A counting semaphore puts processes to sleep on its wait queue while the
+ * 	count is 0. Raising it wakes the highest priority waiter, and can be done
+ * 	from interrupt handlers (to signal a completed transfer, for example).
+ * 	A semaphore has no owner, so unlike a mutex no priority is inherited
+ * 	through it.
+ */
+
+/**
+ * @brief      Initialize a semaphore
+ *
+ * @param      semaphore  The semaphore
+ * @param[in]  count      The number of times it can be taken before anyone waits
+ */
+void semaphore_init(semaphore_t *semaphore, uint32_t count)
+{
+	semaphore->count = count;
+	wait_queue_init(&(semaphore->wait));
+}
+
+/**
+ * @brief      Take the semaphore, sleeping while the count is 0. Not from interrupt handlers.
+ *
+ * @param      semaphore  The semaphore
+ */
+void semaphore_down(semaphore_t *semaphore)
+{
+	wait_queue_lock(&(semaphore->wait));
+
+	while(semaphore->count == 0)
+		wait_queue_block(&(semaphore->wait));
+
+	semaphore->count--;
+
+	wait_queue_unlock(&(semaphore->wait));
+}
+
+/**
+ * @brief      Take the semaphore if the count is not 0
+ *
+ * @param      semaphore  The semaphore
+ *
+ * @return     True if taken, False if it would have to wait
+ */
+bool semaphore_try_down(semaphore_t *semaphore)
+{
+	bool taken;
+
+	wait_queue_lock(&(semaphore->wait));
+
+	taken = semaphore->count != 0;
+	if(taken)
+		semaphore->count--;
+
+	wait_queue_unlock(&(semaphore->wait));
+	return taken;
+}
+
+/**
+ * @brief      Raise the count, waking a waiter. Can be called from interrupt handlers.
+ *
+ * @param      semaphore  The semaphore
+ */
+void semaphore_up(semaphore_t *semaphore)
+{
+	wait_queue_lock(&(semaphore->wait));
+	semaphore->count++;
+	wait_queue_unlock(&(semaphore->wait));
+
+	wait_queue_wake_highest(&(semaphore->wait));
+}
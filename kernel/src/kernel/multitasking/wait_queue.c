@@ -0,0 +1,188 @@
+#include <multitasking/process.h>
+#include <multitasking/scheduler.h>
+#include <multitasking/wait_queue.h>
+
+/**
+ * Wait queues
+ *
+ * 	A blocked process is removed from the run queues and only put back when
+ * 	woken, so it uses no CPU time while it waits. To avoid missing a wakeup,
+ * 	check the condition being waited on and call wait_queue_block() with the
+ * 	wait queue locked:
+ *
+ * 		wait_queue_lock(&queue);
+ * 		while(!condition)
+ * 			wait_queue_block(&queue);
+ * 		wait_queue_unlock(&queue);
+ *
+ * 	and make the condition true before waking. A waker on another CPU either
+ * 	changed the condition before it was checked, or has to wait for the lock
+ * 	until the process is on the queue. wait_queue_block() drops the lock
+ * 	while blocked, so it only protects the condition while it is checked,
+ * 	like a condition variable.
+ */
+
+static void wake(process_t process);
+
+/**
+ * @brief      Initialize an empty wait queue
+ *
+ * @param      queue  The wait queue
+ */
+void wait_queue_init(wait_queue_t *queue)
+{
+	queue->head = NULL;
+	queue->tail = NULL;
+	spinlock_init(&(queue->lock), "wait queue");
+}
+
+/**
+ * @brief      Lock a wait queue, with interrupts disabled
+ *
+ * @param      queue  The wait queue
+ */
+void wait_queue_lock(wait_queue_t *queue)
+{
+	spin_lock_irqsave(&(queue->lock));
+}
+
+/**
+ * @brief      Unlock a wait queue locked with wait_queue_lock()
+ *
+ * @param      queue  The wait queue
+ */
+void wait_queue_unlock(wait_queue_t *queue)
+{
+	spin_unlock_irqrestore(&(queue->lock));
+}
+
+/**
+ * @brief      Block the current process until it is woken through the wait queue. The wait queue must be
+ *              locked with wait_queue_lock(), it is unlocked while blocked and locked again on return.
+ *
+ * @param      queue  The wait queue
+ */
+void wait_queue_block(wait_queue_t *queue)
+{
+	current_process->state     = PROCESS_BLOCKED;
+	current_process->wait_next = NULL;
+
+	if(queue->tail)
+		queue->tail->wait_next = current_process;
+	else
+		queue->head = current_process;
+	queue->tail = current_process;
+
+	scheduler_block_process(current_process);
+
+	// A wake from here on puts the process back in its run queue, the yield then just keeps running it
+	spin_unlock(&(queue->lock));
+
+	// Returns once woken up and scheduled again
+	process_yield();
+
+	spin_lock(&(queue->lock));
+}
+
+/**
+ * @brief      Wake the process that has waited the longest. Can be called from interrupt handlers.
+ *
+ * @param      queue  The wait queue
+ *
+ * @return     True if a process was woken, False if the queue was empty
+ */
+bool wait_queue_wake_one(wait_queue_t *queue)
+{
+	process_t process;
+
+	wait_queue_lock(queue);
+
+	process = queue->head;
+	if(process) {
+		queue->head = process->wait_next;
+		if(queue->head == NULL)
+			queue->tail = NULL;
+
+		wake(process);
+	}
+
+	wait_queue_unlock(queue);
+	return process != NULL;
+}
+
+/**
+ * @brief      Wake the highest priority process (effective priority), the one that waited the longest
+ *              among equals. Can be called from interrupt handlers.
+ *
+ * @param      queue  The wait queue
+ *
+ * @return     True if a process was woken, False if the queue was empty
+ */
+bool wait_queue_wake_highest(wait_queue_t *queue)
+{
+	process_t process, previous, best, best_previous;
+
+	wait_queue_lock(queue);
+
+	best = best_previous = NULL;
+	for(previous = NULL, process = queue->head; process; previous = process, process = process->wait_next) {
+		if(best == NULL || process_effective_priority(process) < process_effective_priority(best)) {
+			best          = process;
+			best_previous = previous;
+		}
+	}
+
+	if(best) {
+		if(best_previous)
+			best_previous->wait_next = best->wait_next;
+		else
+			queue->head = best->wait_next;
+
+		if(queue->tail == best)
+			queue->tail = best_previous;
+
+		wake(best);
+	}
+
+	wait_queue_unlock(queue);
+	return best != NULL;
+}
+
+/**
+ * @brief      Wake every process on the wait queue. Can be called from interrupt handlers.
+ *
+ * @param      queue  The wait queue
+ *
+ * @return     The number of processes woken
+ */
+size_t wait_queue_wake_all(wait_queue_t *queue)
+{
+	process_t process;
+	size_t woken;
+
+	wait_queue_lock(queue);
+
+	woken = 0;
+	while((process = queue->head)) {
+		queue->head = process->wait_next;
+		wake(process);
+		woken++;
+	}
+	queue->tail = NULL;
+
+	wait_queue_unlock(queue);
+	return woken;
+}
+
+/**
+ * @brief      Make a blocked process runnable again. The wait queue must be locked.
+ *
+ * @param[in]  process  The process
+ */
+static void wake(process_t process)
+{
+	process->wait_next = NULL;
+	process->state     = PROCESS_RUNNABLE;
+
+	scheduler_unblock_process(process);
+}
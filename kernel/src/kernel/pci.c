@@ -2,6 +2,10 @@
 #include <kprint.h>
 #include <pci.h>
 #include <portio.h>
+#include <spinlock.h>
+
+// The address and data ports are one transaction, another CPU must not move the address in between
+static spinlock_t pci_config_lock = SPINLOCK_INITIALIZER("pci config");
 
 /**
  * @brief      Initialize the PCI bus
@@ -73,6 +77,7 @@ void pci_get_device_header(uint8_t bus, uint8_t device, struct pci_device *pci_d
 	// Set location information
 	pci_device->bus = bus;
 	pci_device->device = device;
+	pci_device->function = 0;
 
 	// Set device id and vendor id
 	pci_device->device_id = pci_get_device_id(bus, device);
@@ -88,6 +93,11 @@ void pci_get_device_header(uint8_t bus, uint8_t device, struct pci_device *pci_d
 
 	// Set bist, header type, latency timer, cache line size
 	pci_device->_header_type_line = pci_read32(bus, device, 0, PCI_HEADER);
+
+	// No message signalled interrupts until enabled
+	pci_device->msi_vector       = 0;
+	pci_device->msi_vector_count = 0;
+	pci_device->msix_table       = NULL;
 }
 
 /**
@@ -150,18 +160,78 @@ inline uint8_t pci_get_header_type(uint8_t bus, uint8_t device)
  * @param[in]  function  The function number for the device
  * @param[in]  offset    The offset into the device header
  *
- * @return     { description_of_the_return_value }
+ * @return     The 32bit value containing offset
  */
 uint32_t pci_read32(uint8_t bus, uint8_t device, uint8_t function, enum pci_header_offsets offset)
 {
-	uint32_t address;
+	uint32_t address, value;
 
 	address = PCI_ADDRESS_ENABLE_BIT;
 	address |= (((uint32_t)bus) << 16) | (((uint32_t)device) << 11);
 	address |= (((uint32_t)function) << 8) | (((uint8_t)offset) & 0xFC);
 
+	spin_lock_irqsave(&pci_config_lock);
+
 	out32(PCI_CONFIG_ADDRESS, address);
 
 	// (offset & 2) * 8 gets the upper or lower 16bits of the 32bit value returned
-	return in32(PCI_CONFIG_DATA);
+	value = in32(PCI_CONFIG_DATA);
+
+	spin_unlock_irqrestore(&pci_config_lock);
+	return value;
+}
+
+/**
+ * @brief      Writes a 32bit value to the PCI bus
+ *
+ * @param[in]  bus       The bus number to write to
+ * @param[in]  device    The device ID to write to
+ * @param[in]  function  The function number for the device
+ * @param[in]  offset    The offset into the device header (rounded down to 32bits)
+ * @param[in]  value     The value to write
+ */
+void pci_write32(uint8_t bus, uint8_t device, uint8_t function, enum pci_header_offsets offset, uint32_t value)
+{
+	uint32_t address;
+
+	address = PCI_ADDRESS_ENABLE_BIT;
+	address |= (((uint32_t)bus) << 16) | (((uint32_t)device) << 11);
+	address |= (((uint32_t)function) << 8) | (((uint8_t)offset) & 0xFC);
+
+	spin_lock_irqsave(&pci_config_lock);
+
+	out32(PCI_CONFIG_ADDRESS, address);
+	out32(PCI_CONFIG_DATA, value);
+
+	spin_unlock_irqrestore(&pci_config_lock);
+}
+
+/**
+ * @brief      Walk the capability list of a device
+ *
+ * @param      pci_device     The PCI device
+ * @param[in]  capability_id  The capability to find (enum pci_capability_ids)
+ *
+ * @return     Config space offset of the capability, or 0 if the device does not have it
+ */
+uint8_t pci_find_capability(struct pci_device *pci_device, uint8_t capability_id)
+{
+	uint32_t header;
+	uint8_t offset;
+
+	if(!(pci_read32(pci_device->bus, pci_device->device, pci_device->function, PCI_STATUS) >> 16 & PCI_STATUS_CAPABILITIES_LIST))
+		return 0;
+
+	offset = pci_read32(pci_device->bus, pci_device->device, pci_device->function, PCI_TYPE_0_CAPABILITIES_POINTER) & 0xFC;
+
+	// Bounded in case of a looping list, at most 48 capabilities fit after the header
+	for(uint32_t i = 0; offset && i < 48; i++) {
+		header = pci_read32(pci_device->bus, pci_device->device, pci_device->function, offset);
+		if((header & 0xFF) == capability_id)
+			return offset;
+
+		offset = (header >> 8) & 0xFC;
+	}
+
+	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include <kprint.h>
+#include <macros.h>
+#include <pci.h>
+#include <i686/apic.h>
+#include <i686/irq.h>
+#include <i686/isr.h>
+#include <mm/paging.h>
+
+/**
+ * Message signalled interrupts
+ *
+ * 	Instead of raising a shared INTx line, the device writes the vector to
+ * 	the local APIC (APIC_MSI_ADDRESS) itself. MSI gives a device a block of
+ * 	up to 32 consecutive vectors from one capability, MSI-X gives every entry
+ * 	of a table in device memory its own address, vector and mask bit (one per
+ * 	queue). Vectors come from irq_allocate_vectors() and are delivered to the
+ * 	boot CPU, edge triggered. Install a handler on each vector before enabling.
+ */
+
+static void set_command(struct pci_device *pci_device, uint16_t set, uint16_t clear);
+static uint32_t msi_address();
+static volatile uint32_t *map_msix_table(struct pci_device *pci_device, uint8_t capability, uint32_t entries);
+
+/**
+ * @brief      Enable MSI, on success the device uses vectors msi_vector to msi_vector + msi_vector_count - 1
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  count       The number of vectors wanted, a power of 2 (clamped to what the device supports)
+ *
+ * @return     True if enabled, False if the device has no MSI capability or no vectors are left
+ */
+bool pci_enable_msi(struct pci_device *pci_device, uint32_t count)
+{
+	uint32_t control, supported, order;
+	uint8_t capability, vector;
+
+	if(!apic_is_enabled() || count == 0 || pci_device->msi_vector_count)
+		return false;
+
+	capability = pci_find_capability(pci_device, PCI_CAPABILITY_MSI);
+	if(capability == 0)
+		return false;
+
+	control = pci_read32(pci_device->bus, pci_device->device, pci_device->function, capability) >> 16;
+
+	supported = 1 << ((control >> PCI_MSI_CONTROL_MULTIPLE_SHIFT) & PCI_MSI_CONTROL_MULTIPLE_MASK);
+	count     = MIN(count, supported);
+	for(order = 0; (2u << order) <= count; order++);
+	count = 1 << order;
+
+	vector = irq_allocate_vectors(count);
+	if(vector == 0)
+		return false;
+
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability + PCI_MSI_ADDRESS, msi_address());
+
+	// Device ORs the message number into the low bits of the data
+	if(control & PCI_MSI_CONTROL_64BIT) {
+		pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability + PCI_MSI_ADDRESS + 4, 0);
+		pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability + PCI_MSI_DATA_64, vector);
+	} else {
+		pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability + PCI_MSI_DATA_32, vector);
+	}
+
+	control &= ~(PCI_MSI_CONTROL_MULTIPLE_MASK << PCI_MSI_CONTROL_ENABLED_SHIFT);
+	control |= (order << PCI_MSI_CONTROL_ENABLED_SHIFT) | PCI_MSI_CONTROL_ENABLE;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability, control << 16);
+
+	set_command(pci_device, PCI_COMMAND_BUS_MASTER | PCI_COMMAND_INTERRUPT_DISABLE, 0);
+
+	pci_device->msi_vector       = vector;
+	pci_device->msi_vector_count = count;
+
+	kprintf(KPRINT_DEBUG "PCI %d:%d MSI vectors %d - %d\n", pci_device->bus, pci_device->device,
+		vector, vector + count - 1);
+
+	return true;
+}
+
+/**
+ * @brief      Disable MSI, the device goes back to its INTx line
+ *
+ * @param      pci_device  The PCI device
+ */
+void pci_disable_msi(struct pci_device *pci_device)
+{
+	uint32_t control;
+	uint8_t capability;
+
+	if(pci_device->msix_table || pci_device->msi_vector_count == 0)
+		return;
+
+	capability = pci_find_capability(pci_device, PCI_CAPABILITY_MSI);
+	if(capability == 0)
+		return;
+
+	control = pci_read32(pci_device->bus, pci_device->device, pci_device->function, capability) >> 16;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability,
+		(control & ~PCI_MSI_CONTROL_ENABLE) << 16);
+
+	set_command(pci_device, 0, PCI_COMMAND_INTERRUPT_DISABLE);
+
+	irq_free_vectors(pci_device->msi_vector, pci_device->msi_vector_count);
+	pci_device->msi_vector       = 0;
+	pci_device->msi_vector_count = 0;
+}
+
+/**
+ * @brief      Enable MSI-X, table entry N raises vector msi_vector + N. Entries start unmasked.
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  count       The number of table entries to use, a power of 2 (clamped to the table size)
+ *
+ * @return     True if enabled, False if the device has no MSI-X capability, the table can not be mapped
+ *             or no vectors are left
+ */
+bool pci_enable_msix(struct pci_device *pci_device, uint32_t count)
+{
+	volatile uint32_t *table, *entry;
+	uint32_t control, entries;
+	uint8_t capability, vector;
+
+	if(!apic_is_enabled() || count == 0 || pci_device->msi_vector_count)
+		return false;
+
+	capability = pci_find_capability(pci_device, PCI_CAPABILITY_MSIX);
+	if(capability == 0)
+		return false;
+
+	control = pci_read32(pci_device->bus, pci_device->device, pci_device->function, capability) >> 16;
+	entries = (control & PCI_MSIX_CONTROL_TABLE_SIZE_MASK) + 1;
+
+	// Vector blocks are powers of 2
+	count = MIN(count, entries);
+	while(count & (count - 1))
+		count &= count - 1;
+
+	vector = irq_allocate_vectors(count);
+	if(vector == 0)
+		return false;
+
+	table = map_msix_table(pci_device, capability, entries);
+	if(table == NULL) {
+		irq_free_vectors(vector, count);
+		return false;
+	}
+
+	// Masked as a whole while the table is written
+	control |= PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_FUNCTION_MASK;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability, control << 16);
+
+	for(uint32_t i = 0; i < entries; i++) {
+		entry = table + i * PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t);
+
+		if(i < count) {
+			entry[PCI_MSIX_ENTRY_ADDRESS_LOW / sizeof(uint32_t)]  = msi_address();
+			entry[PCI_MSIX_ENTRY_ADDRESS_HIGH / sizeof(uint32_t)] = 0;
+			entry[PCI_MSIX_ENTRY_DATA / sizeof(uint32_t)]         = vector + i;
+			entry[PCI_MSIX_ENTRY_CONTROL / sizeof(uint32_t)]      = 0;
+		} else {
+			entry[PCI_MSIX_ENTRY_CONTROL / sizeof(uint32_t)]      = PCI_MSIX_ENTRY_MASKED;
+		}
+	}
+
+	control &= ~PCI_MSIX_CONTROL_FUNCTION_MASK;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability, control << 16);
+
+	set_command(pci_device, PCI_COMMAND_BUS_MASTER | PCI_COMMAND_INTERRUPT_DISABLE, 0);
+
+	pci_device->msix_table       = table;
+	pci_device->msi_vector       = vector;
+	pci_device->msi_vector_count = count;
+
+	kprintf(KPRINT_DEBUG "PCI %d:%d MSI-X vectors %d - %d\n", pci_device->bus, pci_device->device,
+		vector, vector + count - 1);
+
+	return true;
+}
+
+/**
+ * @brief      Disable MSI-X, the device goes back to its INTx line
+ *
+ * @param      pci_device  The PCI device
+ */
+void pci_disable_msix(struct pci_device *pci_device)
+{
+	uint32_t control;
+	uint8_t capability;
+
+	if(pci_device->msix_table == NULL)
+		return;
+
+	capability = pci_find_capability(pci_device, PCI_CAPABILITY_MSIX);
+	if(capability == 0)
+		return;
+
+	control = pci_read32(pci_device->bus, pci_device->device, pci_device->function, capability) >> 16;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, capability,
+		(control & ~PCI_MSIX_CONTROL_ENABLE) << 16);
+
+	set_command(pci_device, 0, PCI_COMMAND_INTERRUPT_DISABLE);
+
+	irq_free_vectors(pci_device->msi_vector, pci_device->msi_vector_count);
+	pci_device->msi_vector       = 0;
+	pci_device->msi_vector_count = 0;
+
+	// The mapping stays, the MMIO window is never reclaimed
+	pci_device->msix_table = NULL;
+}
+
+/**
+ * @brief      Stop an MSI-X table entry from raising its vector
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  entry       The table entry
+ */
+void pci_msix_mask(struct pci_device *pci_device, uint32_t entry)
+{
+	if(pci_device->msix_table == NULL || entry >= pci_device->msi_vector_count)
+		return;
+
+	pci_device->msix_table[(entry * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) / sizeof(uint32_t)] |= PCI_MSIX_ENTRY_MASKED;
+}
+
+/**
+ * @brief      Let an MSI-X table entry raise its vector
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  entry       The table entry
+ */
+void pci_msix_unmask(struct pci_device *pci_device, uint32_t entry)
+{
+	if(pci_device->msix_table == NULL || entry >= pci_device->msi_vector_count)
+		return;
+
+	pci_device->msix_table[(entry * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) / sizeof(uint32_t)] &= ~PCI_MSIX_ENTRY_MASKED;
+}
+
+/**
+ * @brief      Set and clear bits in the command register
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  set         Bits to set
+ * @param[in]  clear       Bits to clear
+ */
+static void set_command(struct pci_device *pci_device, uint16_t set, uint16_t clear)
+{
+	uint32_t command;
+
+	// Status is the upper half, its bits are cleared by writing 1 so it is written as 0
+	command = pci_read32(pci_device->bus, pci_device->device, pci_device->function, PCI_STATUS) & 0xFFFF;
+	command = (command | set) & ~clear;
+	pci_write32(pci_device->bus, pci_device->device, pci_device->function, PCI_STATUS, command);
+
+	pci_device->command = command;
+}
+
+/**
+ * @brief      Get the message address targeting the local APIC of this CPU
+ */
+static uint32_t msi_address()
+{
+	return APIC_MSI_ADDRESS | ((uint32_t)apic_id() << APIC_MSI_DESTINATION_SHIFT);
+}
+
+/**
+ * @brief      Map the MSI-X table from the BAR it lives in
+ *
+ * @param      pci_device  The PCI device
+ * @param[in]  capability  Config space offset of the MSI-X capability
+ * @param[in]  entries     Number of entries in the table
+ *
+ * @return     The table, or NULL if the BAR is not a 32 bit addressable memory BAR
+ */
+static volatile uint32_t *map_msix_table(struct pci_device *pci_device, uint8_t capability, uint32_t entries)
+{
+	uint32_t table, bar, bar_high;
+	uint8_t bir;
+
+	table = pci_read32(pci_device->bus, pci_device->device, pci_device->function, capability + PCI_MSIX_TABLE);
+	bir   = table & PCI_MSIX_TABLE_BIR_MASK;
+	if(bir > 5)
+		return NULL;
+
+	bar = pci_read32(pci_device->bus, pci_device->device, pci_device->function,
+		PCI_TYPE_0_BASE_ADDRESS_REGISTERS_0 + bir * sizeof(uint32_t));
+	if(bar & PCI_BAR_IO)
+		return NULL;
+
+	if((bar & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64) {
+		bar_high = (bir < 5) ? pci_read32(pci_device->bus, pci_device->device, pci_device->function,
+			PCI_TYPE_0_BASE_ADDRESS_REGISTERS_0 + (bir + 1) * sizeof(uint32_t)) : 1;
+
+		// Above 4GiB, out of reach without PAE
+		if(bar_high)
+			return NULL;
+	}
+
+	return paging_map_mmio((bar & PCI_BAR_MEMORY_MASK) + (table & ~PCI_MSIX_TABLE_BIR_MASK),
+		entries * PCI_MSIX_ENTRY_SIZE);
+}
@@ -0,0 +1,314 @@
+#include <kprint.h>
+#include <spinlock.h>
+#include <i686/isr.h>
+
+/**
+ * Spinlocks
+ *
+ * 	Spinlocks are taken ticket style: a CPU takes the next ticket with a
+ * 	single atomic add and waits until the owner field reaches it, so CPUs
+ * 	get the lock in the order they asked for it and nobody starves. While
+ * 	waiting only the lock is read, the cache line is not written until it
+ * 	is released.
+ *
+ * 	A lock that is also taken from interrupt handlers must be held with
+ * 	interrupts disabled, otherwise an interrupt on the CPU holding it spins
+ * 	forever. spin_lock_irqsave() disables them with irq_disable(), so the
+ * 	previous state is kept in the sync depth and restored by irq_resume()
+ * 	in spin_unlock_irqrestore(). Locks must be released in the reverse
+ * 	order they were taken in.
+ *
+ * 	Reader-writer locks keep the number of readers in the lock word along
+ * 	with a writer bit. A writer that finds readers sets the writer waiting
+ * 	bit, which keeps new readers out until it got the lock.
+ *
+ * 	Spinlocks must not be held across anything that blocks or sleeps.
+ */
+
+#if SPINLOCK_STATS
+// Every lock that was taken at least once, newest first
+static struct spinlock_stats *stats_list;
+
+static void stats_account(struct spinlock_stats *stats, uint32_t spins);
+#endif
+
+/**
+ * @brief      Initialize an unlocked spinlock
+ *
+ * @param      lock  The lock
+ * @param[in]  name  Name shown in the contention statistics
+ */
+void spinlock_init(spinlock_t *lock, const char *name)
+{
+	lock->value = 0;
+
+#if SPINLOCK_STATS
+	lock->stats = (struct spinlock_stats){.name = name};
+#else
+	(void)name;
+#endif
+}
+
+/**
+ * @brief      Take a spinlock, spinning until it is free
+ *
+ * @param      lock  The lock
+ */
+void spin_lock(spinlock_t *lock)
+{
+	uint16_t ticket;
+	uint32_t spins;
+
+	ticket = __atomic_fetch_add(&(lock->tickets.next), 1, __ATOMIC_ACQUIRE);
+
+	spins = 0;
+	while(__atomic_load_n(&(lock->tickets.owner), __ATOMIC_ACQUIRE) != ticket) {
+		asm volatile("pause");
+		spins++;
+	}
+
+#if SPINLOCK_STATS
+	stats_account(&(lock->stats), spins);
+#endif
+}
+
+/**
+ * @brief      Take a spinlock if it is free
+ *
+ * @param      lock  The lock
+ *
+ * @return     True if taken, False if someone else holds it
+ */
+bool spin_trylock(spinlock_t *lock)
+{
+	uint32_t value;
+
+	value = lock->value;
+	if((uint16_t)value != (uint16_t)(value >> 16))
+		return false;
+
+	// Take the next ticket only if nobody else took one meanwhile
+	if(!__sync_bool_compare_and_swap(&(lock->value), value, value + (1 << 16)))
+		return false;
+
+#if SPINLOCK_STATS
+	stats_account(&(lock->stats), 0);
+#endif
+
+	return true;
+}
+
+/**
+ * @brief      Release a spinlock to the next ticket in line
+ *
+ * @param      lock  The lock
+ */
+void spin_unlock(spinlock_t *lock)
+{
+	__atomic_fetch_add(&(lock->tickets.owner), 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief      Disable interrupts on this CPU, then take a spinlock
+ *
+ * @param      lock  The lock
+ */
+void spin_lock_irqsave(spinlock_t *lock)
+{
+	irq_disable();
+	spin_lock(lock);
+}
+
+/**
+ * @brief      Release a spinlock taken with spin_lock_irqsave(), then restore interrupts
+ *
+ * @param      lock  The lock
+ */
+void spin_unlock_irqrestore(spinlock_t *lock)
+{
+	spin_unlock(lock);
+	irq_resume();
+}
+
+/**
+ * @brief      Initialize an unlocked reader-writer lock
+ *
+ * @param      lock  The lock
+ * @param[in]  name  Name shown in the contention statistics
+ */
+void rwlock_init(rwlock_t *lock, const char *name)
+{
+	lock->value = 0;
+
+#if SPINLOCK_STATS
+	lock->stats = (struct spinlock_stats){.name = name};
+#else
+	(void)name;
+#endif
+}
+
+/**
+ * @brief      Take a reader-writer lock for reading, spinning while a writer holds or waits for it
+ *
+ * @param      lock  The lock
+ */
+void read_lock(rwlock_t *lock)
+{
+	uint32_t value, spins;
+
+	spins = 0;
+	while(1) {
+		value = lock->value;
+		if(!(value & (RWLOCK_WRITER | RWLOCK_WRITER_WAITING)) &&
+			__sync_bool_compare_and_swap(&(lock->value), value, value + 1))
+			break;
+
+		asm volatile("pause");
+		spins++;
+	}
+
+#if SPINLOCK_STATS
+	stats_account(&(lock->stats), spins);
+#endif
+}
+
+/**
+ * @brief      Release a reader-writer lock taken for reading
+ *
+ * @param      lock  The lock
+ */
+void read_unlock(rwlock_t *lock)
+{
+	__sync_fetch_and_sub(&(lock->value), 1);
+}
+
+/**
+ * @brief      Take a reader-writer lock for writing, spinning until every reader left
+ *
+ * @param      lock  The lock
+ */
+void write_lock(rwlock_t *lock)
+{
+	uint32_t value, spins;
+
+	spins = 0;
+	while(1) {
+		value = lock->value;
+
+		// No readers or writer, take it (clearing the waiting bit, other writers set it again)
+		if((value & ~RWLOCK_WRITER_WAITING) == 0) {
+			if(__sync_bool_compare_and_swap(&(lock->value), value, RWLOCK_WRITER))
+				break;
+			continue;
+		}
+
+		// Keep new readers out meanwhile
+		if(!(value & RWLOCK_WRITER_WAITING))
+			__sync_fetch_and_or(&(lock->value), RWLOCK_WRITER_WAITING);
+
+		asm volatile("pause");
+		spins++;
+	}
+
+#if SPINLOCK_STATS
+	stats_account(&(lock->stats), spins);
+#endif
+}
+
+/**
+ * @brief      Release a reader-writer lock taken for writing
+ *
+ * @param      lock  The lock
+ */
+void write_unlock(rwlock_t *lock)
+{
+	// Leaves the waiting bit of other writers alone
+	__sync_fetch_and_and(&(lock->value), ~RWLOCK_WRITER);
+}
+
+/**
+ * @brief      Disable interrupts on this CPU, then take a reader-writer lock for reading
+ *
+ * @param      lock  The lock
+ */
+void read_lock_irqsave(rwlock_t *lock)
+{
+	irq_disable();
+	read_lock(lock);
+}
+
+/**
+ * @brief      Release a reader-writer lock taken with read_lock_irqsave(), then restore interrupts
+ *
+ * @param      lock  The lock
+ */
+void read_unlock_irqrestore(rwlock_t *lock)
+{
+	read_unlock(lock);
+	irq_resume();
+}
+
+/**
+ * @brief      Disable interrupts on this CPU, then take a reader-writer lock for writing
+ *
+ * @param      lock  The lock
+ */
+void write_lock_irqsave(rwlock_t *lock)
+{
+	irq_disable();
+	write_lock(lock);
+}
+
+/**
+ * @brief      Release a reader-writer lock taken with write_lock_irqsave(), then restore interrupts
+ *
+ * @param      lock  The lock
+ */
+void write_unlock_irqrestore(rwlock_t *lock)
+{
+	write_unlock(lock);
+	irq_resume();
+}
+
+/**
+ * @brief      Print the contention statistics of every lock taken so far. Does nothing without SPINLOCK_STATS.
+ */
+void spinlock_dump_stats()
+{
+#if SPINLOCK_STATS
+	struct spinlock_stats *stats;
+
+	kprintf("Lock\t\tAcquired\tContended\tSpins\n");
+
+	for(stats = stats_list; stats; stats = stats->next) {
+		kprintf("%s\t\t%d\t\t%d\t\t%d\n", stats->name ? stats->name : "(unnamed)",
+			stats->acquisitions, stats->contended, stats->spins);
+	}
+#endif
+}
+
+#if SPINLOCK_STATS
+/**
+ * @brief      Count an acquisition of a lock, adding it to the statistics list the first time
+ *
+ * @param      stats  The statistics of the lock
+ * @param[in]  spins  How often the lock was looked at again before it was taken
+ */
+static void stats_account(struct spinlock_stats *stats, uint32_t spins)
+{
+	// Readers hold the lock together, so the counters are updated atomically
+	__sync_fetch_and_add(&(stats->acquisitions), 1);
+	if(spins) {
+		__sync_fetch_and_add(&(stats->contended), 1);
+		__sync_fetch_and_add(&(stats->spins), spins);
+	}
+
+	// Lock free push, the list is never removed from
+	if(stats->registered || !__sync_bool_compare_and_swap(&(stats->registered), 0, 1))
+		return;
+
+	do {
+		stats->next = stats_list;
+	} while(!__sync_bool_compare_and_swap(&stats_list, stats->next, stats));
+}
+#endif
@@ -0,0 +1,136 @@
+#include <deferred.h>
+#include <kprint.h>
+#include <threaded_irq.h>
+#include <i686/irq.h>
+#include <i686/isr.h>
+#include <mm/kmalloc.h>
+#include <multitasking/scheduler.h>
+
+/**
+ * Threaded interrupt handlers
+ *
+ * 	A threaded handler runs in a kernel thread of its own, at the priority
+ * 	it was installed with, instead of in interrupt context. The top half
+ * 	only masks the line, acknowledges the controller and wakes the thread,
+ * 	so a slow device (the disk) no longer holds up the timer or other
+ * 	interrupts. The line stays masked until the handler is done, level
+ * 	triggered devices can not raise it again meanwhile.
+ *
+ * 	If the thread outranks the interrupted process it is switched to right
+ * 	away rather than on the next timer tick, so latency critical handlers
+ * 	preempt bulk work.
+ *
+ * 	MSIs can not be masked at the controller, raising one again while the
+ * 	handler runs just makes the thread run it once more.
+ *
+ * 	pending and masked are protected by the lock of the wait queue, the top
+ * 	half and the thread may run on different CPUs.
+ */
+
+static struct threaded_irq *threaded_irqs[MAX_ISR_NUMBER];
+
+static void top_half(struct isr_arguments *args);
+static void irq_thread(void *data);
+
+/**
+ * @brief      Install an interrupt handler that runs in a kernel thread. process_init() must have been called.
+ *
+ * @param[in]  interrupt_number  The interrupt number to attach to
+ * @param[in]  handler           The handler, called with interrupts enabled and may block
+ * @param      data              Passed to the handler
+ * @param[in]  priority          Scheduler priority of the handler thread
+ *
+ * @return     True if installed, False if the thread could not be created
+ */
+bool install_threaded_interrupt_handler(uint8_t interrupt_number, void (*handler)(void *data), void *data,
+	priority_t priority)
+{
+	struct threaded_irq *irq;
+
+	if(threaded_irqs[interrupt_number]) {
+		kprintf(KPRINT_ERROR "Interrupt %d already has a threaded handler\n", interrupt_number);
+		return false;
+	}
+
+	irq = kmalloc(sizeof(struct threaded_irq));
+	if(irq == NULL)
+		goto fail;
+
+	irq->vector  = interrupt_number;
+	irq->handler = handler;
+	irq->data    = data;
+	irq->pending = false;
+	irq->masked  = false;
+	wait_queue_init(&irq->wait);
+
+	irq->thread = process_create_kernel_thread(irq_thread, irq, priority, CPU_MASK_ALL);
+	if(irq->thread == NULL)
+		goto fail_thread;
+
+	irq_disable();
+	threaded_irqs[interrupt_number] = irq;
+	install_interrupt_handler(interrupt_number, top_half);
+	irq_resume();
+
+	return true;
+
+fail_thread:
+	kfree(irq);
+fail:
+	kprintf(KPRINT_ERROR "Could not install threaded handler for interrupt %d\n", interrupt_number);
+	return false;
+}
+
+/**
+ * @brief      Mask and acknowledge the interrupt, then hand it to the thread
+ *
+ * @param      args  The interrupt arguments
+ */
+static void top_half(struct isr_arguments *args)
+{
+	struct threaded_irq *irq;
+
+	irq = threaded_irqs[args->interrupt_number];
+
+	wait_queue_lock(&irq->wait);
+	if(!irq->masked)
+		irq->masked = irq_mask_vector(irq->vector);
+	irq->pending = true;
+	wait_queue_unlock(&irq->wait);
+
+	irq_acknowledge(irq->vector);
+	wait_queue_wake_one(&irq->wait);
+
+	// Run the thread now if it outranks the interrupted process (not from within deferred work)
+	if(scheduler_should_preempt() && !deferred_running())
+		process_yield();
+}
+
+/**
+ * @brief      Run the handler each time the interrupt is raised
+ *
+ * @param      data  The threaded interrupt
+ */
+static void irq_thread(void *data)
+{
+	struct threaded_irq *irq;
+
+	irq = data;
+
+	while(1) {
+		wait_queue_lock(&irq->wait);
+		while(!irq->pending)
+			wait_queue_block(&irq->wait);
+		irq->pending = false;
+		wait_queue_unlock(&irq->wait);
+
+		irq->handler(irq->data);
+
+		wait_queue_lock(&irq->wait);
+		if(irq->masked && !irq->pending) {
+			irq->masked = false;
+			irq_unmask_vector(irq->vector);
+		}
+		wait_queue_unlock(&irq->wait);
+	}
+}
@@ -0,0 +1,332 @@
+#include <deferred.h>
+#include <spinlock.h>
+#include <string.h>
+#include <timeout.h>
+#include <timer.h>
+#include <i686/isr.h>
+
+/**
+ * Timeouts
+ *
+ * 	Timeouts are kept in a hierarchical timer wheel. A timeout goes in the
+ * 	lowest level whose range covers its expiry, in the slot for its expiry
+ * 	at that level's granularity, so adding and cancelling are a list insert
+ * 	and unlink no matter how many timeouts exist. Each tick only the level 0
+ * 	slot for that tick is looked at. Whenever level 0 wraps around, one slot
+ * 	of level 1 is cascaded (re-added, landing in level 0), and so on up.
+ *
+ * 	The timer interrupt moves due timeouts to the expired list with
+ * 	interrupts disabled, their callbacks run as deferred work on interrupt exit.
+ * 	The wheel is shared by every CPU and protected by timeout_lock, which is
+ * 	not held while callbacks run.
+ */
+
+#define LEVEL0_MASK (TIMEOUT_LEVEL0_SLOTS - 1)
+#define LEVEL_MASK  (TIMEOUT_LEVEL_SLOTS - 1)
+
+// Bit of the tick count where a level's slot index starts
+#define LEVEL_SHIFT(level) (TIMEOUT_LEVEL0_BITS + ((level) - 1) * TIMEOUT_LEVEL_BITS)
+
+static struct timeout *level0[TIMEOUT_LEVEL0_SLOTS];
+static struct timeout *levels[TIMEOUT_LEVELS - 1][TIMEOUT_LEVEL_SLOTS];
+
+static struct timeout *expired_list;
+
+// Next tick to process
+static uint32_t wheel_ticks;
+
+static uint32_t number_pending;
+
+static struct deferred_work expired_work;
+
+static spinlock_t timeout_lock = SPINLOCK_INITIALIZER("timeout");
+
+static void list_add(struct timeout **list, struct timeout *timeout);
+static void list_remove(struct timeout *timeout);
+static void wheel_add(struct timeout *timeout);
+static uint32_t cascade(uint32_t level);
+static void run_expired(void *data);
+
+/**
+ * @brief      Initialize the timer wheel
+ */
+void timeout_wheel_init()
+{
+	memset(level0, 0, sizeof(level0));
+	memset(levels, 0, sizeof(levels));
+
+	expired_list   = NULL;
+	wheel_ticks    = timer_get_ticks();
+	number_pending = 0;
+
+	deferred_work_init(&expired_work, run_expired, NULL);
+}
+
+/**
+ * @brief      Initialize a timeout
+ *
+ * @param      timeout   The timeout
+ * @param[in]  callback  The function to call when the timeout expires
+ * @param      data      Passed to the callback
+ */
+void timeout_init(struct timeout *timeout, void (*callback)(void *data), void *data)
+{
+	memset(timeout, 0, sizeof(struct timeout));
+
+	timeout->callback = callback;
+	timeout->data     = data;
+}
+
+/**
+ * @brief      Run a timeout after a number of ticks. Replaces the expiry if already pending.
+ *
+ * @param      timeout  The timeout
+ * @param[in]  ticks    The number of ticks from now
+ */
+void timeout_add(struct timeout *timeout, uint32_t ticks)
+{
+	uint32_t now;
+
+	now = timer_get_ticks();
+
+	spin_lock_irqsave(&timeout_lock);
+
+	// Wheel stopped advancing while empty, catch up so the expiry lands in the right slot
+	if(number_pending == 0 && (int32_t)(now - wheel_ticks) > 0)
+		wheel_ticks = now;
+
+	if(timeout->list)
+		list_remove(timeout);
+	else
+		number_pending++;
+
+	timeout->expires = now + ticks;
+	wheel_add(timeout);
+
+	spin_unlock_irqrestore(&timeout_lock);
+
+	// Timer may need to fire sooner, looks at the wheel so not with the lock held
+	timer_rearm();
+}
+
+/**
+ * @brief      Cancel a pending timeout
+ *
+ * @param      timeout  The timeout
+ *
+ * @return     True if the timeout was pending, False if it already ran or was never added
+ */
+bool timeout_cancel(struct timeout *timeout)
+{
+	bool pending;
+
+	spin_lock_irqsave(&timeout_lock);
+
+	pending = timeout->list != NULL;
+	if(pending) {
+		list_remove(timeout);
+		number_pending--;
+	}
+
+	spin_unlock_irqrestore(&timeout_lock);
+	return pending;
+}
+
+/**
+ * @brief      Check if a timeout is waiting to run
+ *
+ * @param      timeout  The timeout
+ *
+ * @return     True if pending, False if not
+ */
+bool timeout_pending(struct timeout *timeout)
+{
+	return timeout->list != NULL;
+}
+
+/**
+ * @brief      Move every timeout due by now to the expired list. Called from the timer interrupt.
+ *
+ * @param[in]  now   The current tick
+ */
+void timeout_advance(uint32_t now)
+{
+	struct timeout *timeout;
+	uint32_t index;
+
+	spin_lock_irqsave(&timeout_lock);
+
+	// Nothing to cascade or expire, skip the ticks the timer was stopped for
+	if(number_pending == 0) {
+		wheel_ticks = now + 1;
+		spin_unlock_irqrestore(&timeout_lock);
+		return;
+	}
+
+	while((int32_t)(now - wheel_ticks) >= 0) {
+		index = wheel_ticks & LEVEL0_MASK;
+
+		// Level 0 wrapped around, refill it from the levels above
+		if(index == 0) {
+			for(uint32_t level = 1; level < TIMEOUT_LEVELS; level++) {
+				if(cascade(level) != 0)
+					break;
+			}
+		}
+
+		while((timeout = level0[index])) {
+			list_remove(timeout);
+			list_add(&expired_list, timeout);
+		}
+
+		wheel_ticks++;
+	}
+
+	if(expired_list)
+		deferred_queue(&expired_work);
+
+	spin_unlock_irqrestore(&timeout_lock);
+}
+
+/**
+ * @brief      Get the number of ticks until the timer wheel needs to be advanced. Used by tickless mode.
+ *
+ * @param[in]  now    The current tick
+ * @param      ticks  Set to the number of ticks from now
+ *
+ * @return     True if any timeout is pending, False if not
+ */
+bool timeout_next_event(uint32_t now, uint32_t *ticks)
+{
+	uint32_t tick;
+
+	spin_lock_irqsave(&timeout_lock);
+
+	if(number_pending == 0) {
+		spin_unlock_irqrestore(&timeout_lock);
+		return false;
+	}
+
+	// First non-empty level 0 slot, or the next cascade (which may fill one)
+	tick = wheel_ticks;
+	for(uint32_t i = 0; i < TIMEOUT_LEVEL0_SLOTS; i++, tick++) {
+		if(level0[tick & LEVEL0_MASK] || (i && (tick & LEVEL0_MASK) == 0))
+			break;
+	}
+
+	spin_unlock_irqrestore(&timeout_lock);
+
+	*ticks = ((int32_t)(tick - now) > 0) ? tick - now : 1;
+	return true;
+}
+
+/**
+ * @brief      Put a timeout in the wheel slot for its expiry. timeout_lock must be held.
+ *
+ * @param      timeout  The timeout
+ */
+static void wheel_add(struct timeout *timeout)
+{
+	uint32_t delta, expires;
+
+	expires = timeout->expires;
+	delta   = expires - wheel_ticks;
+
+	if((int32_t)delta < 0) {
+		// Already due, run on the next processed tick
+		list_add(&(level0[wheel_ticks & LEVEL0_MASK]), timeout);
+	} else if(delta < TIMEOUT_LEVEL0_SLOTS) {
+		list_add(&(level0[expires & LEVEL0_MASK]), timeout);
+	} else {
+		for(uint32_t level = 1; level < TIMEOUT_LEVELS; level++) {
+			if(level == TIMEOUT_LEVELS - 1 || delta < (1u << (LEVEL_SHIFT(level) + TIMEOUT_LEVEL_BITS))) {
+				list_add(&(levels[level - 1][(expires >> LEVEL_SHIFT(level)) & LEVEL_MASK]), timeout);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * @brief      Run the callbacks of expired timeouts. Deferred work queued by timeout_advance().
+ *
+ * @param      data  Unused
+ */
+static void run_expired(void *data)
+{
+	struct timeout *timeout;
+
+	(void)data;
+
+	spin_lock_irqsave(&timeout_lock);
+
+	while((timeout = expired_list)) {
+		list_remove(timeout);
+		number_pending--;
+
+		spin_unlock_irqrestore(&timeout_lock);
+		timeout->callback(timeout->data);
+		spin_lock_irqsave(&timeout_lock);
+	}
+
+	spin_unlock_irqrestore(&timeout_lock);
+}
+
+/**
+ * @brief      Re-add every timeout in the current slot of a level, moving them to lower levels
+ *
+ * @param[in]  level  The level (1 or above)
+ *
+ * @return     The slot index that was cascaded. 0 means the next level also needs to cascade.
+ */
+static uint32_t cascade(uint32_t level)
+{
+	struct timeout *timeout;
+	uint32_t index;
+
+	index = (wheel_ticks >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+
+	while((timeout = levels[level - 1][index])) {
+		list_remove(timeout);
+		wheel_add(timeout);
+	}
+
+	return index;
+}
+
+/**
+ * @brief      Add a timeout to the front of a list
+ *
+ * @param      list     The list
+ * @param      timeout  The timeout
+ */
+static void list_add(struct timeout **list, struct timeout *timeout)
+{
+	timeout->prev = NULL;
+	timeout->next = *list;
+	if(*list)
+		(*list)->prev = timeout;
+
+	*list = timeout;
+	timeout->list = list;
+}
+
+/**
+ * @brief      Remove a timeout from the list it is in
+ *
+ * @param      timeout  The timeout
+ */
+static void list_remove(struct timeout *timeout)
+{
+	if(timeout->prev)
+		timeout->prev->next = timeout->next;
+	else
+		*(timeout->list) = timeout->next;
+
+	if(timeout->next)
+		timeout->next->prev = timeout->prev;
+
+	timeout->next = NULL;
+	timeout->prev = NULL;
+	timeout->list = NULL;
+}
@@ -1,35 +1,164 @@
+#include <clocksource.h>
+#include <deferred.h>
+#include <kprint.h>
 #include <timer.h>
 #include <portio.h>
-#include <i686/pic.h>
+#include <timeout.h>
+#include <i686/apic.h>
+#include <i686/descriptor_tables.h>
+#include <i686/math64.h>
+#include <i686/irq.h>
+#include <i686/smp.h>
 #include <multitasking/process.h>
+#include <multitasking/scheduler.h>
 
 /**
- * @brief      Initialize the PIT timer
+ * Timer
  *
- * @param[in]  frequency  The frequency to trigger the timer on in HZ
+ * 	Interrupts come from an event source: the local APIC timer when there is
+ * 	one (and the TSC is the clocksource), otherwise the PIT. Ticks are not
+ * 	counted interrupts, they are read from the clocksource, so they stay
+ * 	correct no matter how often the event source fires.
+ *
+ * 	Tickless mode
+ *
+ * 	Instead of interrupting every tick, the event source is used as a one-shot
+ * 	and programmed for the next event: the end of the running timeslice, the
+ * 	next sleeper to wake or the next timeout wheel slot to process. With
+ * 	nothing to wait for it is stopped entirely. The PIT clocksource only
+ * 	advances while the PIT runs, so in that case the PIT is programmed for
+ * 	its longest period instead of being stopped.
+ *
+ * 	With more than one CPU each runs its own local APIC timer, programmed
+ * 	for the events of its own run queue. Sleepers and timeouts are shared,
+ * 	whichever CPU gets there first handles them.
+ */
+
+static uint32_t timer_frequency;
+static uint32_t tick_ns;
+
+// Ticks already accounted to the scheduler, by CPU
+static uint32_t scheduler_ticks[SMP_MAX_CPUS];
+
+static struct timer_event_source *event_source;
+static bool timer_started;
+
+// PIT input clock counts per tick
+static uint32_t pit_divisor;
+
+// Counts programmed into the running one-shot, 0 when stopped or periodic
+static uint32_t pit_oneshot_counts;
+static bool pit_periodic;
+
+// Every PIT input clock count accounted since timer_init()
+static uint64_t pit_counts;
+
+// Converts nanoseconds to PIT input clock counts: (ns * pit_ns_to_counts_mult) >> 32
+static uint32_t pit_ns_to_counts_mult;
+
+static uint32_t read_ticks(uint32_t *tick_offset);
+
+static void pit_set_periodic(uint32_t frequency);
+static void pit_set_oneshot(uint64_t ns);
+static void pit_stop();
+static void pit_acknowledge();
+static void pit_program(uint8_t command, uint32_t counts);
+static uint16_t pit_read_count();
+static bool pit_expired();
+static void pit_account();
+
+static struct timer_event_source pit_event_source = {
+	.name             = "pit",
+	.interrupt_number = IRQ0,
+	.set_periodic     = pit_set_periodic,
+	.set_oneshot      = pit_set_oneshot,
+	.stop             = pit_stop,
+	.acknowledge      = pit_acknowledge,
+};
+
+/**
+ * @brief      Initialize the timer and pick the event source. clocksource_init() must have been called.
+ *
+ * @param[in]  frequency  The frequency of a tick in HZ
  */
 void timer_init(uint32_t frequency)
 {
-	uint32_t divisor;
-	uint8_t l, h;
+	struct timer_event_source *apic_source;
+	uint32_t ticks;
 
 	// The value we send to the PIT is the value to divide it's input clock
 	// (1193180 Hz) by, to get our required frequency. Important to note is
 	// that the divisor must be small enough to fit into 16-bits.
-	divisor = 1193180 / frequency;
+	pit_divisor = PIT_FREQUENCY / frequency;
+
+	pit_oneshot_counts = 0;
+	pit_periodic       = false;
+	pit_counts         = 0;
+	timer_started      = false;
 
-	// 0x36 tells timer to repeat when it hits 0
-	out8(PIT_CMD, 0x36);
+	pit_ns_to_counts_mult = (uint32_t)div_u64_u32((uint64_t)PIT_FREQUENCY << 32, NSEC_PER_SEC, NULL);
 
-	l = (uint8_t)(divisor & 0xFF);
-	h = (uint8_t)((divisor >> 8) & 0xFF);
+	timer_frequency = frequency;
+	tick_ns         = NSEC_PER_SEC / frequency;
 
-	// Send the frequency divisor.
-	out8(PIT_CHAN0, l);
-	out8(PIT_CHAN0, h);
+	ticks = read_ticks(NULL);
+	for(uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		scheduler_ticks[cpu] = ticks;
+
+	// The PIT has to keep running when it is the clocksource
+	event_source = &pit_event_source;
+	if(clocksource_get()->continuous) {
+		apic_source = apic_timer_init();
+		if(apic_source)
+			event_source = apic_source;
+	}
+
+	kprintf(KPRINT_DEBUG "Timer Event Source: %s\n", event_source->name);
+}
+
+/**
+ * @brief      Start the timer interrupt which runs scheduling code
+ */
+void timer_start()
+{
+	install_interrupt_handler(event_source->interrupt_number, timer_interrupt_handler);
+
+	if(event_source == &pit_event_source)
+		enable_irq(0);
+
+	timer_started = true;
+
+	if(TIMER_TICKLESS)
+		timer_rearm();
+	else
+		event_source->set_periodic(timer_frequency);
+}
+
+/**
+ * @brief      Start the timer interrupt of an AP. Only possible when timer_per_cpu().
+ */
+void timer_start_cpu()
+{
+	irq_disable();
+
+	scheduler_ticks[cpu_id()] = read_ticks(NULL);
+
+	if(TIMER_TICKLESS)
+		timer_rearm();
+	else
+		event_source->set_periodic(timer_frequency);
+
+	irq_resume();
+}
 
-	// Enable PIT IRQ
-	enable_irq(0);
+/**
+ * @brief      Check if every CPU has a timer interrupt of its own (the local APIC timer)
+ *
+ * @return     True if per CPU, False if only the boot CPU gets timer interrupts (the PIT)
+ */
+bool timer_per_cpu()
+{
+	return event_source != &pit_event_source;
 }
 
 /**
@@ -39,8 +168,256 @@ void timer_init(uint32_t frequency)
  */
 void timer_interrupt_handler(struct isr_arguments *args)
 {
-	// Acknowledge PIC
-	out8(PIC1, PIC_ACK);
+	uint32_t ticks, elapsed, cpu;
+
+	event_source->acknowledge();
+
+	ticks = read_ticks(NULL);
+
+	cpu = cpu_id();
+	elapsed = ticks - scheduler_ticks[cpu];
+	scheduler_ticks[cpu] = ticks;
+
+	// Sleepers are put back in the run queues before deciding who runs
+	process_wake_sleepers(ticks);
+
+	// Expired callbacks are queued to run on interrupt exit
+	timeout_advance(ticks);
+
+	// Only switch when the timeslice is over or a higher priority is waiting.
+	// Not from an interrupt nested in deferred work, which would stall it.
+	if(scheduler_tick(elapsed) && !deferred_running())
+		process_yield();
+	else
+		timer_rearm();
+}
+
+/**
+ * @brief      Program the next timer interrupt for the next scheduling event, sleeper or timeout.
+ *              Called whenever the scheduler state changes. Does nothing in periodic mode.
+ */
+void timer_rearm()
+{
+	uint32_t now, ticks, wake_tick, timeout_ticks, tick_offset;
+
+	// Nothing is handling the interrupt yet
+	if(!TIMER_TICKLESS || !timer_started)
+		return;
+
+	irq_disable();
+
+	now = read_ticks(&tick_offset);
+
+	ticks = scheduler_ticks_until_preempt();
+
+	if(process_next_wake_tick(&wake_tick)) {
+		if((int32_t)(wake_tick - now) <= 0)
+			wake_tick = now + 1;
+
+		if(ticks == 0 || wake_tick - now < ticks)
+			ticks = wake_tick - now;
+	}
+
+	if(timeout_next_event(now, &timeout_ticks)) {
+		if(ticks == 0 || timeout_ticks < ticks)
+			ticks = timeout_ticks;
+	}
+
+	if(ticks) {
+		// Line up with the tick boundary
+		event_source->set_oneshot((uint64_t)ticks * tick_ns - tick_offset);
+	} else if(clocksource_get()->continuous) {
+		// Nothing to wait for, stop ticking
+		event_source->stop();
+	} else {
+		// Only keeping time, the PIT clamps this to its longest period
+		event_source->set_oneshot(NSEC_PER_SEC);
+	}
+
+	irq_resume();
+}
+
+/**
+ * @brief      Get the number of timer ticks since the timer was initialized
+ *
+ * @return     The number of ticks. Wraps around.
+ */
+uint32_t timer_get_ticks()
+{
+	uint32_t ticks;
+
+	irq_disable();
+	ticks = read_ticks(NULL);
+	irq_resume();
+
+	return ticks;
+}
+
+/**
+ * @brief      Get the number of PIT input clock counts since the timer was initialized.
+ *              Used by the PIT clocksource. Interrupts must be disabled.
+ *
+ * @return     Number of counts, including the running period
+ */
+uint64_t timer_read_counts()
+{
+	uint32_t count;
 
-	process_yield();
-}
\ No newline at end of file
+	if(pit_periodic) {
+		// Rate generator counts down from pit_divisor to 1
+		count = pit_read_count();
+		if(count == 0 || count > pit_divisor)
+			return pit_counts;
+
+		return pit_counts + (pit_divisor - count);
+	}
+
+	if(pit_oneshot_counts == 0)
+		return pit_counts;
+
+	if(pit_expired())
+		return pit_counts + pit_oneshot_counts;
+
+	count = pit_read_count();
+	if(count > pit_oneshot_counts)
+		return pit_counts + pit_oneshot_counts;
+
+	return pit_counts + (pit_oneshot_counts - count);
+}
+
+/**
+ * @brief      Get the frequency of the timer
+ *
+ * @return     Frequency in HZ (ticks per second)
+ */
+uint32_t timer_get_frequency()
+{
+	return timer_frequency;
+}
+
+/**
+ * @brief      Read the tick count from the clocksource. Not cached, a CPU storing an older
+ *              reading would move it backwards for the others. Interrupts must be disabled.
+ *
+ * @param      tick_offset  Set to the nanoseconds into the current tick, can be NULL
+ *
+ * @return     Number of ticks since the clocksource was initialized. Wraps around.
+ */
+static uint32_t read_ticks(uint32_t *tick_offset)
+{
+	return (uint32_t)div_u64_u32(clocksource_read_ns(), tick_ns, tick_offset);
+}
+
+/**
+ * @brief      Interrupt at a fixed frequency
+ *
+ * @param[in]  frequency  The frequency in HZ
+ */
+static void pit_set_periodic(uint32_t frequency)
+{
+	pit_account();
+
+	pit_divisor = PIT_FREQUENCY / frequency;
+	pit_program(PIT_MODE_PERIODIC, pit_divisor);
+	pit_periodic = true;
+}
+
+/**
+ * @brief      Interrupt once after a delay. Replaces any pending one-shot.
+ *
+ * @param[in]  ns    The delay in nanoseconds, longer delays fire after the longest PIT period
+ */
+static void pit_set_oneshot(uint64_t ns)
+{
+	uint64_t counts;
+
+	// Bank the time that passed on the one-shot being replaced
+	pit_account();
+
+	counts = mul_u64_u32_shr(ns, pit_ns_to_counts_mult, 32);
+	counts = MAX(MIN(counts, PIT_MAX_COUNTS), 1);
+
+	pit_program(PIT_MODE_ONESHOT, (uint32_t)counts);
+	pit_oneshot_counts = (uint32_t)counts;
+}
+
+/**
+ * @brief      Stop the PIT
+ */
+static void pit_stop()
+{
+	pit_account();
+	pit_program(PIT_MODE_ONESHOT, 0);
+}
+
+/**
+ * @brief      Acknowledge a PIT interrupt
+ */
+static void pit_acknowledge()
+{
+	irq_acknowledge(IRQ0);
+
+	if(pit_periodic)
+		pit_counts += pit_divisor;
+	else
+		pit_account();
+}
+
+/**
+ * @brief      Program PIT channel 0
+ *
+ * @param[in]  command  The mode command (PIT_MODE_*)
+ * @param[in]  counts   The number of input clock counts. 0 only writes the command, which stops a one-shot.
+ */
+static void pit_program(uint8_t command, uint32_t counts)
+{
+	out8(PIT_CMD, command);
+
+	if(counts == 0)
+		return;
+
+	out8(PIT_CHAN0, (uint8_t)(counts & 0xFF));
+	out8(PIT_CHAN0, (uint8_t)((counts >> 8) & 0xFF));
+}
+
+/**
+ * @brief      Read the current count of PIT channel 0
+ *
+ * @return     The current count
+ */
+static uint16_t pit_read_count()
+{
+	uint8_t l, h;
+
+	// Latch command for channel 0
+	out8(PIT_CMD, 0x00);
+
+	l = in8(PIT_CHAN0);
+	h = in8(PIT_CHAN0);
+
+	return ((uint16_t)h << 8) | l;
+}
+
+/**
+ * @brief      Check if the PIT channel 0 one-shot expired
+ *
+ * @return     True if expired, False if still counting
+ */
+static bool pit_expired()
+{
+	// Read-back status of channel 0, OUT goes high once the one-shot expired
+	out8(PIT_CMD, 0xE2);
+	return (in8(PIT_CHAN0) & 0x80) != 0;
+}
+
+/**
+ * @brief      Account the time elapsed on the running one-shot or period. Interrupts must be disabled.
+ *              Nothing more is accounted until the PIT is programmed again.
+ */
+static void pit_account()
+{
+	pit_counts = timer_read_counts();
+
+	pit_oneshot_counts = 0;
+	pit_periodic       = false;
+}
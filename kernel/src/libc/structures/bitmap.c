@@ -49,7 +49,7 @@ char bitmap_get(void *bitmap, size_t size, size_t index)
 	size = bitmap_determine_size(size);
 
 	map = bitmap;
-	element = index / BITMAP_BITS_PER_INT;
+	element = index / (BITMAP_BITS_PER_INT+1);
 	bit = BITMAP_BITS_PER_INT - (index & BITMAP_BITS_PER_INT);
 
 	if(element >= size) {
@@ -111,7 +111,7 @@ void *bitmap_clear(void *bitmap, size_t size, size_t index)
 	size = bitmap_determine_size(size);
 
 	map = bitmap;
-	element = index / BITMAP_BITS_PER_INT;
+	element = index / (BITMAP_BITS_PER_INT+1);
 	bit = BITMAP_BITS_PER_INT - (index & BITMAP_BITS_PER_INT);
 
 	if(element >= size) {
@@ -0,0 +1,386 @@
+#include <structures/rbtree.h>
+
+/**
+ * Red-black tree
+ *
+ * 	Intrusive, the nodes are embedded in the structures being sorted so
+ * 	inserting and removing never allocate. Nodes that compare equal are
+ * 	kept in insertion order. The leftmost node is cached, so the smallest
+ * 	is found without walking the tree.
+ */
+
+static void insert_fixup(struct rb_tree *tree, struct rb_node *node);
+static void remove_fixup(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent);
+static void rotate_left(struct rb_tree *tree, struct rb_node *node);
+static void rotate_right(struct rb_tree *tree, struct rb_node *node);
+static void replace_child(struct rb_tree *tree, struct rb_node *parent, struct rb_node *old, struct rb_node *new);
+
+static inline bool is_red(struct rb_node *node)
+{
+	return node && node->red;
+}
+
+/**
+ * @brief      Initialize an empty tree
+ *
+ * @param      tree  The tree
+ */
+void rb_init(struct rb_tree *tree)
+{
+	tree->root     = NULL;
+	tree->leftmost = NULL;
+}
+
+/**
+ * @brief      Insert a node, after any nodes it compares equal to
+ *
+ * @param      tree  The tree
+ * @param      node  The node, not in any tree
+ * @param[in]  less  The ordering of the tree
+ */
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less)
+{
+	struct rb_node **link, *parent;
+	bool leftmost;
+
+	link     = &(tree->root);
+	parent   = NULL;
+	leftmost = true;
+
+	while(*link) {
+		parent = *link;
+
+		if(less(node, parent)) {
+			link = &(parent->left);
+		} else {
+			link     = &(parent->right);
+			leftmost = false;
+		}
+	}
+
+	node->parent = parent;
+	node->left   = NULL;
+	node->right  = NULL;
+	node->red    = true;
+	*link = node;
+
+	if(leftmost)
+		tree->leftmost = node;
+
+	insert_fixup(tree, node);
+}
+
+/**
+ * @brief      Remove a node from its tree
+ *
+ * @param      tree  The tree
+ * @param      node  The node, in that tree
+ */
+void rb_remove(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *child, *parent, *successor;
+	bool red;
+
+	if(tree->leftmost == node)
+		tree->leftmost = rb_next(node);
+
+	if(node->left && node->right) {
+		// Smallest node on the right takes its place, it has no left child
+		successor = node->right;
+		while(successor->left)
+			successor = successor->left;
+
+		child = successor->right;
+		red   = successor->red;
+
+		if(successor->parent == node) {
+			parent = successor;
+		} else {
+			parent = successor->parent;
+			parent->left = child;
+			if(child)
+				child->parent = parent;
+
+			successor->right    = node->right;
+			node->right->parent = successor;
+		}
+
+		successor->left    = node->left;
+		node->left->parent = successor;
+
+		successor->parent = node->parent;
+		successor->red    = node->red;
+		replace_child(tree, node->parent, node, successor);
+	} else {
+		child  = node->left ? node->left : node->right;
+		parent = node->parent;
+		red    = node->red;
+
+		if(child)
+			child->parent = parent;
+		replace_child(tree, parent, node, child);
+	}
+
+	// A black node left its path short by one
+	if(!red)
+		remove_fixup(tree, child, parent);
+}
+
+/**
+ * @brief      Get the largest node of a tree
+ *
+ * @param      tree  The tree
+ *
+ * @return     The node, NULL if the tree is empty
+ */
+struct rb_node *rb_last(struct rb_tree *tree)
+{
+	struct rb_node *node;
+
+	node = tree->root;
+	if(node == NULL)
+		return NULL;
+
+	while(node->right)
+		node = node->right;
+
+	return node;
+}
+
+/**
+ * @brief      Get the next node in order
+ *
+ * @param      node  The node
+ *
+ * @return     The next node, NULL if it is the largest
+ */
+struct rb_node *rb_next(struct rb_node *node)
+{
+	if(node->right) {
+		node = node->right;
+		while(node->left)
+			node = node->left;
+		return node;
+	}
+
+	while(node->parent && node == node->parent->right)
+		node = node->parent;
+
+	return node->parent;
+}
+
+/**
+ * @brief      Get the previous node in order
+ *
+ * @param      node  The node
+ *
+ * @return     The previous node, NULL if it is the smallest
+ */
+struct rb_node *rb_prev(struct rb_node *node)
+{
+	if(node->left) {
+		node = node->left;
+		while(node->right)
+			node = node->right;
+		return node;
+	}
+
+	while(node->parent && node == node->parent->left)
+		node = node->parent;
+
+	return node->parent;
+}
+
+/**
+ * @brief      Restore the red-black properties after inserting a red node
+ *
+ * @param      tree  The tree
+ * @param      node  The node inserted
+ */
+static void insert_fixup(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *parent, *grandparent, *uncle;
+
+	// Root is black, so a red parent always has a parent
+	while((parent = node->parent) && parent->red) {
+		grandparent = parent->parent;
+
+		if(parent == grandparent->left) {
+			uncle = grandparent->right;
+
+			if(is_red(uncle)) {
+				// Push the red up, and look again from there
+				parent->red      = false;
+				uncle->red       = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->right) {
+				rotate_left(tree, parent);
+				node   = parent;
+				parent = node->parent;
+			}
+
+			parent->red      = false;
+			grandparent->red = true;
+			rotate_right(tree, grandparent);
+		} else {
+			uncle = grandparent->left;
+
+			if(is_red(uncle)) {
+				parent->red      = false;
+				uncle->red       = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->left) {
+				rotate_right(tree, parent);
+				node   = parent;
+				parent = node->parent;
+			}
+
+			parent->red      = false;
+			grandparent->red = true;
+			rotate_left(tree, grandparent);
+		}
+	}
+
+	tree->root->red = false;
+}
+
+/**
+ * @brief      Restore the red-black properties after removing a black node
+ *
+ * @param      tree    The tree
+ * @param      node    The node that took its place, can be NULL
+ * @param      parent  The parent of that node
+ */
+static void remove_fixup(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent)
+{
+	struct rb_node *sibling;
+
+	// The path through node is one black short, its sibling exists as its path is not
+	while(node != tree->root && !is_red(node)) {
+		if(node == parent->left) {
+			sibling = parent->right;
+
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red  = true;
+				rotate_left(tree, parent);
+				sibling = parent->right;
+			}
+
+			if(!is_red(sibling->left) && !is_red(sibling->right)) {
+				// Shorten the sibling's path too, and look again from the parent
+				sibling->red = true;
+				node   = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if(!is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red       = true;
+				rotate_right(tree, sibling);
+				sibling = parent->right;
+			}
+
+			sibling->red        = parent->red;
+			parent->red         = false;
+			sibling->right->red = false;
+			rotate_left(tree, parent);
+		} else {
+			sibling = parent->left;
+
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red  = true;
+				rotate_right(tree, parent);
+				sibling = parent->left;
+			}
+
+			if(!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node   = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if(!is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red        = true;
+				rotate_left(tree, sibling);
+				sibling = parent->left;
+			}
+
+			sibling->red       = parent->red;
+			parent->red        = false;
+			sibling->left->red = false;
+			rotate_right(tree, parent);
+		}
+
+		node = tree->root;
+		break;
+	}
+
+	if(node)
+		node->red = false;
+}
+
+/**
+ * @brief      Rotate a node down to the left, its right child takes its place
+ */
+static void rotate_left(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *right;
+
+	right = node->right;
+
+	node->right = right->left;
+	if(right->left)
+		right->left->parent = node;
+
+	right->parent = node->parent;
+	replace_child(tree, node->parent, node, right);
+
+	right->left  = node;
+	node->parent = right;
+}
+
+/**
+ * @brief      Rotate a node down to the right, its left child takes its place
+ */
+static void rotate_right(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *left;
+
+	left = node->left;
+
+	node->left = left->right;
+	if(left->right)
+		left->right->parent = node;
+
+	left->parent = node->parent;
+	replace_child(tree, node->parent, node, left);
+
+	left->right  = node;
+	node->parent = left;
+}
+
+/**
+ * @brief      Point the parent of a node (or the root) at another node
+ */
+static void replace_child(struct rb_tree *tree, struct rb_node *parent, struct rb_node *old, struct rb_node *new)
+{
+	if(parent == NULL)
+		tree->root = new;
+	else if(parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}